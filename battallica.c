@@ -31,6 +31,19 @@
 #include <sys/stat.h>
 #include <gdk/gdkkeysyms.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/soundcard.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 #define MAX_PLAYER_VX (10)
@@ -38,10 +51,13 @@
 
 #define SCREEN_WIDTH 800        /* window width, in pixels */
 #define SCREEN_HEIGHT 600       /* window height, in pixels */
-#define MAXOBJS 8500  		/* max objects in the game */
+#define DEFAULT_MAX_OBJECTS (1 << 20)	/* default max objects in the game, see --max-objects */
 #define NANGLES 128 
 
 #define OBJ_TYPE_PLAYER 'p'
+#define OBJ_TYPE_BATTALION 'b'
+#define OBJ_TYPE_SOLDIER 's'
+#define OBJ_TYPE_ENEMY 'e'
 
 /* special values to do with drawing shapes. */
 #define LINE_BREAK (-9999)
@@ -89,25 +105,248 @@ struct my_point_t player_points[] = {
 	{ 0, -50 },
 };
 
+struct my_point_t soldier_points[] = {
+	{ 0, -6 },
+	{ 4, 0 },
+	{ 0, 6 },
+	{ -4, 0 },
+	{ 0, -6 },
+};
+
+struct my_point_t enemy_points[] = {
+	{ -10, -8 },
+	{ 10, -8 },
+	{ 10, 8 },
+	{ -10, 8 },
+	{ -10, -8 },
+	{ 0, -8 },
+	{ 0, -18 },
+};
+
+/* a battalion's flag */
+struct my_point_t flag_points[] = {
+	{ 0, 0 },
+	{ 0, -30 },
+	{ 15, -25 },
+	{ 0, -20 },
+};
+
 
 /* Just a grouping of arrays of points with the number of points in the array */
 struct my_vect_obj {
 	int npoints;
 	struct my_point_t *p;	
+	int nframes;			/* p holds nframes * npoints points, e.g. rotations */
+	short minx, miny, maxx, maxy;	/* bounding box, over all frames */
 };
 
 /* contains instructions on how to draw all the objects */
 struct my_vect_obj player_vect;
+struct my_vect_obj soldier_vect;
+struct my_vect_obj flag_vect;
+struct my_vect_obj enemy_vect;
 
 #define INIT_VECT(x, y) \
 	x.p = y; \
-	x.npoints = NPOINTS(y)
+	x.npoints = NPOINTS(y); \
+	x.nframes = 1; \
+	calc_vect_bbox(&x)
+
+/* figure the bounding box of a vect, skipping line breaks and color changes. */
+/* Needs to be called again if p or nframes changes. */
+void calc_vect_bbox(struct my_vect_obj *v)
+{
+	int i;
+	int first = 1;
+
+	v->minx = v->miny = v->maxx = v->maxy = 0;
+	for (i = 0; i < v->npoints * v->nframes; i++) {
+		if (v->p[i].x == LINE_BREAK || v->p[i].x == COLOR_CHANGE)
+			continue;
+		if (first || v->p[i].x < v->minx)
+			v->minx = v->p[i].x;
+		if (first || v->p[i].x > v->maxx)
+			v->maxx = v->p[i].x;
+		if (first || v->p[i].y < v->miny)
+			v->miny = v->p[i].y;
+		if (first || v->p[i].y > v->maxy)
+			v->maxy = v->p[i].y;
+		first = 0;
+	}
+}
 	
 void init_vects()
 {
 	INIT_VECT(player_vect, player_points);
+	INIT_VECT(soldier_vect, soldier_points);
+	INIT_VECT(flag_vect, flag_points);
+	INIT_VECT(enemy_vect, enemy_points);
+}
+
+/*****************************/
+/* memory code begins        */
+
+/* The game allocates through game_malloc() and game_realloc(), which */
+/* count calls and bytes for each subsystem (ALLOC_*), printed at quit. */
+/* Things which only need to last a tick or a frame come from a bump */
+/* arena instead, tick_arena or frame_arena, with arena_new(a, type, n), */
+/* and are never freed one by one: the whole arena is reset at the end */
+/* of each tick (simulate_tick()) or frame (main_da_expose()).  When an */
+/* arena runs out the rest comes from malloc, with a warning, and the */
+/* arena is grown to fit when it's next reset, so once the game has */
+/* settled down a tick makes no heap allocations at all. */
+
+#define ALLOC_OBJECTS 0		/* object arena, types, scheduler */
+#define ALLOC_SIM 1		/* timers, collisions, shots, combat, formations, avoidance */
+#define ALLOC_TERRAIN 2
+#define ALLOC_INFLUENCE 3
+#define ALLOC_AI 4
+#define ALLOC_DRAW 5		/* vects, segment batches, minimap, HUD */
+#define ALLOC_AUDIO 6
+#define ALLOC_CAPTURE 7
+#define ALLOC_NET 8
+#define ALLOC_TRACE 9
+#define ALLOC_ARENA 10		/* the tick and frame arenas, and their overflow */
+#define NALLOC_KINDS 11
+
+static const char *alloc_kind_name[NALLOC_KINDS] = {
+	"objects", "sim", "terrain", "influence", "ai", "draw",
+	"audio", "capture", "net", "trace", "arenas",
+};
+
+struct {
+	long long calls[NALLOC_KINDS];
+	long long bytes[NALLOC_KINDS];
+} alloc_stats;
+
+/* atomic, the trace rings get allocated from the threads which use them */
+void *game_malloc(int kind, size_t n)
+{
+	__sync_fetch_and_add(&alloc_stats.calls[kind], 1);
+	__sync_fetch_and_add(&alloc_stats.bytes[kind], (long long) n);
+	return malloc(n);
+}
+
+void *game_realloc(int kind, void *p, size_t n)
+{
+	__sync_fetch_and_add(&alloc_stats.calls[kind], 1);
+	__sync_fetch_and_add(&alloc_stats.bytes[kind], (long long) n);
+	return realloc(p, n);
+}
+
+#define TICK_ARENA_SIZE (64 * 1024)
+#define FRAME_ARENA_SIZE (256 * 1024)
+#define ARENA_ALIGN 16	/* enough for anything, SSE included */
+
+struct arena {
+	const char *name;
+	unsigned char *base;
+	size_t size, used;
+	size_t spilled;		/* bytes which didn't fit, since the last reset */
+	void **spill;		/* where they went instead */
+	int nspill, spillsize;
+	size_t high_water;	/* most ever wanted between two resets */
+	long long allocs, resets, overflows;
+	int warned;		/* since it last grew */
+};
+
+struct arena tick_arena = { .name = "tick" };
+struct arena frame_arena = { .name = "frame" };
+
+void init_arena(struct arena *a, size_t size)
+{
+	a->base = (unsigned char *) game_malloc(ALLOC_ARENA, size);
+	a->size = size;
+	a->used = 0;
+}
+
+/* the slow path of arena_alloc(), when a is full */
+static void *arena_spill(struct arena *a, size_t n)
+{
+	if (!a->warned) {
+		fprintf(stderr, "battallica: %s arena is full (%lu bytes), "
+			"using malloc until it's next reset\n", a->name, (unsigned long) a->size);
+		a->warned = 1;
+	}
+	if (a->nspill >= a->spillsize) {
+		a->spillsize = a->spillsize ? a->spillsize * 2 : 16;
+		a->spill = (void **) game_realloc(ALLOC_ARENA, a->spill,
+			sizeof(*a->spill) * a->spillsize);
+	}
+	a->overflows++;
+	a->spilled += n;
+	a->spill[a->nspill] = game_malloc(ALLOC_ARENA, n);
+	return a->spill[a->nspill++];
+}
+
+/* n bytes from a, good until a is next reset */
+static inline void *arena_alloc(struct arena *a, size_t n)
+{
+	void *p;
+
+	n = (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	a->allocs++;
+	if (a->used + n > a->size)
+		return arena_spill(a, n);
+	p = a->base + a->used;
+	a->used += n;
+	return p;
+}
+
+#define arena_new(a, type, n) ((type *) arena_alloc((a), sizeof(type) * (n)))
+
+/* throw away everything allocated from a, and if it overflowed, */
+/* make it big enough for that much next time */
+void arena_reset(struct arena *a)
+{
+	size_t wanted = a->used + a->spilled;
+	int i;
+
+	if (wanted > a->high_water)
+		a->high_water = wanted;
+	if (a->nspill) {
+		for (i = 0; i < a->nspill; i++)
+			free(a->spill[i]);
+		a->nspill = 0;
+		if (a->size == 0)
+			a->size = wanted;
+		while (a->size < wanted)
+			a->size *= 2;
+		free(a->base);
+		a->base = (unsigned char *) game_malloc(ALLOC_ARENA, a->size);
+		a->warned = 0;
+	}
+	a->spilled = 0;
+	a->used = 0;
+	a->resets++;
+}
+
+static void print_arena_stats(struct arena *a)
+{
+	if (a->resets == 0)
+		return;
+	printf("  %s arena: %lu KB, high water %lu KB, %.1f allocations per reset, %lld overflowed\n",
+		a->name, (unsigned long) a->size / 1024, (unsigned long) a->high_water / 1024,
+		(double) a->allocs / a->resets, a->overflows);
+}
+
+void print_alloc_stats()
+{
+	int i;
+
+	printf("memory:");
+	for (i = 0; i < NALLOC_KINDS; i++)
+		if (alloc_stats.calls[i])
+			printf(" %s %lld/%lld KB", alloc_kind_name[i], alloc_stats.calls[i],
+				alloc_stats.bytes[i] / 1024);
+	printf(" (allocations/asked for)\n");
+	print_arena_stats(&tick_arena);
+	print_arena_stats(&frame_arena);
 }
 
+/* memory code ends          */
+/*****************************/
+
 /*********************************/
 /* Game object stuff starts here */
 
@@ -117,30 +356,199 @@ typedef void obj_move_func(struct game_obj_t *o);               /* moves and obj
 typedef void obj_draw_func(struct game_obj_t *o, GtkWidget *w); /* draws object, called 1/frame, if onscreen */
 typedef void obj_destroy_func(struct game_obj_t *o);            /* called when an object is killed */
 
+/* Objects refer to each other by handle rather than by pointer.  A */
+/* handle is the object's slot number plus the slot's generation, which */
+/* gets bumped every time the slot is freed, so a handle to an object */
+/* which has died and whose slot got reused just fails to look up, */
+/* instead of quietly pointing at some other object.  See obj_lookup(). */
+typedef unsigned int obj_handle_t;
+#define OBJ_INDEX_BITS 22
+#define OBJ_INDEX_MASK ((1 << OBJ_INDEX_BITS) - 1)
+#define OBJ_GEN_MASK ((1 << (32 - OBJ_INDEX_BITS)) - 1)
+#define NO_OBJ ((obj_handle_t) 0)	/* generation 0 is never used, so this never looks up */
+
 struct game_obj_t {
 	int number; /* offset into go game_object array */
+	unsigned short generation;	/* bumped whenever this slot is freed, never 0 once used */
         obj_move_func *move;
         obj_draw_func *draw;
-        obj_destroy_func *destroy;
 	struct my_vect_obj *v;
         int x, y;                       /* current position, in game coords */
         int vx, vy;                     /* velocity */
-	int bearing;
+	int bearing;			/* which frame of v to draw, for things that rotate */
         int color;                      /* initial color */
         int alive;                      /* alive?  Or dead? */
         int otype;                      /* object type */
-        // union type_specific_data tsd;   /* the Type Specific Data for this object */
-        // struct health_data health;
-        struct game_obj_t *next;        /* These pointers, next, prev, are used to construct the */
-        struct game_obj_t *prev;        /* target list, the list of things which may be hit by other things */
+	int cold;			/* slot in our type's type specific data table, see obj_cold() */
+        obj_handle_t next;              /* These handles, next, prev, are used to construct the */
+        obj_handle_t prev;              /* target list, the list of things which may be hit by other things */
         int ontargetlist;               /* this list keeps of from having to scan the entire object list. */
+	int tile;			/* terrain square we're in (for the minimap), -1 if none yet */
+	GdkRectangle drawn;		/* window area covered when last drawn, for dirty rects */
+	int drawn_bearing;		/* bearing when last drawn */
+};
+
+/* Things which can be hurt keep this at the start of their type specific */
+/* data, see obj_health(). */
+struct health_data {
+	int hp, maxhp;
+	obj_handle_t last_attacker;	/* who hit us last */
+	int hit_time;			/* and when */
+};
+
+/* the points to draw for an object, taking its bearing into account */
+static inline struct my_point_t *obj_points(struct game_obj_t *o)
+{
+	if (o->v->nframes <= 1)
+		return o->v->p;
+	return &o->v->p[(o->bearing % o->v->nframes) * o->v->npoints];
+}
+
+obj_handle_t target_head = NO_OBJ;	/* The target list. */
+
+/* Objects are moved and drawn grouped by type, so that all the objects */
+/* of one type go through the same code back to back, rather than */
+/* hopping between move functions in slot order.  A type may supply */
+/* batch functions which get handed all its objects at once, otherwise */
+/* each object's own move/draw function gets called. */
+typedef void obj_move_batch_func(struct game_obj_t **o, int n);
+typedef void obj_draw_batch_func(struct game_obj_t **o, int n, GtkWidget *w);
+
+/* Each type also has its own limit on how many of it may exist, and */
+/* its own table of type specific (cold) data, so the object header */
+/* which every pass walks over stays small.  Types which aren't */
+/* registered have no limit and no type specific data. */
+struct obj_type_t {
+	char otype;
+	char *name;
+	obj_move_func *think;			/* AI, called by run_ai() when there's time */
+	obj_move_batch_func *steer_batch;	/* if not NULL, called before anything moves */
+	obj_move_batch_func *move_batch;	/* NULL means call o->move for each */
+	obj_draw_batch_func *draw_batch;	/* NULL means call o->draw for each */
+	obj_destroy_func *destroy;		/* NULL means generic_destroy_func */
+	int max;				/* most objects of this type at once */
+	int cold_size;				/* bytes of type specific data per object */
+	int maxhp;				/* > 0 if type specific data starts with struct health_data */
+	int avoid_radius;			/* > 0 to keep this far from others in crowds */
+	int side;				/* 0 for nobody's, else SIDE_PLAYER or SIDE_ENEMY */
+	int influence;				/* how much each one counts on its side's influence map */
+
+	/* the rest is filled in by register_obj_type() */
+	int count;				/* how many exist right now */
+	unsigned char *cold;			/* max * cold_size bytes */
+	int cold_next;				/* slots from here on have never been used */
+	int *cold_free;				/* stack of slots below cold_next given back */
+	int ncold_free;
+};
+
+struct obj_type_t *obj_type[256];	/* indexed by otype */
+
+void register_obj_type(struct obj_type_t *t)
+{
+	t->count = 0;
+	t->cold = NULL;
+	t->cold_free = NULL;
+	t->cold_next = 0;
+	t->ncold_free = 0;
+	if (t->cold_size > 0) {
+		t->cold = (unsigned char *) game_malloc(ALLOC_OBJECTS, t->max * t->cold_size);
+		t->cold_free = (int *) game_malloc(ALLOC_OBJECTS, sizeof(*t->cold_free) * t->max);
+		memset(t->cold, 0, t->max * t->cold_size);
+	}
+	obj_type[(unsigned char) t->otype] = t;
+}
+
+/* What objects and timer events point at goes into a snapshot as its */
+/* index in one of these, see save_sim().  Everything which may be */
+/* pointed at is registered at startup by init_sim_tables(), and */
+/* add_generic_object() and schedule_timer_event() won't take anything */
+/* which isn't, so a missing one shows up when it's first used rather */
+/* than when the game is next saved. */
+#define SIM_TABLE_MAX 32
+
+struct sim_table {
+	const char *what;
+	void *entry[SIM_TABLE_MAX];	/* entry[0] is NULL, for none */
+	int n;
 };
 
-struct game_obj_t *target_head = NULL;	/* The target list. */
+struct sim_table sim_move_funcs = { "move function", { NULL }, 1 };
+struct sim_table sim_draw_funcs = { "draw function", { NULL }, 1 };
+struct sim_table sim_event_funcs = { "timer event function", { NULL }, 1 };
+struct sim_table sim_vects = { "vector shape", { NULL }, 1 };
+
+void sim_register(struct sim_table *t, void *p)
+{
+	if (t->n >= SIM_TABLE_MAX) {
+		fprintf(stderr, "battallica: more than %d of %s to register\n", SIM_TABLE_MAX, t->what);
+		exit(1);
+	}
+	t->entry[t->n++] = p;
+}
+
+/* where p is in t, -1 if it isn't */
+static int sim_lookup(struct sim_table *t, void *p)
+{
+	int i;
+
+	for (i = 0; i < t->n; i++)
+		if (t->entry[i] == p)
+			return i;
+	return -1;
+}
+
+static void sim_require(struct sim_table *t, void *p)
+{
+	if (sim_lookup(t, p) >= 0)
+		return;
+	fprintf(stderr, "battallica: %s %p is used but isn't in init_sim_tables()\n", t->what, p);
+	exit(1);
+}
+
+/* a slot in t's type specific data table, t->count < t->max is assumed */
+static inline int alloc_cold(struct obj_type_t *t)
+{
+	if (t->ncold_free > 0)
+		return t->cold_free[--t->ncold_free];
+	return t->cold_next++;
+}
+
+/* an object's type specific data, NULL if its type has none */
+static inline void *obj_cold(struct game_obj_t *o)
+{
+	struct obj_type_t *t = obj_type[(unsigned char) o->otype];
+
+	if (t == NULL || o->cold < 0)
+		return NULL;
+	return &t->cold[o->cold * t->cold_size];
+}
+
+/* an object's health, NULL if it's not the kind of thing that can be hurt */
+static inline struct health_data *obj_health(struct game_obj_t *o)
+{
+	struct obj_type_t *t = obj_type[(unsigned char) o->otype];
+
+	if (t == NULL || t->maxhp <= 0 || o->cold < 0)
+		return NULL;
+	return (struct health_data *) &t->cold[o->cold * t->cold_size];
+}
+
+#define MAXPLAYERS 8
 
+#define NSIDES 2
+#define SIDE_PLAYER 1
+#define SIDE_ENEMY 2
 
-struct game_obj_t *the_player = NULL;
-struct game_obj_t *the_enemy = NULL;
+/* Everybody's player, whether it's playing (joined the game) or not, */
+/* and from which tick on its input counts, see add_player(). */
+obj_handle_t player_obj[MAXPLAYERS];
+unsigned int active_players = 0;	/* bit per player */
+int player_input_from[MAXPLAYERS];
+#define JOIN_INPUT_LEAD 30	/* ticks a late joiner's input doesn't count, while it catches up */
+
+int local_player = 0;			/* which player is sitting at this keyboard */
+obj_handle_t the_player = NO_OBJ;	/* player_obj[local_player] */
+obj_handle_t the_enemy = NO_OBJ;
 
 int highest_object_number = 0;
 
@@ -152,19 +560,110 @@ struct viewport_t {
 	int x, y;
 	int vx, vy;
 	int width, height;
-	struct game_obj_t *obj;
+	obj_handle_t obj;	/* what we follow */
+	int sx, sy, sw, sh;	/* where on the screen it goes, in screen coords */
 };
 
+#define MAX_VIEWS 3	/* views on the screen at once, counting the main one */
+
+#define VIEWS_SINGLE 0	/* view layouts, see set_view_layout() */
+#define VIEWS_PIP 1	/* a small view in the top right corner */
+#define VIEWS_SPLIT 2	/* left and right halves */
+#define VIEWS_TRIO 3	/* left half, and the right half cut in two */
+#define NVIEW_LAYOUTS 4
+
+/* Objects live in chunks of OBJ_CHUNK_SIZE, allocated as they're needed. */
+/* Chunks never move, so pointers to objects stay good as the arena grows. */
+#define OBJ_CHUNK_SHIFT 10
+#define OBJ_CHUNK_SIZE (1 << OBJ_CHUNK_SHIFT)
+#define OBJ_CHUNK_MASK (OBJ_CHUNK_SIZE - 1)
+#define MAX_OBJ_CHUNKS ((OBJ_INDEX_MASK + 1) >> OBJ_CHUNK_SHIFT)
+
 struct game_state_t {
-	struct viewport_t vp;
+	struct viewport_t vp;		/* the main view */
+	struct viewport_t extra_vp[MAX_VIEWS - 1];	/* split screen, picture in picture */
+	int nviews;			/* 1 + how many of extra_vp are showing */
 	int lives;
 	int score;
-	struct game_obj_t go[MAXOBJS];
+	struct game_obj_t *go[MAX_OBJ_CHUNKS];	/* the object arena */
+	int nchunks;
 } game_state;
 
+int max_objects = DEFAULT_MAX_OBJECTS;	/* arena won't grow past this */
+int obj_capacity = 0;			/* nchunks * OBJ_CHUNK_SIZE */
+
+/* object number i */
+static inline struct game_obj_t *gobj(int i)
+{
+	return &game_state.go[i >> OBJ_CHUNK_SHIFT][i & OBJ_CHUNK_MASK];
+}
+
+/* view i, 0 being the main one */
+static inline struct viewport_t *view(int i)
+{
+	return i ? &game_state.extra_vp[i - 1] : &game_state.vp;
+}
+
+struct viewport_t *draw_vp = &game_state.vp;	/* the view being drawn */
+int view_layout = VIEWS_SINGLE;
+volatile int view_layout_requested = -1;	/* from the keyboard or --views, done next tick */
+
+struct {
+	long long culls;	/* passes over the arena */
+	long long binned;	/* objects put in a bin, summed over views */
+	long long hidden;	/* objects and squares left out, under a view on top */
+} view_stats;
+
+void print_view_stats()
+{
+	if (view_stats.culls == 0)
+		return;
+	printf("views: %d showing, %.1f objects binned per expose, %lld left out under other views\n",
+		game_state.nviews, (double) view_stats.binned / view_stats.culls, view_stats.hidden);
+}
+
+static inline obj_handle_t obj_handle(struct game_obj_t *o)
+{
+	return ((obj_handle_t) o->generation << OBJ_INDEX_BITS) | o->number;
+}
+
+/* the object a handle refers to, or NULL if it's gone */
+static inline struct game_obj_t *obj_lookup(obj_handle_t h)
+{
+	unsigned int i = h & OBJ_INDEX_MASK;
+
+	if (h == NO_OBJ || i >= (unsigned int) obj_capacity || gobj(i)->generation != (h >> OBJ_INDEX_BITS))
+		return NULL;
+	return gobj(i);
+}
+
+/* the closest player who's still alive, NULL if there are none */
+struct game_obj_t *nearest_player(int x, int y)
+{
+	struct game_obj_t *p, *best = NULL;
+	long long dx, dy, d, best_d = 0;
+	int i;
+
+	for (i = 0; i < MAXPLAYERS; i++) {
+		if (!(active_players & (1U << i)))
+			continue;
+		p = obj_lookup(player_obj[i]);
+		if (p == NULL || !p->alive)
+			continue;
+		dx = p->x - x;
+		dy = p->y - y;
+		d = dx * dx + dy * dy;
+		if (best == NULL || d < best_d) {
+			best = p;
+			best_d = d;
+		}
+	}
+	return best;
+}
+
 void init_game_state(struct game_obj_t *viewer)
 {
-	game_state.vp.obj = viewer;
+	game_state.vp.obj = obj_handle(viewer);
 	game_state.vp.x = viewer->x - SCREEN_WIDTH/2;
 	game_state.vp.y = viewer->y - SCREEN_HEIGHT/2;
 	game_state.vp.vx = viewer->vx;
@@ -173,6 +672,11 @@ void init_game_state(struct game_obj_t *viewer)
 	game_state.vp.yoffset = 10;
 	game_state.vp.width = SCREEN_WIDTH - (game_state.vp.xoffset * 2);
 	game_state.vp.height = SCREEN_HEIGHT - (game_state.vp.yoffset * 2);
+	game_state.vp.sx = 0;
+	game_state.vp.sy = 0;
+	game_state.vp.sw = SCREEN_WIDTH;
+	game_state.vp.sh = SCREEN_HEIGHT;
+	game_state.nviews = 1;
 	game_state.lives = 3;
 	game_state.score = 0;
 }
@@ -188,28 +692,48 @@ typedef void rectangle_drawing_function(GdkDrawable *drawable,
 
 typedef void explosion_function(int x, int y, int ivx, int ivy, int v, int nsparks, int time);
 
+typedef void foreground_function(GdkGC *gc, const GdkColor *color);
+
 line_drawing_function *current_draw_line = gdk_draw_line;
 rectangle_drawing_function *current_draw_rectangle = gdk_draw_rectangle;
 bright_line_drawing_function *current_bright_line = NULL;
 explosion_function *explosion = NULL;
+foreground_function *current_set_foreground = gdk_gc_set_foreground;
 
 /* I can switch out the line drawing function with these macros */
 /* in case I come across something faster than gdk_draw_line */
 #define DEFAULT_LINE_STYLE current_draw_line
 #define DEFAULT_RECTANGLE_STYLE current_draw_rectangle
 #define DEFAULT_BRIGHT_LINE_STYLE current_bright_line
+#define DEFAULT_FOREGROUND_STYLE current_set_foreground
 
 #define wwvi_draw_line DEFAULT_LINE_STYLE
 #define wwvi_draw_rectangle DEFAULT_RECTANGLE_STYLE
 #define wwvi_bright_line DEFAULT_BRIGHT_LINE_STYLE
+#define wwvi_set_foreground DEFAULT_FOREGROUND_STYLE
 int thicklines = 0;
 int frame_rate_hz = 30;
 
+/* How much drawing to do, from full down to as little as will still */
+/* do.  Each level does without what the ones above it do without as */
+/* well.  The quality governor moves it, see govern_quality(). */
+#define QUALITY_FULL 0
+#define QUALITY_THIN_LINES 1	/* no thick or bright variants of lines */
+#define QUALITY_PLAIN_TERRAIN 2	/* terrain squares without their decoration */
+#define QUALITY_LOW_LOD 3	/* objects as crosses the size of their shapes */
+#define QUALITY_FEW_SHOTS 4	/* half the shots away from the middle of the screen */
+#define QUALITY_LOWEST QUALITY_FEW_SHOTS
+#define QUALITY_NEAR_SHOTS (SCREEN_HEIGHT / 4)	/* "the middle of the screen" */
+int quality = QUALITY_FULL;
+
 GtkWidget *window;
 GdkGC *gc = NULL;               /* our graphics context. */
 GtkWidget *main_da;             /* main drawing area. */
 gint timer_tag;  
 int fullscreen = 0;
+int full_redraw = 1;		/* next frame must repaint the whole window, not just dirty rects */
+int xrequests = 0;		/* drawing requests sent to X since the last tick */
+int hud_debug = 0;		/* show the HUD's debug counters, F2 */
 int in_the_process_of_quitting = 0;
 
 float xscale_screen;
@@ -240,6 +764,196 @@ int nframes = 0;
 int timer = 0;
 struct timeval start_time, end_time;
 
+/* microseconds from the monotonic clock, for measuring things. */
+static inline long long usecs_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*****************************/
+/* trace code begins         */
+
+/* Scoped markers, for opening a slow frame in a trace viewer and seeing */
+/* which stage on which thread held it up.  Every thread which records */
+/* anything has a ring of events of its own which only it writes, so */
+/* recording takes no locks, and the newest events push out the oldest. */
+/* trace_dump() writes the last trace_seconds of every ring out as */
+/* Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev */
+/* both read.  With --trace the rings record all the time, and F9 or */
+/* SIGUSR1 writes out whatever they hold, so a hitch can be caught */
+/* after it happens.  Without it, F9 or SIGUSR1 starts recording and */
+/* the next one stops it and writes the file.  With tracing off a */
+/* marker costs a test of a global. */
+
+#define TRACE_RING_SIZE 65536	/* events per thread, must be a power of 2 */
+#define MAX_TRACE_THREADS 32
+#define DEFAULT_TRACE_SECONDS 10	/* see --trace-seconds */
+
+struct trace_event {
+	const char *name;	/* must outlive the ring, a string constant or a type name */
+	long long start, dur;	/* nanoseconds, monotonic clock */
+	int arg;		/* something to go with it, how many objects, which part... */
+};
+
+struct trace_ring {
+	struct trace_event ev[TRACE_RING_SIZE];
+	volatile gint head;	/* events ever written, only the owning thread moves it */
+	const char *name;	/* the thread's */
+	int tid;
+};
+
+struct trace_ring *trace_rings[MAX_TRACE_THREADS];
+volatile gint ntrace_rings = 0;
+static __thread struct trace_ring *my_trace_ring = NULL;
+
+volatile int tracing = 0;
+int trace_always = 0;		/* --trace, never stop recording */
+int trace_seconds = DEFAULT_TRACE_SECONDS;
+int ntrace_dumps = 0;
+volatile sig_atomic_t trace_toggle_requested = 0;
+
+static inline long long trace_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Called once by each thread which traces, before it does. */
+/* Threads past MAX_TRACE_THREADS just don't get traced. */
+void trace_register_thread(const char *name)
+{
+	struct trace_ring *r;
+	int n;
+
+	n = g_atomic_int_add(&ntrace_rings, 1);
+	if (n >= MAX_TRACE_THREADS)
+		return;
+	/* big, but nothing touches the events until tracing is on */
+	r = (struct trace_ring *) game_malloc(ALLOC_TRACE, sizeof(*r));
+	if (r == NULL)
+		return;
+	r->head = 0;
+	r->name = name;
+	r->tid = n + 1;
+	g_atomic_pointer_set(&trace_rings[n], r);
+	my_trace_ring = r;
+}
+
+/* start of a marker, 0 if tracing is off */
+static inline long long trace_begin()
+{
+	return tracing ? trace_now() : 0;
+}
+
+/* end of a marker begun by trace_begin() */
+static inline void trace_end(const char *name, long long start, int arg)
+{
+	struct trace_ring *r = my_trace_ring;
+	struct trace_event *e;
+	int h;
+
+	if (start == 0 || r == NULL)
+		return;
+	h = r->head;
+	e = &r->ev[h & (TRACE_RING_SIZE - 1)];
+	e->name = name;
+	e->start = start;
+	e->dur = trace_now() - start;
+	e->arg = arg;
+	g_atomic_int_set(&r->head, h + 1);	/* publish it */
+}
+
+static void trace_write_ring(FILE *f, struct trace_ring *r, long long since, int *first)
+{
+	static struct trace_event copy[TRACE_RING_SIZE];
+	unsigned int h1, h2, i, from;
+	struct trace_event *e;
+
+	/* The owner may still be writing, so copy first, then throw away */
+	/* whatever it could have written over while we were copying. */
+	h1 = (unsigned int) g_atomic_int_get(&r->head);
+	from = h1 > TRACE_RING_SIZE ? h1 - TRACE_RING_SIZE : 0;
+	for (i = from; i != h1; i++)
+		copy[i & (TRACE_RING_SIZE - 1)] = r->ev[i & (TRACE_RING_SIZE - 1)];
+	h2 = (unsigned int) g_atomic_int_get(&r->head);
+	if (h2 - from > TRACE_RING_SIZE)
+		from = h2 - TRACE_RING_SIZE;
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}}", *first ? "" : ",", r->tid, r->name);
+	*first = 0;
+	for (i = from; (int) (h1 - i) > 0; i++) {
+		e = &copy[i & (TRACE_RING_SIZE - 1)];
+		if (e->start < since)
+			continue;
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%d}}",
+			e->name, r->tid, e->start / 1000.0, e->dur / 1000.0, e->arg);
+	}
+}
+
+/* write the last trace_seconds of every thread's ring to a new file */
+void trace_dump()
+{
+	char filename[64];
+	long long since;
+	FILE *f;
+	int i, n, first = 1;
+	struct trace_ring *r;
+
+	snprintf(filename, sizeof(filename), "battallica-trace-%d-%d.json",
+		(int) getpid(), ntrace_dumps++);
+	f = fopen(filename, "w");
+	if (f == NULL) {
+		fprintf(stderr, "battallica: can't write %s: %s\n", filename, strerror(errno));
+		return;
+	}
+	since = trace_now() - trace_seconds * 1000000000LL;
+	n = g_atomic_int_get(&ntrace_rings);
+	if (n > MAX_TRACE_THREADS)
+		n = MAX_TRACE_THREADS;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = 0; i < n; i++) {
+		r = (struct trace_ring *) g_atomic_pointer_get(&trace_rings[i]);
+		if (r)
+			trace_write_ring(f, r, since, &first);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	printf("trace: wrote the last %d seconds to %s\n", trace_seconds, filename);
+}
+
+/* from F9 or SIGUSR1, by way of trace_toggle_requested */
+void trace_toggle()
+{
+	if (trace_always) {
+		trace_dump();
+		return;
+	}
+	if (!tracing) {
+		tracing = 1;
+		printf("trace: recording, F9 or SIGUSR1 again to write it out\n");
+		return;
+	}
+	tracing = 0;
+	trace_dump();
+}
+
+#ifndef BATTALLICA_BENCH
+static void trace_signal(int sig)
+{
+	trace_toggle_requested = 1;
+}
+#endif
+
+/* trace code ends           */
+/*****************************/
+
 
 void spin_points(struct my_point_t *points, int npoints, 
 	struct my_point_t **spun_points, int nangles,
@@ -252,7 +966,7 @@ void spin_points(struct my_point_t *points, int npoints,
 	double magnitude, diff;
 
 	*spun_points = (struct my_point_t *) 
-		malloc(sizeof(*spun_points) * npoints * nangles);
+		game_malloc(ALLOC_DRAW, sizeof(**spun_points) * npoints * nangles);
 	if (*spun_points == NULL)
 		return;
 
@@ -260,7 +974,6 @@ void spin_points(struct my_point_t *points, int npoints,
 
 	for (i = 0; i < nangles; i++) {
 		angle = angle_inc * (double) i;
-		printf("Rotation angle = %f\n", angle * 180.0/3.1415927);
 		for (j=0;j<npoints;j++) {
 			startx = (double) (points[j].x - originx);
 			starty = (double) (points[j].y - originy);
@@ -277,9 +990,6 @@ void spin_points(struct my_point_t *points, int npoints,
 			newy = sin(new_angle) * magnitude + originy;
 			(*spun_points)[i*npoints + j].x = newx;
 			(*spun_points)[i*npoints + j].y = newy;
-			printf("s=%f,%f, e=%f,%f, angle = %f/%f\n", 
-				startx, starty, newx, newy, 
-				start_angle * 180/3.1415927, new_angle * 360.0 / (2.0*3.1415927)); 
 		}
 	} 
 }
@@ -311,6 +1021,7 @@ void thick_scaled_line(GdkDrawable *drawable,
 	gdk_draw_line(drawable, gc, sx1,sy1,sx2,sy2);
 	gdk_draw_line(drawable, gc, sx1-dx,sy1-dy,sx2-dx,sy2-dy);
 	gdk_draw_line(drawable, gc, sx1+dx,sy1+dy,sx2+dx,sy2+dy);
+	xrequests += 2;		/* callers count the first one */
 }
 
 void scaled_rectangle(GdkDrawable *drawable,
@@ -344,6 +1055,14 @@ void scaled_bright_line(GdkDrawable *drawable,
 	gdk_draw_line(drawable, gc, sx1+dx,sy1+dy,sx2+dx,sy2+dy);
 }
 
+/* a bright line as a plain one, for when the quality is turned down */
+void thin_bright_line(GdkDrawable *drawable,
+	GdkGC *gc, gint x1, gint y1, gint x2, gint y2, int color)
+{
+	gdk_gc_set_foreground(gc, &huex[color]);
+	scaled_line(drawable, gc, x1, y1, x2, y2);
+}
+
 void unscaled_bright_line(GdkDrawable *drawable,
 	GdkGC *gc, gint x1, gint y1, gint x2, gint y2, int color)
 {
@@ -364,86 +1083,330 @@ void unscaled_bright_line(GdkDrawable *drawable,
 	gdk_draw_line(drawable, gc, x1+dx,y1+dy,x2+dx,y2+dy);
 }
 
-/*******************************************/
-/* object allocator code begins            */
+/***********************************/
+/* segment batching code begins    */
 
-/* object allocation algorithm uses a bit per object to indicate */
-/* free/allocated... how many 32 bit blocks do we need?  NBITBLOCKS. */
-/* 5, 2^5 = 32, 32 bits per int. */
+/* Drawing a line at a time means one X request per line, plus one */
+/* per color change.  Instead, batch_line() collects segments per */
+/* color, already scaled, and flush_segment_batches() draws each */
+/* color's segments with a single gdk_draw_segments(). */
 
-#define NBITBLOCKS ((MAXOBJS >> 5) + 1) 
+#define NSEGCOLORS (NCOLORS + NSPARKCOLORS + NRAINBOWCOLORS)
 
-unsigned int free_obj_bitmap[NBITBLOCKS] = {0}; /* bitmaps for object allocater free/allocated status */
+struct segment_batch {
+	GdkSegment *seg;
+	int nsegs, size;
+} seg_batch[NSEGCOLORS];
 
-static inline void clearbit(unsigned int *value, unsigned char bit)
+static void grow_segment_batch(struct segment_batch *b, int needed)
 {
-	*value &= ~(1 << bit);
+	int newsize = b->size ? b->size : 256;
+
+	while (newsize < b->nsegs + needed)
+		newsize *= 2;
+	b->seg = (GdkSegment *) game_realloc(ALLOC_DRAW, b->seg, sizeof(*b->seg) * newsize);
+	b->size = newsize;
 }
 
-int find_free_obj()
+static inline void add_segment(struct segment_batch *b, int x1, int y1, int x2, int y2)
 {
-	int i, j, answer;
-	unsigned int block;
+	GdkSegment *s = &b->seg[b->nsegs++];
 
-	/* this might be optimized by find_first_zero_bit, or whatever */
-	/* it's called that's in the linux kernel.  But, it's pretty */
-	/* fast as is, and this is portable without writing asm code. */
-	/* Er, portable, except for assuming an int is 32 bits. */
+	s->x1 = x1;
+	s->y1 = y1;
+	s->x2 = x2;
+	s->y2 = y2;
+}
 
-	for (i=0;i<NBITBLOCKS;i++) {
-		if (free_obj_bitmap[i] == 0xffffffff) /* is this block full?  continue. */
-			continue;
+/* queue a line, in game screen coords, same as wwvi_draw_line would draw it */
+static inline void batch_line(int color, int x1, int y1, int x2, int y2)
+{
+	struct segment_batch *b = &seg_batch[color];
+	int dx, dy;
 
-		/* I tried doing a preliminary binary search using bitmasks to figure */
-		/* which byte in block contains a free slot so that the for loop only */
-		/* compared 8 bits, rather than up to 32.  This resulted in a performance */
-		/* drop, (according to the gprof) perhaps contrary to intuition.  My guess */
-		/* is branch misprediction hurt performance in that case.  Just a guess though. */
+	if (b->nsegs + 3 > b->size)
+		grow_segment_batch(b, 3);
+	if (current_draw_line == gdk_draw_line) {
+		add_segment(b, x1, y1, x2, y2);
+		return;
+	}
+	x1 = x1 * xscale_screen;
+	x2 = x2 * xscale_screen;
+	y1 = y1 * yscale_screen;
+	y2 = y2 * yscale_screen;
+	add_segment(b, x1, y1, x2, y2);
+	if (current_draw_line != thick_scaled_line)
+		return;
+	if (abs(x1-x2) > abs(y1-y2)) {
+		dx = 0;
+		dy = 1;
+	} else {
+		dx = 1;
+		dy = 0;
+	}
+	add_segment(b, x1-dx, y1-dy, x2-dx, y2-dy);
+	add_segment(b, x1+dx, y1+dy, x2+dx, y2+dy);
+}
 
-		/* undoubtedly the best way to find the first empty bit in an array of ints */
-		/* is some custom ASM code.  But, this is portable, and seems fast enough. */
-		/* profile says we spend about 3.8% of time in here. */
-	
-		/* Not full. There is an empty slot in this block, find it. */
-		block = free_obj_bitmap[i];			
-		for (j=0;j<32;j++) {
-			if (block & 0x01) {	/* is bit j set? */
-				block = block >> 1;
-				continue;	/* try the next bit. */
-			}
+void flush_segment_batches(GdkDrawable *drawable)
+{
+	int i;
 
-			/* Found free bit, bit j.  Set it, marking it non free.  */
-			free_obj_bitmap[i] |= (1 << j);
-			answer = (i * 32 + j);	/* return the corresponding array index, if in bounds. */
-			if (answer < MAXOBJS) {
-				if (game_state.go[answer].next != NULL || game_state.go[answer].prev != NULL ||
-					game_state.go[answer].ontargetlist) {
-						printf("T%c ", game_state.go[answer].otype);
-				}
-				game_state.go[answer].ontargetlist=0;
-				if (answer > highest_object_number)
-					highest_object_number = answer;
-				return answer;
-			}
-			return -1;
-		}
+	for (i = 0; i < NSEGCOLORS; i++) {
+		if (seg_batch[i].nsegs == 0)
+			continue;
+		gdk_gc_set_foreground(gc, &huex[i]);
+		gdk_draw_segments(drawable, gc, seg_batch[i].seg, seg_batch[i].nsegs);
+		seg_batch[i].nsegs = 0;
+		xrequests += 2;
 	}
-	return -1;
 }
 
-/* object allocator code ends              */
-/*******************************************/
+/* segment batching code ends      */
+/***********************************/
 
-/***************************/
-/* target list code begins */
+/*****************************/
+/* worker thread code begins */
 
-/* add an object to the list of targets... */
+/* A small pool of threads for passes which split into independent */
+/* parts.  run_parallel(func, nparts, arg) calls func(part, arg) once */
+/* for each part 0 .. nparts-1, spread over the worker threads and the */
+/* calling thread, and returns once they're all done.  Parts are handed */
+/* out first come first served, so func mustn't care which thread runs */
+/* which part, or in what order. */
+
+#define MAX_WORKERS 16
+
+typedef void parallel_func(int part, void *arg);
+
+int nworkers = 1;	/* threads for parallel passes, counting the game thread */
+
+struct worker_pool {
+	GMutex lock;
+	GCond go, done;
+	int job;		/* bumped for each run_parallel() */
+	int busy;		/* worker threads still on the current job */
+	parallel_func *func;
+	void *arg;
+	int nparts;
+	volatile gint next_part;
+} workers;
+
+static void do_parallel_parts(void)
+{
+	int part;
+	long long start;
+
+	while ((part = g_atomic_int_add(&workers.next_part, 1)) < workers.nparts) {
+		start = trace_begin();
+		workers.func(part, workers.arg);
+		trace_end("part", start, part);
+	}
+}
+
+static gpointer worker_thread(gpointer data)
+{
+	int job = 0;
+
+	trace_register_thread((const char *) data);
+	g_mutex_lock(&workers.lock);
+	for (;;) {
+		while (workers.job == job)
+			g_cond_wait(&workers.go, &workers.lock);
+		job = workers.job;
+		g_mutex_unlock(&workers.lock);
+		do_parallel_parts();
+		g_mutex_lock(&workers.lock);
+		if (--workers.busy == 0)
+			g_cond_signal(&workers.done);
+	}
+	return NULL;
+}
+
+void run_parallel(parallel_func *func, int nparts, void *arg)
+{
+	int i;
+
+	if (nworkers <= 1 || nparts <= 1) {
+		for (i = 0; i < nparts; i++)
+			func(i, arg);
+		return;
+	}
+	g_mutex_lock(&workers.lock);
+	workers.func = func;
+	workers.arg = arg;
+	workers.nparts = nparts;
+	g_atomic_int_set(&workers.next_part, 0);
+	workers.busy = nworkers - 1;
+	workers.job++;
+	g_cond_broadcast(&workers.go);
+	g_mutex_unlock(&workers.lock);
+
+	do_parallel_parts();
+
+	g_mutex_lock(&workers.lock);
+	while (workers.busy > 0)
+		g_cond_wait(&workers.done, &workers.lock);
+	g_mutex_unlock(&workers.lock);
+}
+
+/* must be called after g_thread_init() */
+void init_workers(int n)
+{
+	GThread *t;
+	char *name;
+	int i;
+
+	if (n < 1)
+		n = 1;
+	if (n > MAX_WORKERS)
+		n = MAX_WORKERS;
+	nworkers = n;
+	g_mutex_init(&workers.lock);
+	g_cond_init(&workers.go);
+	g_cond_init(&workers.done);
+	workers.job = 0;
+	workers.busy = 0;
+	for (i = 1; i < n; i++) {
+		name = g_strdup_printf("worker %d", i);
+		t = g_thread_try_new(name, worker_thread, name, NULL);
+		if (t == NULL) {
+			g_free(name);
+			nworkers = i;
+			break;
+		}
+		g_thread_unref(t);	/* they run till the game exits */
+	}
+}
+
+/* worker thread code ends   */
+/*****************************/
+
+/*******************************************/
+/* object allocator code begins            */
+
+/* object allocation algorithm uses a bit per object to indicate */
+/* free/allocated... how many 32 bit blocks do we need?  nbitblocks, */
+/* which grows along with the object arena, obj_capacity >> 5. */
+/* 5, 2^5 = 32, 32 bits per int. */
+
+unsigned int *free_obj_bitmap = NULL; /* bitmaps for object allocater free/allocated status */
+int nbitblocks = 0;
+int first_free_block = 0;	/* blocks before this one are known to be full */
+int live_objects = 0, peak_live_objects = 0;
+
+static inline void clearbit(unsigned int *value, unsigned char bit)
+{
+	*value &= ~(1 << bit);
+}
+
+/* add another chunk to the object arena, returns -1 if we can't */
+static int grow_obj_arena()
+{
+	struct game_obj_t *chunk;
+	int oldblocks = nbitblocks;
+
+	if (game_state.nchunks >= MAX_OBJ_CHUNKS || obj_capacity >= max_objects)
+		return -1;
+	chunk = (struct game_obj_t *) game_malloc(ALLOC_OBJECTS, sizeof(*chunk) * OBJ_CHUNK_SIZE);
+	if (chunk == NULL)
+		return -1;
+	memset(chunk, 0, sizeof(*chunk) * OBJ_CHUNK_SIZE);
+	game_state.go[game_state.nchunks++] = chunk;
+	obj_capacity = game_state.nchunks * OBJ_CHUNK_SIZE;
+
+	nbitblocks = obj_capacity >> 5;
+	free_obj_bitmap = (unsigned int *) game_realloc(ALLOC_OBJECTS, free_obj_bitmap,
+				sizeof(*free_obj_bitmap) * nbitblocks);
+	memset(&free_obj_bitmap[oldblocks], 0,
+		sizeof(*free_obj_bitmap) * (nbitblocks - oldblocks));
+	return 0;
+}
+
+void init_obj_arena()
+{
+	if (max_objects > OBJ_INDEX_MASK + 1)
+		max_objects = OBJ_INDEX_MASK + 1;
+	if (max_objects < 1)
+		max_objects = 1;
+	grow_obj_arena();	/* so there's always an object 0 to look at */
+}
+
+void print_obj_arena_stats()
+{
+	printf("objects: %d live, %d peak, highest slot %d, %d chunks (%lu KB), limit %d\n",
+		live_objects, peak_live_objects, highest_object_number, game_state.nchunks,
+		(unsigned long) (game_state.nchunks * sizeof(struct game_obj_t) * OBJ_CHUNK_SIZE
+			+ nbitblocks * sizeof(*free_obj_bitmap)) / 1024,
+		max_objects);
+}
+
+int find_free_obj()
+{
+	int i, j, answer;
+	unsigned int block;
+
+	/* this might be optimized by find_first_zero_bit, or whatever */
+	/* it's called that's in the linux kernel.  But, it's pretty */
+	/* fast as is, and this is portable without writing asm code. */
+	/* Er, portable, except for assuming an int is 32 bits. */
+
+	for (i=first_free_block;i<nbitblocks;i++) {
+		if (free_obj_bitmap[i] == 0xffffffff) /* is this block full?  continue. */
+			continue;
+		first_free_block = i;
+
+		/* I tried doing a preliminary binary search using bitmasks to figure */
+		/* which byte in block contains a free slot so that the for loop only */
+		/* compared 8 bits, rather than up to 32.  This resulted in a performance */
+		/* drop, (according to the gprof) perhaps contrary to intuition.  My guess */
+		/* is branch misprediction hurt performance in that case.  Just a guess though. */
+
+		/* undoubtedly the best way to find the first empty bit in an array of ints */
+		/* is some custom ASM code.  But, this is portable, and seems fast enough. */
+		/* profile says we spend about 3.8% of time in here. */
+	
+		/* Not full. There is an empty slot in this block, find it. */
+		block = free_obj_bitmap[i];			
+		for (j=0;j<32;j++) {
+			if (block & 0x01) {	/* is bit j set? */
+				block = block >> 1;
+				continue;	/* try the next bit. */
+			}
+
+			/* Found free bit, bit j.  Set it, marking it non free.  */
+			answer = (i * 32 + j);	/* return the corresponding array index, if in bounds. */
+			if (answer >= max_objects)
+				return -1;
+			free_obj_bitmap[i] |= (1 << j);
+			gobj(answer)->ontargetlist=0;
+			if (answer > highest_object_number)
+				highest_object_number = answer;
+			return answer;
+		}
+	}
+
+	/* Everything's full, make more room if we're allowed to. */
+	first_free_block = nbitblocks;
+	if (grow_obj_arena() < 0)
+		return -1;
+	return find_free_obj();
+}
+
+/* object allocator code ends              */
+/*******************************************/
+
+/***************************/
+/* target list code begins */
+
+/* add an object to the list of targets... */
 struct game_obj_t *add_target(struct game_obj_t *o)
 {
+	struct game_obj_t *head;
 #ifdef DEBUG_TARGET_LIST
 	struct game_obj_t *t;
 
-	for (t = target_head; t != NULL; t = t->next) {
+	for (t = obj_lookup(target_head); t != NULL; t = obj_lookup(t->next)) {
 		if (t == o) {
 			printf("Object already in target list!\n");
 			return NULL;
@@ -455,13 +1418,14 @@ struct game_obj_t *add_target(struct game_obj_t *o)
 #endif
 
 	o->next = target_head;
-	o->prev = NULL;
-	if (target_head)
-		target_head->prev = o;
-	target_head = o;
+	o->prev = NO_OBJ;
+	head = obj_lookup(target_head);
+	if (head)
+		head->prev = obj_handle(o);
+	target_head = obj_handle(o);
 	o->ontargetlist = 1;
 
-	return target_head;
+	return o;
 }
 
 /* for debugging... */
@@ -469,7 +1433,7 @@ void print_target_list()
 {
 	struct game_obj_t *t;
 	printf("Targetlist:\n");
-	for (t=target_head; t != NULL;t=t->next) {
+	for (t=obj_lookup(target_head); t != NULL;t=obj_lookup(t->next)) {
 		printf("%c: %d,%d\n", t->otype, t->x, t->y);
 	}
 	printf("end of list.\n");
@@ -479,12 +1443,12 @@ void print_target_list()
 struct game_obj_t *remove_target(struct game_obj_t *t)
 {
 
-	struct game_obj_t *next;
+	struct game_obj_t *next, *prev;
 	if (!t)
 		return NULL;
 #ifdef DEBUG_TARGET_LIST
 	if (!t->ontargetlist) {
-		for (next = target_head; next != NULL; next = next->next) {
+		for (next = obj_lookup(target_head); next != NULL; next = obj_lookup(next->next)) {
 			if (next == t) {
 				printf("Remove, object claims not to be on target list, but it is.\n");
 				goto do_it_anyway;
@@ -494,15 +1458,16 @@ struct game_obj_t *remove_target(struct game_obj_t *t)
 	}
 do_it_anyway:
 #endif
-	next = t->next;
-	if (t == target_head)
+	next = obj_lookup(t->next);
+	prev = obj_lookup(t->prev);
+	if (obj_handle(t) == target_head)
 		target_head = t->next;
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = NULL;
-	t->prev = NULL;
+	if (next)
+		next->prev = t->prev;
+	if (prev)
+		prev->next = t->next;
+	t->next = NO_OBJ;
+	t->prev = NO_OBJ;
 	t->ontargetlist=0;
 	return next;
 }
@@ -510,542 +1475,6162 @@ do_it_anyway:
 /* target list code ends */
 /***************************/
 
-/*************************************/
-/* random number related code begins */
+/*****************************/
+/* timer wheel code begins   */
+
+/* Things which should happen some number of ticks from now (reload */
+/* timers, fuses, respawns...) are kept in a hierarchical timing wheel */
+/* rather than having every object check the timer in its move function */
+/* every tick.  Level 0 has a slot per tick for the next 64 ticks, level */
+/* 1 a slot per 64 ticks for the next 4096, and so on.  Each tick we */
+/* run whatever is in the current level 0 slot, and every 64 ticks the */
+/* next slot of the level above is cascaded down.  So an object waiting */
+/* on an event costs nothing per tick until the event fires. */
+/* Events are kept in an array and linked by index, and are also linked */
+/* per object so all of an object's events can be cancelled at once. */
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+#define TW_MAX_DELAY ((1 << (TW_BITS * TW_LEVELS)) - 1)
+#define TW_ID_BITS 20		/* an event id is its index, with its generation above */
+#define TW_ID_MASK ((1 << TW_ID_BITS) - 1)
+#define TW_MAX_EVENTS (TW_ID_MASK + 1)
+
+typedef void obj_event_func(struct game_obj_t *o, int arg);
+
+struct timer_event {
+	unsigned int when;	/* tick at which to fire */
+	int obj;		/* object index, or -1 */
+	obj_event_func *func;	/* NULL if cancelled */
+	int arg;
+	int next, prev;		/* slot list (or free list) */
+	int onext, oprev;	/* per object list */
+	int slot;		/* level * TW_SIZE + slot index, or -1 if being delivered or free */
+	int gen;		/* bumped when freed, so an old id can't cancel its reuse */
+};
 
-/* get a random number between 0 and n-1... fast and loose algorithm.  */
-static inline int randomn(int n)
+struct timer_wheel {
+	struct timer_event *ev;
+	int size, free;		/* free is a list through ev[].next */
+	int head[TW_LEVELS * TW_SIZE];
+	int tail[TW_LEVELS * TW_SIZE];
+	unsigned int now;	/* last tick processed */
+	int *obj_head;		/* each object's events, grows with the object arena */
+	int obj_head_size;
+	int *batch;		/* events being delivered this tick */
+	int nbatch, batchsize;
+	int pending;		/* number of scheduled events */
+} timer_wheel;
+
+/* empty the wheel, as of the current tick */
+void init_timer_wheel()
 {
-        /* return (int) (((random() + 0.0) / (RAND_MAX + 0.0)) * (n + 0.0)); */
-        /* floating point divide?  No. */
-        return ((random() & 0x0000ffff) * n) >> 16;
+	int i;
+
+	for (i = 0; i < TW_LEVELS * TW_SIZE; i++)
+		timer_wheel.head[i] = timer_wheel.tail[i] = -1;
+	for (i = 0; i < timer_wheel.obj_head_size; i++)
+		timer_wheel.obj_head[i] = -1;
+	timer_wheel.free = -1;
+	for (i = timer_wheel.size - 1; i >= 0; i--) {
+		timer_wheel.ev[i].func = NULL;
+		timer_wheel.ev[i].slot = -1;
+		timer_wheel.ev[i].gen = (timer_wheel.ev[i].gen + 1) & (INT_MAX >> TW_ID_BITS);
+		timer_wheel.ev[i].next = timer_wheel.free;
+		timer_wheel.free = i;
+	}
+	timer_wheel.now = timer;
+	timer_wheel.pending = 0;
 }
 
-/* get a random number between a and b. */
-static inline int randomab(int a, int b)
+static int alloc_timer_event()
 {
-        int n;
-        n = abs(a - b);
-        return (((random() & 0x0000ffff) * n) >> 16) + min(a,b);
+	int i, oldsize;
+	struct timer_wheel *tw = &timer_wheel;
+
+	if (tw->free < 0) {
+		oldsize = tw->size;
+		if (oldsize >= TW_MAX_EVENTS) {
+			fprintf(stderr, "battallica: more than %d timer events\n", TW_MAX_EVENTS);
+			exit(1);
+		}
+		tw->size = oldsize ? oldsize * 2 : 1024;
+		tw->ev = (struct timer_event *) game_realloc(ALLOC_SIM, tw->ev, sizeof(*tw->ev) * tw->size);
+		for (i = tw->size - 1; i >= oldsize; i--) {
+			tw->ev[i].func = NULL;
+			tw->ev[i].slot = -1;
+			tw->ev[i].gen = 0;
+			tw->ev[i].next = tw->free;
+			tw->free = i;
+		}
+	}
+	i = tw->free;
+	tw->free = tw->ev[i].next;
+	return i;
 }
 
-/* random number related code ends   */
-/*************************************/
+/* link event e into the right slot for its time, relative to tw->now */
+static void timer_wheel_insert(int e)
+{
+	struct timer_wheel *tw = &timer_wheel;
+	struct timer_event *ev = &tw->ev[e];
+	unsigned int delta = ev->when - tw->now;
+	int level, slot;
 
-/************************************/
-/* Terrain related code begins here */
-int mapsquarewidth = (SCREEN_HEIGHT / 8);
-int mapxdim = 64;
-int mapydim = 64;
-char *terrain_map = NULL;
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1U << (TW_BITS * (level + 1))))
+			break;
+	slot = level * TW_SIZE + ((ev->when >> (TW_BITS * level)) & TW_MASK);
 
-struct terrain_descriptor_t {
-	char *name;
-	char terrain_type;
-	int color;
-};
+	ev->slot = slot;
+	ev->next = -1;
+	ev->prev = tw->tail[slot];
+	if (tw->tail[slot] >= 0)
+		tw->ev[tw->tail[slot]].next = e;
+	else
+		tw->head[slot] = e;
+	tw->tail[slot] = e;
+}
 
-struct terrain_descriptor_t grass_terrain = 	{ "grass", '.', GREEN };
-struct terrain_descriptor_t mountain_terrain =	{ "mountains", 'm', WHITE };
-struct terrain_descriptor_t water_terrain =	{ "water", 'w', CYAN };
-struct terrain_descriptor_t forest_terrain =	{ "forest", 'f', ORANGE };
-struct terrain_descriptor_t swamp_terrain =	{ "swamp", 's', DARKGREEN };
+static void timer_wheel_unlink(int e)
+{
+	struct timer_wheel *tw = &timer_wheel;
+	struct timer_event *ev = &tw->ev[e];
 
-struct terrain_descriptor_t *terrain_type[256];
+	if (ev->prev >= 0)
+		tw->ev[ev->prev].next = ev->next;
+	else
+		tw->head[ev->slot] = ev->next;
+	if (ev->next >= 0)
+		tw->ev[ev->next].prev = ev->prev;
+	else
+		tw->tail[ev->slot] = ev->prev;
+}
 
-static inline int txy(int x, int y)
+static void free_timer_event(int e)
 {
-	return y*mapydim + x;
+	struct timer_wheel *tw = &timer_wheel;
+	struct timer_event *ev = &tw->ev[e];
+
+	if (ev->obj >= 0) {
+		if (ev->oprev >= 0)
+			tw->ev[ev->oprev].onext = ev->onext;
+		else
+			tw->obj_head[ev->obj] = ev->onext;
+		if (ev->onext >= 0)
+			tw->ev[ev->onext].oprev = ev->oprev;
+	}
+	ev->func = NULL;
+	ev->slot = -1;
+	ev->gen = (ev->gen + 1) & (INT_MAX >> TW_ID_BITS);
+	ev->next = tw->free;
+	tw->free = e;
+	tw->pending--;
 }
 
-void init_terrain_types()
+/* call func(object, arg) at tick when, which must be after tw->now and */
+/* no more than TW_MAX_DELAY past it */
+static int timer_wheel_add(int obj, unsigned int when, obj_event_func *func, int arg)
 {
-	int i;
-	for (i=0;i<256;i++)
-		terrain_type[i] = NULL;
-
-	terrain_type[grass_terrain.terrain_type] = &grass_terrain; 
-	terrain_type[mountain_terrain.terrain_type] = &mountain_terrain; 
-	terrain_type[water_terrain.terrain_type] = &water_terrain; 
-	terrain_type[forest_terrain.terrain_type] = &forest_terrain; 
-	terrain_type[swamp_terrain.terrain_type] = &swamp_terrain; 
+	struct timer_wheel *tw = &timer_wheel;
+	struct timer_event *ev;
+	int e;
+
+	if (obj >= tw->obj_head_size) {
+		e = tw->obj_head_size;
+		tw->obj_head_size = obj_capacity > obj ? obj_capacity : obj + 1;
+		tw->obj_head = (int *) game_realloc(ALLOC_SIM, tw->obj_head, sizeof(*tw->obj_head) * tw->obj_head_size);
+		for (; e < tw->obj_head_size; e++)
+			tw->obj_head[e] = -1;
+	}
+	e = alloc_timer_event();
+	ev = &tw->ev[e];
+	ev->when = when;
+	ev->obj = obj;
+	ev->func = func;
+	ev->arg = arg;
+	ev->oprev = -1;
+	ev->onext = -1;
+	if (obj >= 0) {
+		ev->onext = tw->obj_head[obj];
+		if (ev->onext >= 0)
+			tw->ev[ev->onext].oprev = e;
+		tw->obj_head[obj] = e;
+	}
+	tw->pending++;
+	timer_wheel_insert(e);
+	return e;
 }
 
-void build_terrain()
+static void cancel_event(int e)
 {
-	int i, x, y;
-	char *line;
+	struct timer_event *ev = &timer_wheel.ev[e];
 
-	terrain_map = (char *) malloc(mapxdim * mapydim);
-	memset(terrain_map, grass_terrain.terrain_type, mapxdim*mapydim);
+	if (ev->func == NULL)	/* already cancelled, or free */
+		return;
+	ev->func = NULL;
+	if (ev->slot < 0)	/* being delivered, run_timer_events() frees it */
+		return;
+	timer_wheel_unlink(e);
+	free_timer_event(e);
+}
 
-	for (i=0;i<500;i++) {
-		x = randomn(64);
-		y = randomn(64);
-		terrain_map[txy(x,y)] = water_terrain.terrain_type;
-	}
-	for (i=0;i<500;i++) {
-		x = randomn(64);
-		y = randomn(64);
-		terrain_map[txy(x,y)] = mountain_terrain.terrain_type;
-	}
-	for (i=0;i<500;i++) {
-		x = randomn(64);
-		y = randomn(64);
-		terrain_map[txy(x,y)] = swamp_terrain.terrain_type;
-	}
-	for (i=0;i<500;i++) {
-		x = randomn(64);
-		y = randomn(64);
-		terrain_map[txy(x,y)] = forest_terrain.terrain_type;
-	}
+/* call func(object, arg) delay ticks from now.  Returns an event */
+/* id which can be passed to cancel_timer_event(). */
+int schedule_timer_event(int obj, int delay, obj_event_func *func, int arg)
+{
+	int e;
+
+	sim_require(&sim_event_funcs, (void *) func);
+	if (delay < 1)
+		delay = 1;
+	if (delay > TW_MAX_DELAY)
+		delay = TW_MAX_DELAY;
+	e = timer_wheel_add(obj, (unsigned int) timer + delay, func, arg);
+	return e | timer_wheel.ev[e].gen << TW_ID_BITS;
+}
 
-	line = (char *) malloc(mapxdim + 2);
-	for (y = 0; y < mapydim; y++) {
-		strncpy(line, &terrain_map[txy(0,y)], mapxdim);
-		line[mapxdim] = '\0';
-		printf("%s\n", line);
-	}
-	free(line);
+/* does nothing if the event has already fired or been cancelled */
+void cancel_timer_event(int id)
+{
+	int e = id & TW_ID_MASK;
+
+	if (id < 0 || e >= timer_wheel.size)
+		return;
+	if (timer_wheel.ev[e].gen != id >> TW_ID_BITS)
+		return;
+	cancel_event(e);
 }
 
-/* Terrain related code ends here   */
-/************************************/
+/* cancel everything scheduled for an object, e.g. when it dies */
+void cancel_obj_timer_events(int obj)
+{
+	int e, next;
 
+	if (obj >= timer_wheel.obj_head_size)
+		return;
+	for (e = timer_wheel.obj_head[obj]; e >= 0; e = next) {
+		next = timer_wheel.ev[e].onext;
+		cancel_event(e);
+	}
+}
 
-void generic_destroy_func(struct game_obj_t *o)
+/* move everything in a slot of a higher level down to where it now belongs */
+static void timer_wheel_cascade(int level)
 {
-	/* so far, nothing needs to be done in this. */
-	return;
+	struct timer_wheel *tw = &timer_wheel;
+	int slot = level * TW_SIZE + ((tw->now >> (TW_BITS * level)) & TW_MASK);
+	int e, next;
+
+	e = tw->head[slot];
+	tw->head[slot] = tw->tail[slot] = -1;
+	for (; e >= 0; e = next) {
+		next = tw->ev[e].next;
+		timer_wheel_insert(e);
+	}
 }
 
-/* this is what can draw a list of line segments with line
- * breaks and color changes...  This gets called quite a lot,
- * so try to make sure it's fast.  There is an inline version
- * of this in draw_objs(), btw. 
- */
-void generic_draw(struct game_obj_t *o, GtkWidget *w)
+/* deliver everything which is due, called at the start of each tick */
+void run_timer_events()
 {
-	int j;
-	int x1, y1, x2, y2;
-	
-	int vpx, vpy;
+	struct timer_wheel *tw = &timer_wheel;
+	struct timer_event *ev;
+	int e, i, level, slot;
 
-	vpx = game_state.vp.x;
-	vpy = game_state.vp.y;
+	while (tw->now != (unsigned int) timer) {
+		tw->now++;
+		if (tw->pending == 0)
+			continue;
 
-	gdk_gc_set_foreground(gc, &huex[o->color]);
-	x1 = o->x + o->v->p[0].x - vpx;
-	y1 = o->y + o->v->p[0].y - vpy;  
-	for (j=0;j<o->v->npoints-1;j++) {
-		if (o->v->p[j+1].x == LINE_BREAK) { /* Break in the line segments. */
-			j+=2;
-			x1 = o->x + o->v->p[j].x - vpx;
-			y1 = o->y + o->v->p[j].y - vpy;  
+		/* every TW_SIZE ticks, pull down the next slot of the level above, */
+		/* and so on up. */
+		for (level = 1; level < TW_LEVELS; level++) {
+			if ((tw->now >> (TW_BITS * (level - 1))) & TW_MASK)
+				break;
+			timer_wheel_cascade(level);
 		}
-		if (o->v->p[j].x == COLOR_CHANGE) {
-			gdk_gc_set_foreground(gc, &huex[o->v->p[j].y]);
-			j+=1;
-			x1 = o->x + o->v->p[j].x - vpx;
-			y1 = o->y + o->v->p[j].y - vpy;  
+
+		/* gather up this tick's events, then run them as a batch. */
+		slot = tw->now & TW_MASK;
+		tw->nbatch = 0;
+		for (e = tw->head[slot]; e >= 0; e = tw->ev[e].next) {
+			if (tw->nbatch >= tw->batchsize) {
+				tw->batchsize = tw->batchsize ? tw->batchsize * 2 : 256;
+				tw->batch = (int *) game_realloc(ALLOC_SIM, tw->batch, sizeof(*tw->batch) * tw->batchsize);
+			}
+			tw->batch[tw->nbatch++] = e;
+			tw->ev[e].slot = -1;
 		}
-		x2 = o->x + o->v->p[j+1].x - vpx; 
-		y2 = o->y + o->v->p[j+1].y - vpy;
-		if (x1 > 0 && x2 > 0)
-			wwvi_draw_line(w->window, gc, x1, y1, x2, y2); 
-		x1 = x2;
-		y1 = y2;
+		tw->head[slot] = tw->tail[slot] = -1;
+
+		for (i = 0; i < tw->nbatch; i++) {
+			ev = &tw->ev[tw->batch[i]];
+			if (ev->func)
+				ev->func(ev->obj >= 0 ? gobj(ev->obj) : NULL, ev->arg);
+			/* ev may have moved if func scheduled more events */
+		}
+		for (i = 0; i < tw->nbatch; i++)
+			free_timer_event(tw->batch[i]);
 	}
 }
 
-void player_draw(struct game_obj_t *o, GtkWidget *w)
-{
-	struct my_point_t *temp;
+/* timer wheel code ends     */
+/*****************************/
 
-	temp = o->v->p;
-	o->v->p = &temp[(timer % NANGLES) * o->v->npoints];
-	generic_draw(o, w);
-	o->v->p = temp;
-}
+/*********************************/
+/* collision detection begins    */
+
+/* Everything on the target list can hit everything else on it. */
+/* Broad phase is sweep and prune along x: targets are kept in an */
+/* array sorted by the left edge of their bounding box (from their */
+/* my_vect_obj), which hardly changes from tick to tick, so an */
+/* insertion sort keeps it sorted in about linear time.  Sweeping the */
+/* array then only pairs up things whose x extents overlap.  Pairs */
+/* whose boxes also overlap in y go to the narrow phase, which tests */
+/* the actual line segments of the two shapes against each other, four */
+/* at a time with SSE2 where we have it.  Hits are collected into */
+/* contact[] for game logic to deal with after the pass. */
+
+struct sap_entry {
+	obj_handle_t h;
+	int minx, maxx, miny, maxy;
+};
 
-void player_move(struct game_obj_t *o)
+struct contact {
+	obj_handle_t a, b;
+	int x, y;		/* where, roughly */
+};
+
+struct sap_entry *sap = NULL;	/* targets, sorted by minx */
+int nsap = 0, sapsize = 0;
+unsigned char *in_sap = NULL;	/* per object slot, is it in sap[] */
+int in_sap_size = 0;
+int sap_maxwidth = 0;		/* widest box in sap[], for range queries */
+
+struct contact *contact = NULL;	/* this tick's hits */
+int ncontacts = 0, contactsize = 0;
+
+/* segments of the two shapes being tested, relative to the first */
+/* shape's position.  Padded out to a multiple of 4 for the SIMD kernel. */
+struct segment_list {
+	float *x1, *y1, *x2, *y2;
+	int n, size;
+} seg_a, seg_b;
+
+static void grow_segment_list(struct segment_list *s, int n)
 {
-	o->x += o->vx;
-	o->y += o->vy;
+	if (n <= s->size)
+		return;
+	s->size = (n + 3) & ~3;
+	s->x1 = (float *) game_realloc(ALLOC_SIM, s->x1, sizeof(float) * s->size);
+	s->y1 = (float *) game_realloc(ALLOC_SIM, s->y1, sizeof(float) * s->size);
+	s->x2 = (float *) game_realloc(ALLOC_SIM, s->x2, sizeof(float) * s->size);
+	s->y2 = (float *) game_realloc(ALLOC_SIM, s->y2, sizeof(float) * s->size);
+}
 
-	if (o->x < 0) {
-		o->x = 0;
-		if (o->vx < 0)
-			o->vx = 0;
+/* turn an object's shape into a list of line segments, honoring */
+/* LINE_BREAK and COLOR_CHANGE the same way generic_draw() does. */
+static void get_obj_segments(struct game_obj_t *o, int originx, int originy,
+		struct segment_list *s)
+{
+	int j, npoints = o->v->npoints;
+	struct my_point_t *p = obj_points(o);
+	float ox = o->x - originx;
+	float oy = o->y - originy;
+	float x1, y1;
+
+	grow_segment_list(s, npoints + 4);
+	s->n = 0;
+	x1 = ox + p[0].x;
+	y1 = oy + p[0].y;
+	for (j = 0; j < npoints - 1; j++) {
+		if (p[j+1].x == LINE_BREAK) {
+			j += 2;
+			x1 = ox + p[j].x;
+			y1 = oy + p[j].y;
+		}
+		if (p[j].x == COLOR_CHANGE) {
+			j += 1;
+			x1 = ox + p[j].x;
+			y1 = oy + p[j].y;
+		}
+		s->x1[s->n] = x1;
+		s->y1[s->n] = y1;
+		s->x2[s->n] = x1 = ox + p[j+1].x;
+		s->y2[s->n] = y1 = oy + p[j+1].y;
+		s->n++;
 	}
-	if (o->x > mapxdim*mapsquarewidth) {
-		o->x = mapxdim*mapsquarewidth;
-		if (o->vx > 0)
-			o->vx = 0;
+	/* pad with zero length segments, which never intersect anything */
+	while (s->n & 3) {
+		s->x1[s->n] = s->x2[s->n] = 0.0;
+		s->y1[s->n] = s->y2[s->n] = 0.0;
+		s->n++;
 	}
-	if (o->y < 0) {
-		o->y = 0;
-		if (o->vy < 0)
-			o->vy = 0;
+}
+
+/* Does segment (px,py)+t(rx,ry) hit any of the segments in b?  Returns */
+/* the index of the first one it hits, or -1.  With d = r x s, a hit */
+/* means 0 <= (q-p) x s <= d and 0 <= (q-p) x r <= d, once everything */
+/* is flipped so that d is positive.  Parallel segments (d == 0) don't count. */
+static int segment_hits_segments(float px, float py, float rx, float ry,
+		struct segment_list *b)
+{
+	int i;
+#ifdef __SSE2__
+	__m128 vpx = _mm_set1_ps(px), vpy = _mm_set1_ps(py);
+	__m128 vrx = _mm_set1_ps(rx), vry = _mm_set1_ps(ry);
+	__m128 zero = _mm_setzero_ps();
+	__m128 signbit = _mm_set1_ps(-0.0f);
+	__m128 qx, qy, sx, sy, d, tn, un, sign, hit;
+	int mask;
+
+	for (i = 0; i < b->n; i += 4) {
+		qx = _mm_sub_ps(_mm_loadu_ps(&b->x1[i]), vpx);
+		qy = _mm_sub_ps(_mm_loadu_ps(&b->y1[i]), vpy);
+		sx = _mm_sub_ps(_mm_loadu_ps(&b->x2[i]), _mm_loadu_ps(&b->x1[i]));
+		sy = _mm_sub_ps(_mm_loadu_ps(&b->y2[i]), _mm_loadu_ps(&b->y1[i]));
+		d = _mm_sub_ps(_mm_mul_ps(vrx, sy), _mm_mul_ps(vry, sx));
+		tn = _mm_sub_ps(_mm_mul_ps(qx, sy), _mm_mul_ps(qy, sx));
+		un = _mm_sub_ps(_mm_mul_ps(qx, vry), _mm_mul_ps(qy, vrx));
+		sign = _mm_and_ps(d, signbit);
+		d = _mm_xor_ps(d, sign);
+		tn = _mm_xor_ps(tn, sign);
+		un = _mm_xor_ps(un, sign);
+		hit = _mm_and_ps(_mm_cmpgt_ps(d, zero),
+			_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tn, zero), _mm_cmple_ps(tn, d)),
+				_mm_and_ps(_mm_cmpge_ps(un, zero), _mm_cmple_ps(un, d))));
+		mask = _mm_movemask_ps(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
-	if (o->y > mapydim*mapsquarewidth) {
-		o->y = mapydim*mapsquarewidth;
-		if (o->vy > 0)
-			o->vy = 0;
+#else
+	float qx, qy, sx, sy, d, tn, un;
+
+	for (i = 0; i < b->n; i++) {
+		qx = b->x1[i] - px;
+		qy = b->y1[i] - py;
+		sx = b->x2[i] - b->x1[i];
+		sy = b->y2[i] - b->y1[i];
+		d = rx * sy - ry * sx;
+		tn = qx * sy - qy * sx;
+		un = qx * ry - qy * rx;
+		if (d < 0) {
+			d = -d;
+			tn = -tn;
+			un = -un;
+		}
+		if (d > 0 && tn >= 0 && tn <= d && un >= 0 && un <= d)
+			return i;
 	}
+#endif
+	return -1;
 }
 
-
-/*****************************/
-/* Object adding code begins */
-
-static struct game_obj_t *add_generic_object(int x, int y, int vx, int vy,
-	obj_move_func *move_func,
-	obj_draw_func *draw_func,
-	int color, 
-	struct my_vect_obj *vect, 
-	int target,  /* can this object be a target? hit by laser, etc? */
-	char otype, 
-	int alive)
+static void add_contact(obj_handle_t a, obj_handle_t b, int x, int y)
 {
-	int j;
-	struct game_obj_t *o;
-
-	j = find_free_obj();
-	if (j < 0)
-		return NULL;
-	o = &game_state.go[j];
-	o->x = x;
-	o->y = y;
-	o->vx = vx;
-	o->vy = vy;
-	o->move = move_func;
-	o->draw = draw_func;
-	o->destroy = generic_destroy_func;
-	o->color = color;
-	if (target)
-		add_target(o);
-	else {
-		o->prev = NULL;
-		o->next = NULL;
+	if (ncontacts >= contactsize) {
+		contactsize = contactsize ? contactsize * 2 : 256;
+		contact = (struct contact *) game_realloc(ALLOC_SIM, contact, sizeof(*contact) * contactsize);
 	}
-	o->v = vect;
-	o->otype = otype;
-	o->alive = alive;
-	return o;
+	contact[ncontacts].a = a;
+	contact[ncontacts].b = b;
+	contact[ncontacts].x = x;
+	contact[ncontacts].y = y;
+	ncontacts++;
 }
-/* Object adding code ends */
-/*****************************/
 
-void init_player()
+/* test the real shapes of two objects whose boxes overlap */
+static void narrow_phase(struct game_obj_t *a, struct game_obj_t *b)
 {
-	int i;
-	struct my_point_t *points;
-
-	spin_points(player_vect.p, player_vect.npoints, &points, NANGLES, 0, 0);
-	player_vect.p = points;
-	the_player = add_generic_object(
-		mapxdim * mapsquarewidth / 2, 
-		mapydim * mapsquarewidth / 2,
-		0, 0, player_move, player_draw,
-		YELLOW, &player_vect, 1, OBJ_TYPE_PLAYER, 1);
+	int i, hit;
+
+	get_obj_segments(a, a->x, a->y, &seg_a);
+	get_obj_segments(b, a->x, a->y, &seg_b);
+	for (i = 0; i < seg_a.n; i++) {
+		hit = segment_hits_segments(seg_a.x1[i], seg_a.y1[i],
+			seg_a.x2[i] - seg_a.x1[i], seg_a.y2[i] - seg_a.y1[i], &seg_b);
+		if (hit >= 0) {
+			add_contact(obj_handle(a), obj_handle(b),
+				a->x + (int) seg_b.x1[hit], a->y + (int) seg_b.y1[hit]);
+			return;
+		}
+	}
 }
 
-/**********************************/
-/* keyboard handling stuff begins */
+/* bring sap[] up to date with the target list: drop what's gone, */
+/* add what's new, refresh the boxes and re-sort. */
+static void update_sap()
+{
+	int i, j, n;
+	struct game_obj_t *o;
+	struct sap_entry e;
 
-struct keyname_value_entry {
-	char *name;
-	unsigned int value;
-} keyname_value_map[] = {
-	{ "a", GDK_a }, 
-	{ "b", GDK_b }, 
-	{ "c", GDK_c }, 
-	{ "d", GDK_d }, 
-	{ "e", GDK_e }, 
-	{ "f", GDK_f }, 
-	{ "g", GDK_g }, 
-	{ "h", GDK_h }, 
-	{ "i", GDK_i }, 
-	{ "j", GDK_j }, 
-	{ "k", GDK_k }, 
-	{ "l", GDK_l }, 
-	{ "m", GDK_m }, 
-	{ "n", GDK_n }, 
-	{ "o", GDK_o }, 
-	{ "p", GDK_p }, 
-	{ "q", GDK_q }, 
-	{ "r", GDK_r }, 
-	{ "s", GDK_s }, 
-	{ "t", GDK_t }, 
-	{ "u", GDK_u }, 
-	{ "v", GDK_v }, 
-	{ "w", GDK_w }, 
-	{ "x", GDK_x }, 
-	{ "y", GDK_y }, 
-	{ "z", GDK_z }, 
-	{ "A", GDK_A }, 
-	{ "B", GDK_B }, 
-	{ "C", GDK_C }, 
-	{ "D", GDK_D }, 
-	{ "E", GDK_E }, 
-	{ "F", GDK_F }, 
-	{ "G", GDK_G }, 
-	{ "H", GDK_H }, 
-	{ "I", GDK_I }, 
-	{ "J", GDK_J }, 
-	{ "K", GDK_K }, 
-	{ "L", GDK_L }, 
-	{ "M", GDK_M }, 
-	{ "N", GDK_N }, 
-	{ "O", GDK_O }, 
-	{ "P", GDK_P }, 
-	{ "Q", GDK_Q }, 
-	{ "R", GDK_R }, 
-	{ "S", GDK_S }, 
-	{ "T", GDK_T }, 
-	{ "U", GDK_U }, 
-	{ "V", GDK_V }, 
-	{ "W", GDK_W }, 
-	{ "X", GDK_X }, 
-	{ "Y", GDK_Y }, 
-	{ "Z", GDK_Z }, 
-	{ "0", GDK_0 }, 
-	{ "1", GDK_1 }, 
-	{ "2", GDK_2 }, 
-	{ "3", GDK_3 }, 
-	{ "4", GDK_4 }, 
-	{ "5", GDK_5 }, 
-	{ "6", GDK_6 }, 
-	{ "7", GDK_7 }, 
-	{ "8", GDK_8 }, 
-	{ "9", GDK_9 }, 
-	{ "-", GDK_minus }, 
-	{ "+", GDK_plus }, 
-	{ "=", GDK_equal }, 
-	{ "?", GDK_question }, 
-	{ ".", GDK_period }, 
-	{ ",", GDK_comma }, 
-	{ "<", GDK_less }, 
-	{ ">", GDK_greater }, 
-	{ ":", GDK_colon }, 
-	{ ";", GDK_semicolon }, 
-	{ "@", GDK_at }, 
-	{ "*", GDK_asterisk }, 
-	{ "$", GDK_dollar }, 
-	{ "%", GDK_percent }, 
-	{ "&", GDK_ampersand }, 
-	{ "'", GDK_apostrophe }, 
-	{ "(", GDK_parenleft }, 
-	{ ")", GDK_parenright }, 
-	{ "space", GDK_space }, 
-	{ "enter", GDK_Return }, 
-	{ "return", GDK_Return }, 
-	{ "backspace", GDK_BackSpace }, 
-	{ "delete", GDK_Delete }, 
-	{ "pause", GDK_Pause }, 
-	{ "scrolllock", GDK_Scroll_Lock }, 
-	{ "escape", GDK_Escape }, 
-	{ "sysreq", GDK_Sys_Req }, 
-	{ "left", GDK_Left }, 
-	{ "right", GDK_Right }, 
-	{ "up", GDK_Up }, 
-	{ "down", GDK_Down }, 
-	{ "kp_home", GDK_KP_Home }, 
-	{ "kp_down", GDK_KP_Down }, 
-	{ "kp_up", GDK_KP_Up }, 
-	{ "kp_left", GDK_KP_Left }, 
-	{ "kp_right", GDK_KP_Right }, 
-	{ "kp_end", GDK_KP_End }, 
-	{ "kp_delete", GDK_KP_Delete }, 
-	{ "kp_insert", GDK_KP_Insert }, 
-	{ "home", GDK_Home }, 
-	{ "down", GDK_Down }, 
-	{ "up", GDK_Up }, 
-	{ "left", GDK_Left }, 
-	{ "right", GDK_Right }, 
-	{ "end", GDK_End }, 
-	{ "delete", GDK_Delete }, 
-	{ "insert", GDK_Insert }, 
-	{ "kp_0", GDK_KP_0 }, 
-	{ "kp_1", GDK_KP_1 }, 
-	{ "kp_2", GDK_KP_2 }, 
-	{ "kp_3", GDK_KP_3 }, 
-	{ "kp_4", GDK_KP_4 }, 
-	{ "kp_5", GDK_KP_5 }, 
-	{ "kp_6", GDK_KP_6 }, 
-	{ "kp_7", GDK_KP_7 }, 
-	{ "kp_8", GDK_KP_8 }, 
-	{ "kp_9", GDK_KP_9 }, 
-	{ "f1", GDK_F1 }, 
-	{ "f2", GDK_F2 }, 
-	{ "f3", GDK_F3 }, 
-	{ "f4", GDK_F4 }, 
-	{ "f5", GDK_F5 }, 
-	{ "f6", GDK_F6 }, 
-	{ "f7", GDK_F7 }, 
-	{ "f9", GDK_F9 }, 
-	{ "f9", GDK_F9 }, 
-	{ "f10", GDK_F10 }, 
-	{ "f11", GDK_F11 }, 
-	{ "f12", GDK_F12 }, 
-};
+	if (in_sap_size < obj_capacity) {
+		in_sap = (unsigned char *) game_realloc(ALLOC_SIM, in_sap, obj_capacity);
+		memset(&in_sap[in_sap_size], 0, obj_capacity - in_sap_size);
+		in_sap_size = obj_capacity;
+	}
 
-enum keyaction { keynone, keydown, keyup, keyleft, keyright, 
-		keylaser, keytransform, 
-		keyquarter, keypause, key2, key3, key4, key5, key6,
-		key7, key8, keysuicide, keyfullscreen, keythrust, 
-		keysoundeffects, keymusic, keyquit, keytogglemissilealarm,
-		keypausehelp, keyreverse
-};
+	/* drop whatever died or stopped being a target */
+	n = 0;
+	for (i = 0; i < nsap; i++) {
+		o = obj_lookup(sap[i].h);
+		if (o == NULL || !o->alive || !o->ontargetlist || o->v == NULL) {
+			in_sap[sap[i].h & OBJ_INDEX_MASK] = 0;
+			continue;
+		}
+		sap[n++] = sap[i];
+	}
+	nsap = n;
 
-enum keyaction keymap[256];
-enum keyaction ffkeymap[256];
-unsigned char *keycharmap[256];
+	/* add new targets on the end, the sort will put them in place */
+	for (o = obj_lookup(target_head); o != NULL; o = obj_lookup(o->next)) {
+		if (in_sap[o->number] || !o->alive || o->v == NULL)
+			continue;
+		if (nsap >= sapsize) {
+			sapsize = sapsize ? sapsize * 2 : 256;
+			sap = (struct sap_entry *) game_realloc(ALLOC_SIM, sap, sizeof(*sap) * sapsize);
+		}
+		sap[nsap++].h = obj_handle(o);
+		in_sap[o->number] = 1;
+	}
 
-char *keyactionstring[] = {
-	"none", "down", "up", "left", "right", 
-	"laser", "bomb", "chaff", "gravitybomb",
-	"quarter", "pause", "2x", "3x", "4x", "5x", "6x",
-	"7x", "8x", "suicide", "fullscreen", "thrust", 
-	"soundeffect", "music", "quit", "missilealarm", "help", "reverse"
-};
-void init_keymap()
-{
-	memset(keymap, 0, sizeof(keymap));
-	memset(ffkeymap, 0, sizeof(ffkeymap));
-	memset(keycharmap, 0, sizeof(keycharmap));
+	/* refresh boxes */
+	sap_maxwidth = 0;
+	for (i = 0; i < nsap; i++) {
+		o = obj_lookup(sap[i].h);
+		sap[i].minx = o->x + o->v->minx;
+		sap[i].maxx = o->x + o->v->maxx;
+		sap[i].miny = o->y + o->v->miny;
+		sap[i].maxy = o->y + o->v->maxy;
+		if (sap[i].maxx - sap[i].minx > sap_maxwidth)
+			sap_maxwidth = sap[i].maxx - sap[i].minx;
+	}
 
-	keymap[GDK_j] = keydown;
-	ffkeymap[GDK_Down & 0x00ff] = keydown;
+	/* insertion sort, nearly sorted already from last tick.  Ties go by */
+	/* handle, so the order (and so the order of contacts) doesn't depend */
+	/* on the order things arrived in. */
+	for (i = 1; i < nsap; i++) {
+		e = sap[i];
+		for (j = i - 1; j >= 0 && (sap[j].minx > e.minx ||
+			(sap[j].minx == e.minx && sap[j].h > e.h)); j--)
+			sap[j + 1] = sap[j];
+		sap[j + 1] = e;
+	}
+}
 
-	keymap[GDK_k] = keyup;
-	ffkeymap[GDK_Up & 0x00ff] = keyup;
+/* find all the contacts between targets for this tick */
+void detect_collisions()
+{
+	int i, j;
 
-	keymap[GDK_l] = keyright;
-	ffkeymap[GDK_Right & 0x00ff] = keyright;
-	keymap[GDK_period] = keyright;
-	keymap[GDK_greater] = keyright;
+	ncontacts = 0;
+	update_sap();
+	for (i = 0; i < nsap; i++) {
+		for (j = i + 1; j < nsap && sap[j].minx <= sap[i].maxx; j++) {
+			if (sap[j].miny > sap[i].maxy || sap[j].maxy < sap[i].miny)
+				continue;
+			narrow_phase(obj_lookup(sap[i].h), obj_lookup(sap[j].h));
+		}
+	}
+}
 
-	keymap[GDK_h] = keyleft;
-	ffkeymap[GDK_Left & 0x00ff] = keyleft;
-	keymap[GDK_comma] = keyleft;
-	keymap[GDK_less] = keyleft;
+/* collision detection ends      */
+/*********************************/
 
-	keymap[GDK_space] = keylaser;
-	keymap[GDK_z] = keylaser;
+/*************************************/
+/* random number related code begins */
 
-	keymap[GDK_b] = keytransform;
-	keymap[GDK_x] = keythrust;
-	keymap[GDK_p] = keypause;
-	ffkeymap[GDK_F1 & 0x00ff] = keypausehelp;
-	keymap[GDK_q] = keyquarter;
-	keymap[GDK_m] = keymusic;
-	keymap[GDK_s] = keysoundeffects;
-	ffkeymap[GDK_Escape & 0x00ff] = keyquit;
-	keymap[GDK_1] = keytogglemissilealarm;
+/* The game's own generator (xorshift) rather than random(), so that */
+/* its state can be saved along with the rest of the game, and so every */
+/* copy of the game started with the same seed (see --seed) rolls the */
+/* same numbers.  Only the simulation should use it. */
+#define DEFAULT_SEED 0x2545f491
 
-	keymap[GDK_2] = key2;
-	keymap[GDK_3] = key3;
-	keymap[GDK_4] = key4;
-	keymap[GDK_5] = key5;
-	keymap[GDK_6] = key6;
-	keymap[GDK_7] = key7;
-	keymap[GDK_8] = key8;
-	keymap[GDK_9] = keysuicide;
+unsigned int sim_rng = DEFAULT_SEED;
 
-	ffkeymap[GDK_F11 & 0x00ff] = keyfullscreen;
+static inline unsigned int sim_random()
+{
+	sim_rng ^= sim_rng << 13;
+	sim_rng ^= sim_rng >> 17;
+	sim_rng ^= sim_rng << 5;
+	return sim_rng;
 }
 
-static gint key_press_cb(GtkWidget* widget, GdkEventKey* event, gpointer data)
+/* get a random number between 0 and n-1... fast and loose algorithm.  */
+static inline int randomn(int n)
+{
+        /* return (int) (((random() + 0.0) / (RAND_MAX + 0.0)) * (n + 0.0)); */
+        /* floating point divide?  No. */
+        return ((sim_random() & 0x0000ffff) * n) >> 16;
+}
+
+/* get a random number between a and b. */
+static inline int randomab(int a, int b)
+{
+        int n;
+        n = abs(a - b);
+        return (((sim_random() & 0x0000ffff) * n) >> 16) + min(a,b);
+}
+
+/* random number related code ends   */
+/*************************************/
+
+/************************************/
+/* Terrain related code begins here */
+
+/* The terrain isn't kept a row at a time any more.  The map is cut into */
+/* blocks of TERRAIN_BLOCK x TERRAIN_BLOCK squares, the blocks go row by */
+/* row, and within a block the squares go in Z (Morton) order, x and y */
+/* bits interleaved, so squares which are near each other on the map are */
+/* near each other in memory and "what's around here" stays inside a */
+/* block or two instead of striding down the rows.  A square's type is */
+/* 4 bits, two to a byte, so a whole block of types is 32 bytes; other */
+/* things about a square (height, owner...) go in planes of their own in */
+/* the same order, so code which only wants one of them only pulls that */
+/* one into cache.  Use terrain_index() for where a square lives, and */
+/* terrain_at(), terrain_neighbor() and terrain_for_rect() to look, */
+/* terrain_height_at() and terrain_owner() for the planes. */
+/* txy() is still the row-major number of a square, for the per square */
+/* arrays which aren't terrain (occupancy, influence, the minimap). */
+
+#define TERRAIN_BLOCK_SHIFT 3
+#define TERRAIN_BLOCK (1 << TERRAIN_BLOCK_SHIFT)	/* squares along a block side */
+#define TERRAIN_BLOCK_SQUARES (TERRAIN_BLOCK * TERRAIN_BLOCK)
+#define TERRAIN_KINDS 16	/* a type has to fit in 4 bits */
+
+int mapsquarewidth = (SCREEN_HEIGHT / 8);
+int mapxdim = 64;
+int mapydim = 64;
+
+struct terrain_descriptor_t {
+	char *name;
+	char terrain_type;	/* letter, for printing the map */
+	int color;
+	int move_cost;		/* how many times slower than grass, 0 means impassable */
+	int height;		/* for the height plane when the square is made */
+	int code;		/* 4 bit type code, set by init_terrain_types() */
+};
+
+struct terrain_descriptor_t grass_terrain = 	{ "grass", '.', GREEN, 1, 1, -1 };
+struct terrain_descriptor_t mountain_terrain =	{ "mountains", 'm', WHITE, 4, 3, -1 };
+struct terrain_descriptor_t water_terrain =	{ "water", 'w', CYAN, 0, 0, -1 };
+struct terrain_descriptor_t forest_terrain =	{ "forest", 'f', ORANGE, 2, 1, -1 };
+struct terrain_descriptor_t swamp_terrain =	{ "swamp", 's', DARKGREEN, 3, 0, -1 };
+
+struct terrain_descriptor_t *terrain_type[256];			/* by letter */
+struct terrain_descriptor_t *terrain_kind[TERRAIN_KINDS];	/* by code */
+int nterrain_kinds = 0;
+
+struct terrain_layout {
+	int bxdim, bydim;	/* map size in blocks, rounded up */
+	int nsquares;		/* bxdim * bydim * TERRAIN_BLOCK_SQUARES */
+	unsigned char *type;	/* 4 bits a square, low nibble first */
+	unsigned char *height;	/* one byte a square */
+	unsigned char *owner;	/* side which holds the square, 0 for nobody */
+} terrain;
+
+/* bits of a coordinate within a block, spread out to every other bit */
+static const unsigned char morton_spread[TERRAIN_BLOCK] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+static const int terrain_dx[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };	/* N, NE, E ... like dir8x */
+static const int terrain_dy[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+static inline int txy(int x, int y)
+{
+	return y*mapydim + x;
+}
+
+/* where square x, y lives in terrain.type (as a nibble) and the planes */
+static inline int terrain_index(int x, int y)
+{
+	return (((y >> TERRAIN_BLOCK_SHIFT) * terrain.bxdim + (x >> TERRAIN_BLOCK_SHIFT))
+			<< (2 * TERRAIN_BLOCK_SHIFT)) |
+		morton_spread[x & (TERRAIN_BLOCK - 1)] |
+		(morton_spread[y & (TERRAIN_BLOCK - 1)] << 1);
+}
+
+static inline int terrain_code(int i)
+{
+	return (terrain.type[i >> 1] >> ((i & 1) << 2)) & 0x0f;
+}
+
+static inline void set_terrain_code(int i, int code)
+{
+	int shift = (i & 1) << 2;
+
+	terrain.type[i >> 1] = (terrain.type[i >> 1] & ~(0x0f << shift)) | (code << shift);
+}
+
+/* the terrain at square x, y, which had better be on the map */
+static inline struct terrain_descriptor_t *terrain_at(int x, int y)
+{
+	return terrain_kind[terrain_code(terrain_index(x, y))];
+}
+
+/* the terrain next to square x, y in direction d (0 - 7, clockwise */
+/* from north), or NULL off the edge of the map */
+static inline struct terrain_descriptor_t *terrain_neighbor(int x, int y, int d)
+{
+	x += terrain_dx[d];
+	y += terrain_dy[d];
+	if (x < 0 || y < 0 || x >= mapxdim || y >= mapydim)
+		return NULL;
+	return terrain_at(x, y);
+}
+
+typedef void terrain_visit_func(int x, int y, struct terrain_descriptor_t *t, void *cookie);
+
+/* call f for each square from x1, y1 to x2, y2 inclusive, clipped to */
+/* the map, a block at a time so each block is pulled in once. */
+static inline void terrain_for_rect(int x1, int y1, int x2, int y2,
+	terrain_visit_func *f, void *cookie)
+{
+	int bx, by, x, y, xend, yend, base;
+
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 >= mapxdim)
+		x2 = mapxdim - 1;
+	if (y2 >= mapydim)
+		y2 = mapydim - 1;
+	for (by = y1 & ~(TERRAIN_BLOCK - 1); by <= y2; by += TERRAIN_BLOCK) {
+		yend = by + TERRAIN_BLOCK - 1 < y2 ? by + TERRAIN_BLOCK - 1 : y2;
+		for (bx = x1 & ~(TERRAIN_BLOCK - 1); bx <= x2; bx += TERRAIN_BLOCK) {
+			xend = bx + TERRAIN_BLOCK - 1 < x2 ? bx + TERRAIN_BLOCK - 1 : x2;
+			base = terrain_index(bx, by);
+			for (y = by > y1 ? by : y1; y <= yend; y++)
+				for (x = bx > x1 ? bx : x1; x <= xend; x++)
+					f(x, y, terrain_kind[terrain_code(base |
+						morton_spread[x & (TERRAIN_BLOCK - 1)] |
+						(morton_spread[y & (TERRAIN_BLOCK - 1)] << 1))],
+						cookie);
+		}
+	}
+}
+
+static void add_terrain_type(struct terrain_descriptor_t *t)
+{
+	if (nterrain_kinds >= TERRAIN_KINDS) {
+		fprintf(stderr, "battallica: too many terrain types, %s doesn't fit\n", t->name);
+		exit(1);
+	}
+	t->code = nterrain_kinds;
+	terrain_kind[nterrain_kinds++] = t;
+	terrain_type[(unsigned char) t->terrain_type] = t;
+}
+
+void init_terrain_types()
+{
+	int i;
+	for (i=0;i<256;i++)
+		terrain_type[i] = NULL;
+	nterrain_kinds = 0;
+
+	add_terrain_type(&grass_terrain);	/* first, so a zeroed map is grass */
+	add_terrain_type(&mountain_terrain);
+	add_terrain_type(&water_terrain);
+	add_terrain_type(&forest_terrain);
+	add_terrain_type(&swamp_terrain);
+}
+
+/* move cost of the terrain at game coords x, y.  Off the map is impassable. */
+int terrain_cost_at(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapxdim * mapsquarewidth || y >= mapydim * mapsquarewidth)
+		return 0;
+	return terrain_at(x / mapsquarewidth, y / mapsquarewidth)->move_cost;
+}
+
+/* height of the ground at game coords x, y, 0 off the map */
+int terrain_height_at(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapxdim * mapsquarewidth || y >= mapydim * mapsquarewidth)
+		return 0;
+	return terrain.height[terrain_index(x / mapsquarewidth, y / mapsquarewidth)];
+}
+
+/* which side holds square x, y, 0 for nobody */
+static inline int terrain_owner(int x, int y)
+{
+	return terrain.owner[terrain_index(x, y)];
+}
+
+static inline void set_terrain_owner(int x, int y, int side)
+{
+	terrain.owner[terrain_index(x, y)] = side;
+}
+
+/* make square x, y terrain t, and the planes which follow from it */
+static void put_terrain(int x, int y, struct terrain_descriptor_t *t)
+{
+	int i = terrain_index(x, y);
+
+	set_terrain_code(i, t->code);
+	terrain.height[i] = t->height;
+}
+
+void build_terrain()
+{
+	int i, x, y;
+	char *line;
+
+	terrain.bxdim = (mapxdim + TERRAIN_BLOCK - 1) >> TERRAIN_BLOCK_SHIFT;
+	terrain.bydim = (mapydim + TERRAIN_BLOCK - 1) >> TERRAIN_BLOCK_SHIFT;
+	terrain.nsquares = terrain.bxdim * terrain.bydim * TERRAIN_BLOCK_SQUARES;
+	terrain.type = (unsigned char *) game_malloc(ALLOC_TERRAIN, terrain.nsquares / 2);
+	terrain.height = (unsigned char *) game_malloc(ALLOC_TERRAIN, terrain.nsquares);
+	terrain.owner = (unsigned char *) game_malloc(ALLOC_TERRAIN, terrain.nsquares);
+	memset(terrain.type, (grass_terrain.code << 4) | grass_terrain.code, terrain.nsquares / 2);
+	memset(terrain.height, grass_terrain.height, terrain.nsquares);
+	memset(terrain.owner, 0, terrain.nsquares);
+
+	for (i=0;i<500;i++) {
+		x = randomn(64);
+		y = randomn(64);
+		put_terrain(x, y, &water_terrain);
+	}
+	for (i=0;i<500;i++) {
+		x = randomn(64);
+		y = randomn(64);
+		put_terrain(x, y, &mountain_terrain);
+	}
+	for (i=0;i<500;i++) {
+		x = randomn(64);
+		y = randomn(64);
+		put_terrain(x, y, &swamp_terrain);
+	}
+	for (i=0;i<500;i++) {
+		x = randomn(64);
+		y = randomn(64);
+		put_terrain(x, y, &forest_terrain);
+	}
+
+	line = (char *) game_malloc(ALLOC_TERRAIN, mapxdim + 2);
+	for (y = 0; y < mapydim; y++) {
+		for (x = 0; x < mapxdim; x++)
+			line[x] = terrain_at(x, y)->terrain_type;
+		line[mapxdim] = '\0';
+		printf("%s\n", line);
+	}
+	free(line);
+}
+
+/* Terrain related code ends here   */
+/************************************/
+
+/*****************************/
+/* projectile code begins    */
+
+/* Shots aren't game_obj_t's, there are far too many of them and they */
+/* live far too briefly to go through find_free_obj().  They live in */
+/* their own pool, one array per field, packed so that the live ones */
+/* are always projectiles.x[0] .. x[n-1]; freeing one moves the last */
+/* one into its place.  Shots are fast enough to jump right over a */
+/* target between ticks, so hits are tested along the whole path from */
+/* where the shot was last tick to where it is now, against the */
+/* targets near that path, found via the sweep and prune array. */
+
+#define DEFAULT_MAX_PROJECTILES 65536
+#define PROJECTILE_SPEED 40
+#define PROJECTILE_TTL 30	/* ticks */
+#define PROJECTILE_DAMAGE 10
+
+struct projectile_pool {
+	int *x, *y;		/* where it is */
+	int *ox, *oy;		/* where it was last tick */
+	int *vx, *vy;
+	int *ttl;		/* ticks left to live */
+	int *damage;
+	obj_handle_t *owner;	/* who fired it, it can't hit them */
+	int n, max;
+	int fired, hit, expired, dropped;	/* stats */
+} projectiles;
+
+struct projectile_hit {
+	obj_handle_t target, owner;
+	int x, y;
+	int damage;
+};
+
+struct projectile_hit *proj_hit = NULL;	/* this tick's hits */
+int nproj_hits = 0, proj_hitsize = 0;
+
+/* lines of shots which went away since the last frame, they need erasing */
+struct proj_trail {
+	int x1, y1, x2, y2;
+} *proj_erase = NULL;
+int nproj_erase = 0, proj_erasesize = 0;
+
+void init_projectiles(int max)
+{
+	struct projectile_pool *p = &projectiles;
+
+	memset(p, 0, sizeof(*p));
+	p->max = max;
+	p->x = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->y = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->ox = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->oy = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->vx = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->vy = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->ttl = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->damage = (int *) game_malloc(ALLOC_SIM, sizeof(int) * max);
+	p->owner = (obj_handle_t *) game_malloc(ALLOC_SIM, sizeof(obj_handle_t) * max);
+}
+
+int fire_projectile(obj_handle_t owner, int x, int y, int vx, int vy, int ttl, int damage)
+{
+	struct projectile_pool *p = &projectiles;
+	int i;
+
+	if (p->n >= p->max) {
+		p->dropped++;
+		return -1;
+	}
+	i = p->n++;
+	p->x[i] = p->ox[i] = x;
+	p->y[i] = p->oy[i] = y;
+	p->vx[i] = vx;
+	p->vy[i] = vy;
+	p->ttl[i] = ttl;
+	p->damage[i] = damage;
+	p->owner[i] = owner;
+	p->fired++;
+	return i;
+}
+
+static void free_projectile(int i)
+{
+	struct projectile_pool *p = &projectiles;
+	int last = --p->n;
+
+	if (nproj_erase >= proj_erasesize) {
+		proj_erasesize = proj_erasesize ? proj_erasesize * 2 : 256;
+		proj_erase = (struct proj_trail *) game_realloc(ALLOC_SIM, proj_erase, sizeof(*proj_erase) * proj_erasesize);
+	}
+	proj_erase[nproj_erase].x1 = p->ox[i];
+	proj_erase[nproj_erase].y1 = p->oy[i];
+	proj_erase[nproj_erase].x2 = p->x[i];
+	proj_erase[nproj_erase].y2 = p->y[i];
+	nproj_erase++;
+
+	p->x[i] = p->x[last];
+	p->y[i] = p->y[last];
+	p->ox[i] = p->ox[last];
+	p->oy[i] = p->oy[last];
+	p->vx[i] = p->vx[last];
+	p->vy[i] = p->vy[last];
+	p->ttl[i] = p->ttl[last];
+	p->damage[i] = p->damage[last];
+	p->owner[i] = p->owner[last];
+}
+
+static void add_projectile_hit(obj_handle_t target, int i, int x, int y)
+{
+	struct projectile_pool *p = &projectiles;
+
+	if (nproj_hits >= proj_hitsize) {
+		proj_hitsize = proj_hitsize ? proj_hitsize * 2 : 256;
+		proj_hit = (struct projectile_hit *) game_realloc(ALLOC_SIM, proj_hit, sizeof(*proj_hit) * proj_hitsize);
+	}
+	proj_hit[nproj_hits].target = target;
+	proj_hit[nproj_hits].owner = p->owner[i];
+	proj_hit[nproj_hits].x = x;
+	proj_hit[nproj_hits].y = y;
+	proj_hit[nproj_hits].damage = p->damage[i];
+	nproj_hits++;
+}
+
+/* first entry in sap[] whose minx is >= x */
+static int sap_lower_bound(int x)
+{
+	int lo = 0, hi = nsap, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sap[mid].minx < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Which target, if any, does shot i hit first on its way from (ox,oy) */
+/* to (x,y)?  Returns the sap[] index, -1 if none, and the fraction of */
+/* the way along the path at which it hit in *where. */
+static int projectile_sweep(int i, float *where)
+{
+	struct projectile_pool *p = &projectiles;
+	struct game_obj_t *o;
+	int k, seg, best = -1;
+	int minx, maxx, miny, maxy;
+	float rx, ry, sx, sy, qx, qy, d, t, best_t = 2.0;
+
+	minx = p->ox[i] < p->x[i] ? p->ox[i] : p->x[i];
+	maxx = p->ox[i] < p->x[i] ? p->x[i] : p->ox[i];
+	miny = p->oy[i] < p->y[i] ? p->oy[i] : p->y[i];
+	maxy = p->oy[i] < p->y[i] ? p->y[i] : p->oy[i];
+
+	/* things whose boxes overlap the path's box in x */
+	for (k = sap_lower_bound(minx - sap_maxwidth); k < nsap && sap[k].minx <= maxx; k++) {
+		if (sap[k].maxx < minx || sap[k].miny > maxy || sap[k].maxy < miny)
+			continue;
+		if (sap[k].h == p->owner[i])
+			continue;
+		o = obj_lookup(sap[k].h);
+		if (o == NULL || !o->alive)
+			continue;
+
+		/* path relative to the target, against the target's segments */
+		get_obj_segments(o, o->x, o->y, &seg_b);
+		rx = p->x[i] - p->ox[i];
+		ry = p->y[i] - p->oy[i];
+		seg = segment_hits_segments(p->ox[i] - o->x, p->oy[i] - o->y, rx, ry, &seg_b);
+		if (seg < 0)
+			continue;
+
+		/* how far along the path?  Only matters if several things got hit. */
+		qx = seg_b.x1[seg] - (p->ox[i] - o->x);
+		qy = seg_b.y1[seg] - (p->oy[i] - o->y);
+		sx = seg_b.x2[seg] - seg_b.x1[seg];
+		sy = seg_b.y2[seg] - seg_b.y1[seg];
+		d = rx * sy - ry * sx;
+		t = (qx * sy - qy * sx) / d;
+		if (t < best_t) {
+			best_t = t;
+			best = k;
+		}
+	}
+	*where = best_t;
+	return best;
+}
+
+/* move all the shots and see what they hit.  Runs after detect_collisions() */
+/* so sap[] is up to date. */
+void move_projectiles()
+{
+	struct projectile_pool *p = &projectiles;
+	int i, n, k, maxx, maxy;
+	float t;
+
+	nproj_hits = 0;
+	n = p->n;
+	for (i = 0; i < n; i++) {
+		p->ox[i] = p->x[i];
+		p->oy[i] = p->y[i];
+		p->x[i] += p->vx[i];
+		p->y[i] += p->vy[i];
+		p->ttl[i]--;
+	}
+
+	maxx = mapxdim * mapsquarewidth;
+	maxy = mapydim * mapsquarewidth;
+	i = 0;
+	while (i < p->n) {
+		k = nsap ? projectile_sweep(i, &t) : -1;
+		if (k >= 0) {
+			add_projectile_hit(sap[k].h, i,
+				p->ox[i] + (int) (t * (p->x[i] - p->ox[i])),
+				p->oy[i] + (int) (t * (p->y[i] - p->oy[i])));
+			p->hit++;
+			free_projectile(i);
+			continue;	/* the last one got moved into slot i */
+		}
+		if (p->ttl[i] <= 0 || p->x[i] < 0 || p->x[i] > maxx ||
+			p->y[i] < 0 || p->y[i] > maxy) {
+			p->expired++;
+			free_projectile(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+/* is shot i in view vp? */
+static inline int shot_in_view(int i, struct viewport_t *vp)
+{
+	struct projectile_pool *p = &projectiles;
+
+	return p->x[i] >= vp->x && p->x[i] <= vp->x + vp->width &&
+		p->y[i] >= vp->y && p->y[i] <= vp->y + vp->height;
+}
+
+/* draw the given shots, which are in draw_vp */
+void draw_projectiles(int *shots, int n)
+{
+	struct projectile_pool *p = &projectiles;
+	struct viewport_t *vp = draw_vp;
+	int i, j, cx = vp->x + vp->width / 2, cy = vp->y + vp->height / 2;
+	int dx = vp->sx - vp->x, dy = vp->sy - vp->y;
+
+	for (j = 0; j < n; j++) {
+		i = shots[j];
+		/* ttl + timer stays the same for a shot's whole life, */
+		/* so it's always the same half which goes undrawn */
+		if (quality >= QUALITY_FEW_SHOTS && ((p->ttl[i] + timer) & 1) &&
+			(abs(p->x[i] - cx) > QUALITY_NEAR_SHOTS || abs(p->y[i] - cy) > QUALITY_NEAR_SHOTS))
+			continue;
+		batch_line(YELLOW, p->ox[i] + dx, p->oy[i] + dy, p->x[i] + dx, p->y[i] + dy);
+	}
+}
+
+/* fire from the nose of an object which is using a spun vect like the player's */
+void fire_from_nose(struct game_obj_t *o)
+{
+	double angle = (2.0 * 3.1415927 * (o->bearing % NANGLES)) / NANGLES;
+	int dx, dy;
+
+	/* the nose points up, (0,-1), when bearing is 0 */
+	dx = (int) (sin(angle) * PROJECTILE_SPEED);
+	dy = (int) (-cos(angle) * PROJECTILE_SPEED);
+	fire_projectile(obj_handle(o), o->x, o->y, o->vx + dx, o->vy + dy,
+		PROJECTILE_TTL, PROJECTILE_DAMAGE);
+}
+
+void print_projectile_stats()
+{
+	struct projectile_pool *p = &projectiles;
+
+	if (p->fired == 0)
+		return;
+	printf("projectiles: %d fired, %d hit, %d expired, %d dropped (pool of %d)\n",
+		p->fired, p->hit, p->expired, p->dropped, p->max);
+}
+
+/* projectile code ends      */
+/*****************************/
+
+/******************************/
+/* influence map code begins  */
+
+/* How strong each side is, square by square.  Everything on a side */
+/* stamps a little pyramid of its type's influence, centered on its */
+/* square, into its side's raw map, and unstamps it when it leaves the */
+/* square, so keeping the maps up to date costs in proportion to how */
+/* much moves, not to how much there is.  Every INFLUENCE_PERIOD ticks */
+/* a copy of the raw maps is blurred, on a thread of its own, to spread */
+/* the influence out a bit further, and the result replaces the maps */
+/* influence_at() reads INFLUENCE_PERIOD ticks later (waiting for the */
+/* thread if it isn't done), so what the AI sees at each tick doesn't */
+/* depend on how fast the thread is.  Networked games rely on that. */
+
+#define INFLUENCE_RADIUS 3	/* squares */
+#define INFLUENCE_PERIOD 8	/* ticks between blurs */
+#define INFLUENCE_BLUR_PASSES 2
+
+struct influence_maps {
+	int *raw[NSIDES];		/* stamped right now, by tile */
+	float *front[NSIDES];		/* blurred, what influence_at() reads */
+	float *back[NSIDES];		/* the blur thread writes these */
+	float *snapshot[NSIDES];	/* the copy of raw the blur thread reads */
+	float *scratch;
+	int threaded;
+	GMutex lock;
+	GCond go, done;
+	int state;			/* INFLUENCE_IDLE etc, under lock */
+	int blurs;
+	long long blur_usecs;		/* on the blur thread */
+	long long stamps;
+} influence;
+
+#define INFLUENCE_IDLE 0	/* nothing going on */
+#define INFLUENCE_QUEUED 1	/* snapshot taken, blur thread busy with it */
+#define INFLUENCE_READY 2	/* back has a fresh blur in it */
+
+/* add (or with a negative strength, remove) a pyramid at tile */
+static void influence_stamp(int *map, int tile, int strength)
+{
+	int tx = tile % mapxdim, ty = tile / mapxdim;
+	int x, y, d, dx, dy;
+
+	for (y = ty - INFLUENCE_RADIUS; y <= ty + INFLUENCE_RADIUS; y++) {
+		if (y < 0 || y >= mapydim)
+			continue;
+		dy = abs(y - ty);
+		for (x = tx - INFLUENCE_RADIUS; x <= tx + INFLUENCE_RADIUS; x++) {
+			if (x < 0 || x >= mapxdim)
+				continue;
+			dx = abs(x - tx);
+			d = dx > dy ? dx : dy;
+			map[txy(x, y)] += strength * (INFLUENCE_RADIUS + 1 - d);
+		}
+	}
+	influence.stamps++;
+}
+
+/* o moved from square "from" to square "to", either may be -1 for none */
+static inline void influence_move(struct game_obj_t *o, int from, int to)
+{
+	struct obj_type_t *t = obj_type[(unsigned char) o->otype];
+
+	if (t == NULL || t->side == 0 || t->influence == 0 || influence.raw[0] == NULL)
+		return;
+	if (from >= 0)
+		influence_stamp(influence.raw[t->side - 1], from, -t->influence);
+	if (to >= 0)
+		influence_stamp(influence.raw[t->side - 1], to, t->influence);
+}
+
+/* how strong side is at tile, as of the last blur */
+static inline float influence_at(int side, int tile)
+{
+	return influence.front[side - 1][tile];
+}
+
+/* one [1 2 1] / 4 pass along the rows of in, into out */
+static void blur_rows(const float *in, float *out)
+{
+	int x, y;
+	const float *r;
+	float *o;
+#ifdef __SSE2__
+	__m128 quarter = _mm_set1_ps(0.25f), half = _mm_set1_ps(0.5f);
+#endif
+
+	for (y = 0; y < mapydim; y++) {
+		r = &in[txy(0, y)];
+		o = &out[txy(0, y)];
+		o[0] = 0.75f * r[0] + 0.25f * r[1];	/* edges count themselves twice */
+		x = 1;
+#ifdef __SSE2__
+		for (; x + 4 <= mapxdim - 1; x += 4)
+			_mm_storeu_ps(&o[x], _mm_add_ps(_mm_mul_ps(half, _mm_loadu_ps(&r[x])),
+				_mm_mul_ps(quarter, _mm_add_ps(_mm_loadu_ps(&r[x - 1]),
+					_mm_loadu_ps(&r[x + 1])))));
+#endif
+		for (; x < mapxdim - 1; x++)
+			o[x] = 0.5f * r[x] + 0.25f * (r[x - 1] + r[x + 1]);
+		o[mapxdim - 1] = 0.75f * r[mapxdim - 1] + 0.25f * r[mapxdim - 2];
+	}
+}
+
+/* and down the columns */
+static void blur_columns(const float *in, float *out)
+{
+	int x, y;
+	const float *above, *r, *below;
+	float *o;
+#ifdef __SSE2__
+	__m128 quarter = _mm_set1_ps(0.25f), half = _mm_set1_ps(0.5f);
+#endif
+
+	for (y = 0; y < mapydim; y++) {
+		r = &in[txy(0, y)];
+		above = y > 0 ? &in[txy(0, y - 1)] : r;
+		below = y < mapydim - 1 ? &in[txy(0, y + 1)] : r;
+		o = &out[txy(0, y)];
+		x = 0;
+#ifdef __SSE2__
+		for (; x + 4 <= mapxdim; x += 4)
+			_mm_storeu_ps(&o[x], _mm_add_ps(_mm_mul_ps(half, _mm_loadu_ps(&r[x])),
+				_mm_mul_ps(quarter, _mm_add_ps(_mm_loadu_ps(&above[x]),
+					_mm_loadu_ps(&below[x])))));
+#endif
+		for (; x < mapxdim; x++)
+			o[x] = 0.5f * r[x] + 0.25f * (above[x] + below[x]);
+	}
+}
+
+static void blur_influence()
+{
+	int side, i;
+	long long start = usecs_now(), tstart = trace_begin();
+
+	for (side = 0; side < NSIDES; side++) {
+		blur_rows(influence.snapshot[side], influence.scratch);
+		blur_columns(influence.scratch, influence.back[side]);
+		for (i = 1; i < INFLUENCE_BLUR_PASSES; i++) {
+			blur_rows(influence.back[side], influence.scratch);
+			blur_columns(influence.scratch, influence.back[side]);
+		}
+	}
+	influence.blurs++;
+	influence.blur_usecs += usecs_now() - start;
+	trace_end("blur_influence", tstart, influence.blurs);
+}
+
+static gpointer influence_thread(gpointer data)
+{
+	trace_register_thread("influence");
+	g_mutex_lock(&influence.lock);
+	for (;;) {
+		while (influence.state != INFLUENCE_QUEUED)
+			g_cond_wait(&influence.go, &influence.lock);
+		g_mutex_unlock(&influence.lock);
+		blur_influence();
+		g_mutex_lock(&influence.lock);
+		influence.state = INFLUENCE_READY;
+		g_cond_signal(&influence.done);
+	}
+	return NULL;
+}
+
+/* wait for the blur thread to finish whatever it's doing */
+void influence_wait()
+{
+	if (!influence.threaded)
+		return;
+	g_mutex_lock(&influence.lock);
+	while (influence.state == INFLUENCE_QUEUED)
+		g_cond_wait(&influence.done, &influence.lock);
+	g_mutex_unlock(&influence.lock);
+}
+
+/* called once a tick, after things have moved */
+void update_influence()
+{
+	float *t;
+	int side, i, n = mapxdim * mapydim;
+
+	if (influence.raw[0] == NULL || timer % INFLUENCE_PERIOD)
+		return;
+	influence_wait();
+	if (influence.threaded)
+		g_mutex_lock(&influence.lock);
+
+	/* last time's blur is due now */
+	if (influence.state == INFLUENCE_READY) {
+		for (side = 0; side < NSIDES; side++) {
+			t = influence.front[side];
+			influence.front[side] = influence.back[side];
+			influence.back[side] = t;
+		}
+		influence.state = INFLUENCE_IDLE;
+	}
+
+	for (side = 0; side < NSIDES; side++)
+		for (i = 0; i < n; i++)
+			influence.snapshot[side][i] = influence.raw[side][i];
+	if (!influence.threaded) {
+		blur_influence();
+		influence.state = INFLUENCE_READY;
+		return;
+	}
+	influence.state = INFLUENCE_QUEUED;
+	g_cond_signal(&influence.go);
+	g_mutex_unlock(&influence.lock);
+}
+
+void init_influence()
+{
+	int side, n = mapxdim * mapydim;
+
+	for (side = 0; side < NSIDES; side++) {
+		influence.raw[side] = (int *) game_malloc(ALLOC_INFLUENCE, sizeof(int) * n);
+		influence.front[side] = (float *) game_malloc(ALLOC_INFLUENCE, sizeof(float) * n);
+		influence.back[side] = (float *) game_malloc(ALLOC_INFLUENCE, sizeof(float) * n);
+		influence.snapshot[side] = (float *) game_malloc(ALLOC_INFLUENCE, sizeof(float) * n);
+		memset(influence.raw[side], 0, sizeof(int) * n);
+		memset(influence.front[side], 0, sizeof(float) * n);
+	}
+	influence.scratch = (float *) game_malloc(ALLOC_INFLUENCE, sizeof(float) * n);
+	influence.state = INFLUENCE_IDLE;
+	influence.threaded = 0;
+}
+
+/* blur on a thread of its own from now on.  Needs g_thread_init() done. */
+void start_influence_thread()
+{
+	GThread *t;
+
+	g_mutex_init(&influence.lock);
+	g_cond_init(&influence.go);
+	g_cond_init(&influence.done);
+	t = g_thread_try_new("influence", influence_thread, NULL, NULL);
+	influence.threaded = t != NULL;
+	if (t)
+		g_thread_unref(t);
+}
+
+void print_influence_stats()
+{
+	if (influence.blurs == 0)
+		return;
+	printf("influence: %lld stamps, %d blurs at %.1f usecs each\n",
+		influence.stamps, influence.blurs, (double) influence.blur_usecs / influence.blurs);
+}
+
+/* influence map code ends    */
+/******************************/
+
+/***************************/
+/* Minimap code begins     */
+
+/* The minimap is a little picture of the whole terrain with blobs */
+/* where the units are.  The terrain part is rendered once into a pixmap, */
+/* and the unit blobs come from tile_occupancy, a count of objects per */
+/* terrain square which is kept up to date as objects cross squares in */
+/* the move pass.  Only squares which actually changed get redrawn, so */
+/* the per frame cost doesn't depend on map size or number of units. */
+
+#define MINIMAP_TILE_PIXELS 3	/* pixels per terrain square on the minimap */
+#define MINIMAP_DIRTY_UNITS 0x01	/* occupancy of this square changed */
+#define MINIMAP_DIRTY_TERRAIN 0x02	/* terrain of this square changed */
+#define MINIMAP_DIRTY_QUEUED 0x80	/* on minimap_dirty_list, till it drains */
+
+GtkWidget *minimap_da = NULL;		/* minimap drawing area */
+GdkGC *minimap_gc = NULL;
+GdkPixmap *minimap_terrain = NULL;	/* just the terrain, drawn once */
+GdkPixmap *minimap_pixmap = NULL;	/* terrain + unit blobs, this is what's shown */
+unsigned short *tile_occupancy = NULL;	/* number of objects in each terrain square */
+unsigned char *minimap_dirty = NULL;	/* MINIMAP_DIRTY_* flags per terrain square */
+int *minimap_dirty_list = NULL;		/* squares with MINIMAP_DIRTY_QUEUED set */
+int minimap_ndirty = 0;
+GdkRectangle minimap_vp_rect;		/* where the viewport outline was last drawn */
+
+void init_minimap()
+{
+	int n = mapxdim * mapydim;
+
+	tile_occupancy = (unsigned short *) game_malloc(ALLOC_DRAW, sizeof(*tile_occupancy) * n);
+	minimap_dirty = (unsigned char *) game_malloc(ALLOC_DRAW, sizeof(*minimap_dirty) * n);
+	minimap_dirty_list = (int *) game_malloc(ALLOC_DRAW, sizeof(*minimap_dirty_list) * n);
+	memset(tile_occupancy, 0, sizeof(*tile_occupancy) * n);
+	memset(minimap_dirty, 0, sizeof(*minimap_dirty) * n);
+	minimap_ndirty = 0;
+	memset(&minimap_vp_rect, 0, sizeof(minimap_vp_rect));
+}
+
+static inline void minimap_mark_dirty(int tile, unsigned char why)
+{
+	if (minimap_dirty == NULL)
+		return;
+	/* not just !minimap_dirty[tile], realize_minimap() can clear a */
+	/* square's flags while it's still on the list */
+	if (!(minimap_dirty[tile] & MINIMAP_DIRTY_QUEUED))
+		minimap_dirty_list[minimap_ndirty++] = tile;
+	minimap_dirty[tile] |= why | MINIMAP_DIRTY_QUEUED;
+}
+
+/* change the terrain of a square, keeping the minimap in sync. */
+void set_terrain(int x, int y, char t)
+{
+	struct terrain_descriptor_t *d = terrain_type[(unsigned char) t];
+
+	if (d == NULL || terrain_at(x, y) == d)
+		return;
+	put_terrain(x, y, d);
+	minimap_mark_dirty(txy(x,y), MINIMAP_DIRTY_TERRAIN);
+}
+
+/* which terrain square is this object in? */
+static inline int obj_tile(struct game_obj_t *o)
+{
+	int tx, ty;
+
+	tx = o->x / mapsquarewidth;
+	ty = o->y / mapsquarewidth;
+	if (tx < 0)
+		tx = 0;
+	else if (tx >= mapxdim)
+		tx = mapxdim - 1;
+	if (ty < 0)
+		ty = 0;
+	else if (ty >= mapydim)
+		ty = mapydim - 1;
+	return txy(tx, ty);
+}
+
+/* called from the move pass, keeps tile_occupancy up to date.  Cheap */
+/* when the object hasn't left its square, which is almost always. */
+static inline void update_obj_tile(struct game_obj_t *o)
+{
+	int t;
+
+	if (tile_occupancy == NULL)
+		return;
+	t = obj_tile(o);
+	if (t == o->tile)
+		return;
+	influence_move(o, o->tile, t);
+	if (o->tile >= 0) {
+		tile_occupancy[o->tile]--;
+		minimap_mark_dirty(o->tile, MINIMAP_DIRTY_UNITS);
+	}
+	tile_occupancy[t]++;
+	minimap_mark_dirty(t, MINIMAP_DIRTY_UNITS);
+	o->tile = t;
+}
+
+/* called when an object goes away */
+void forget_obj_tile(struct game_obj_t *o)
+{
+	if (tile_occupancy == NULL || o->tile < 0)
+		return;
+	influence_move(o, o->tile, -1);
+	tile_occupancy[o->tile]--;
+	minimap_mark_dirty(o->tile, MINIMAP_DIRTY_UNITS);
+	o->tile = -1;
+}
+
+static void minimap_draw_terrain_tile(int x, int y)
+{
+	gdk_gc_set_foreground(minimap_gc, &huex[terrain_at(x, y)->color]);
+	gdk_draw_rectangle(minimap_terrain, minimap_gc, TRUE,
+		x * MINIMAP_TILE_PIXELS, y * MINIMAP_TILE_PIXELS,
+		MINIMAP_TILE_PIXELS, MINIMAP_TILE_PIXELS);
+}
+
+/* bring one square of minimap_pixmap up to date from minimap_terrain */
+/* and tile_occupancy, and invalidate it so it gets exposed. */
+static void minimap_draw_tile(int tile)
+{
+	int x, y, n, color;
+	GdkRectangle r;
+
+	x = tile % mapxdim;
+	y = tile / mapxdim;
+	if (minimap_dirty[tile] & MINIMAP_DIRTY_TERRAIN)
+		minimap_draw_terrain_tile(x, y);
+
+	r.x = x * MINIMAP_TILE_PIXELS;
+	r.y = y * MINIMAP_TILE_PIXELS;
+	r.width = MINIMAP_TILE_PIXELS;
+	r.height = MINIMAP_TILE_PIXELS;
+	gdk_draw_drawable(minimap_pixmap, minimap_gc, minimap_terrain,
+		r.x, r.y, r.x, r.y, r.width, r.height);
+
+	n = tile_occupancy[tile];
+	if (n > 0) {
+		if (n < 3)
+			color = YELLOW;
+		else if (n < 10)
+			color = ORANGE;
+		else
+			color = RED;
+		gdk_gc_set_foreground(minimap_gc, &huex[color]);
+		gdk_draw_rectangle(minimap_pixmap, minimap_gc, TRUE,
+			r.x, r.y, r.width, r.height);
+	}
+	gdk_window_invalidate_rect(minimap_da->window, &r, FALSE);
+}
+
+/* called once, after the minimap window exists and colors are allocated. */
+void realize_minimap()
+{
+	int x, y, w, h;
+
+	w = mapxdim * MINIMAP_TILE_PIXELS;
+	h = mapydim * MINIMAP_TILE_PIXELS;
+	minimap_gc = gdk_gc_new(minimap_da->window);
+	minimap_terrain = gdk_pixmap_new(minimap_da->window, w, h, -1);
+	minimap_pixmap = gdk_pixmap_new(minimap_da->window, w, h, -1);
+
+	/* This is the only time the whole terrain gets drawn. */
+	for (y = 0; y < mapydim; y++)
+		for (x = 0; x < mapxdim; x++)
+			minimap_draw_terrain_tile(x, y);
+	gdk_draw_drawable(minimap_pixmap, minimap_gc, minimap_terrain, 0, 0, 0, 0, w, h);
+
+	/* terrain changes so far are already drawn, but unit blobs aren't. */
+	for (x = 0; x < minimap_ndirty; x++)
+		minimap_dirty[minimap_dirty_list[x]] &= ~MINIMAP_DIRTY_TERRAIN;
+	for (x = 0; x < mapxdim * mapydim; x++)
+		if (tile_occupancy[x])
+			minimap_mark_dirty(x, MINIMAP_DIRTY_UNITS);
+	gtk_widget_queue_draw(minimap_da);
+}
+
+/* where the viewport is, in minimap pixels */
+static void minimap_viewport_rect(GdkRectangle *r)
+{
+	struct viewport_t *vp = &game_state.vp;
+
+	r->x = vp->x * MINIMAP_TILE_PIXELS / mapsquarewidth;
+	r->y = vp->y * MINIMAP_TILE_PIXELS / mapsquarewidth;
+	r->width = vp->width * MINIMAP_TILE_PIXELS / mapsquarewidth;
+	r->height = vp->height * MINIMAP_TILE_PIXELS / mapsquarewidth;
+}
+
+/* called once per frame, does work only for squares which changed. */
+void update_minimap()
+{
+	int i;
+	GdkRectangle r;
+
+	if (minimap_pixmap == NULL)
+		return;
+
+	for (i = 0; i < minimap_ndirty; i++) {
+		minimap_draw_tile(minimap_dirty_list[i]);
+		minimap_dirty[minimap_dirty_list[i]] = 0;
+	}
+	minimap_ndirty = 0;
+
+	/* the viewport outline is drawn at expose time, just invalidate */
+	/* where it was and where it is, if it moved. */
+	minimap_viewport_rect(&r);
+	if (r.x != minimap_vp_rect.x || r.y != minimap_vp_rect.y ||
+		r.width != minimap_vp_rect.width || r.height != minimap_vp_rect.height) {
+		minimap_vp_rect.width++; /* outline is 1 pixel bigger than the rect */
+		minimap_vp_rect.height++;
+		gdk_window_invalidate_rect(minimap_da->window, &minimap_vp_rect, FALSE);
+		minimap_vp_rect = r;
+		r.width++;
+		r.height++;
+		gdk_window_invalidate_rect(minimap_da->window, &r, FALSE);
+	}
+}
+
+#ifndef BATTALLICA_BENCH
+static int minimap_expose(GtkWidget *w, GdkEventExpose *event, gpointer p)
+{
+	if (minimap_pixmap == NULL)
+		return FALSE;
+	gdk_draw_drawable(w->window, minimap_gc, minimap_pixmap,
+		event->area.x, event->area.y, event->area.x, event->area.y,
+		event->area.width, event->area.height);
+	gdk_gc_set_foreground(minimap_gc, &huex[WHITE]);
+	gdk_draw_rectangle(w->window, minimap_gc, FALSE,
+		minimap_vp_rect.x, minimap_vp_rect.y,
+		minimap_vp_rect.width, minimap_vp_rect.height);
+	return TRUE;
+}
+#endif
+
+/* Minimap code ends       */
+/***************************/
+
+
+void generic_destroy_func(struct game_obj_t *o)
+{
+	forget_obj_tile(o);
+	cancel_obj_timer_events(o->number);
+}
+
+/* this is what can draw a list of line segments with line
+ * breaks and color changes...  This gets called quite a lot,
+ * so try to make sure it's fast.  There is an inline version
+ * of this in draw_objs(), btw. 
+ */
+void generic_draw(struct game_obj_t *o, GtkWidget *w)
+{
+	int j;
+	int x1, y1, x2, y2;
+	struct my_point_t *p = obj_points(o);
+	
+	int vpx, vpy;
+
+	vpx = draw_vp->x - draw_vp->sx;
+	vpy = draw_vp->y - draw_vp->sy;
+
+	wwvi_set_foreground(gc, &huex[o->color]);
+	xrequests++;
+	x1 = o->x + p[0].x - vpx;
+	y1 = o->y + p[0].y - vpy;  
+	for (j=0;j<o->v->npoints-1;j++) {
+		if (p[j+1].x == LINE_BREAK) { /* Break in the line segments. */
+			j+=2;
+			x1 = o->x + p[j].x - vpx;
+			y1 = o->y + p[j].y - vpy;  
+		}
+		if (p[j].x == COLOR_CHANGE) {
+			wwvi_set_foreground(gc, &huex[p[j].y]);
+			xrequests++;
+			j+=1;
+			x1 = o->x + p[j].x - vpx;
+			y1 = o->y + p[j].y - vpy;  
+		}
+		x2 = o->x + p[j+1].x - vpx; 
+		y2 = o->y + p[j+1].y - vpy;
+		if (x1 > 0 && x2 > 0) {
+			wwvi_draw_line(w->window, gc, x1, y1, x2, y2); 
+			xrequests++;
+		}
+		x1 = x2;
+		y1 = y2;
+	}
+}
+
+/* same as generic_draw, but for a whole batch of objects, and the */
+/* lines go into the segment batches instead of straight to X. */
+void generic_draw_batch(struct game_obj_t **objs, int n, GtkWidget *w)
+{
+	int i, j, color, npoints;
+	int x1, y1, x2, y2;
+	int ox, oy;
+	struct game_obj_t *o;
+	struct my_point_t *p;
+
+	for (i = 0; i < n; i++) {
+		o = objs[i];
+		p = obj_points(o);
+		npoints = o->v->npoints;
+		ox = o->x - draw_vp->x + draw_vp->sx;
+		oy = o->y - draw_vp->y + draw_vp->sy;
+		color = o->color;
+		if (quality >= QUALITY_LOW_LOD) {
+			if (ox > 0) {
+				batch_line(color, ox + o->v->minx, oy, ox + o->v->maxx, oy);
+				batch_line(color, ox, oy + o->v->miny, ox, oy + o->v->maxy);
+			}
+			continue;
+		}
+		x1 = ox + p[0].x;
+		y1 = oy + p[0].y;
+		for (j=0;j<npoints-1;j++) {
+			if (p[j+1].x == LINE_BREAK) { /* Break in the line segments. */
+				j+=2;
+				x1 = ox + p[j].x;
+				y1 = oy + p[j].y;
+			}
+			if (p[j].x == COLOR_CHANGE) {
+				color = p[j].y;
+				j+=1;
+				x1 = ox + p[j].x;
+				y1 = oy + p[j].y;
+			}
+			x2 = ox + p[j+1].x; 
+			y2 = oy + p[j+1].y;
+			if (x1 > 0 && x2 > 0)
+				batch_line(color, x1, y1, x2, y2); 
+			x1 = x2;
+			y1 = y2;
+		}
+	}
+}
+
+void player_draw(struct game_obj_t *o, GtkWidget *w)
+{
+	generic_draw(o, w);	/* obj_points() picks the rotation from o->bearing */
+}
+
+/* stop things at the edge of the map */
+/* pull a point, in world coords, onto the map */
+static inline void clamp_to_map(int *x, int *y)
+{
+	if (*x < 0)
+		*x = 0;
+	else if (*x >= mapxdim * mapsquarewidth)
+		*x = mapxdim * mapsquarewidth - 1;
+	if (*y < 0)
+		*y = 0;
+	else if (*y >= mapydim * mapsquarewidth)
+		*y = mapydim * mapsquarewidth - 1;
+}
+
+static inline void keep_on_map(struct game_obj_t *o)
+{
+	if (o->x < 0) {
+		o->x = 0;
+		if (o->vx < 0)
+			o->vx = 0;
+	}
+	if (o->x > mapxdim*mapsquarewidth) {
+		o->x = mapxdim*mapsquarewidth;
+		if (o->vx > 0)
+			o->vx = 0;
+	}
+	if (o->y < 0) {
+		o->y = 0;
+		if (o->vy < 0)
+			o->vy = 0;
+	}
+	if (o->y > mapydim*mapsquarewidth) {
+		o->y = mapydim*mapsquarewidth;
+		if (o->vy > 0)
+			o->vy = 0;
+	}
+}
+
+void player_move(struct game_obj_t *o)
+{
+	/* spins while it's going somewhere, so a player sitting still */
+	/* doesn't keep the game awake, see idle_after_tick() */
+	if (o->vx || o->vy)
+		o->bearing = (o->bearing + 1) % NANGLES;
+	o->x += o->vx;
+	o->y += o->vy;
+	keep_on_map(o);
+}
+
+
+/*****************************/
+/* Object adding code begins */
+
+static struct game_obj_t *add_generic_object(int x, int y, int vx, int vy,
+	obj_move_func *move_func,
+	obj_draw_func *draw_func,
+	int color, 
+	struct my_vect_obj *vect, 
+	int target,  /* can this object be a target? hit by laser, etc? */
+	char otype, 
+	int alive)
+{
+	int j;
+	struct game_obj_t *o;
+	struct obj_type_t *t = obj_type[(unsigned char) otype];
+
+	sim_require(&sim_move_funcs, (void *) move_func);
+	sim_require(&sim_draw_funcs, (void *) draw_func);
+	sim_require(&sim_vects, vect);
+	if (t && t->count >= t->max)	/* this type's pool is full */
+		return NULL;
+	j = find_free_obj();
+	if (j < 0)
+		return NULL;
+	o = gobj(j);
+	o->number = j;
+	if (o->generation == 0)	/* first use of this slot */
+		o->generation = 1;
+	o->cold = -1;
+	if (t) {
+		t->count++;
+		if (t->cold_size > 0) {
+			o->cold = alloc_cold(t);
+			memset(&t->cold[o->cold * t->cold_size], 0, t->cold_size);
+		}
+	}
+	o->x = x;
+	o->y = y;
+	o->vx = vx;
+	o->vy = vy;
+	o->move = move_func;
+	o->draw = draw_func;
+	o->color = color;
+	if (target)
+		add_target(o);
+	else {
+		o->prev = NO_OBJ;
+		o->next = NO_OBJ;
+	}
+	o->v = vect;
+	o->otype = otype;
+	o->alive = alive;
+	if (obj_health(o)) {
+		obj_health(o)->hp = t->maxhp;
+		obj_health(o)->maxhp = t->maxhp;
+	}
+	o->tile = -1;	/* the move pass will find it a square */
+	o->bearing = 0;
+	memset(&o->drawn, 0, sizeof(o->drawn));	/* not on screen yet */
+	o->drawn_bearing = 0;
+	live_objects++;
+	if (live_objects > peak_live_objects)
+		peak_live_objects = live_objects;
+	return o;
+}
+
+/* get rid of an object and free its slot.  Handles to it stop working. */
+void kill_object(struct game_obj_t *o)
+{
+	struct obj_type_t *t = obj_type[(unsigned char) o->otype];
+
+	if (o->generation == 0 || !(free_obj_bitmap[o->number >> 5] & (1 << (o->number & 31))))
+		return;	/* already free */
+	if (o->ontargetlist)
+		remove_target(o);
+	if (t && t->destroy)
+		t->destroy(o);
+	else
+		generic_destroy_func(o);
+	if (t) {
+		t->count--;
+		if (o->cold >= 0)
+			t->cold_free[t->ncold_free++] = o->cold;
+	}
+	o->cold = -1;
+	o->alive = 0;
+	o->generation = (o->generation + 1) & OBJ_GEN_MASK;
+	if (o->generation == 0)
+		o->generation = 1;
+	clearbit(&free_obj_bitmap[o->number >> 5], o->number & 31);
+	if ((o->number >> 5) < first_free_block)
+		first_free_block = o->number >> 5;
+	live_objects--;
+}
+/* Object adding code ends */
+/*****************************/
+
+/*************************/
+/* combat code begins    */
+
+/* Anything which wants to hurt something this tick says so by adding */
+/* an attack intent, rather than poking at the victim's health there and */
+/* then.  Once movement and hit testing are done, resolve_combat() bins */
+/* the intents by target, applies each bin's damage (bins in parallel; */
+/* all of a target's intents land in the same bin, so nothing needs */
+/* locking), then kills whatever ran out of health, all in one go. */
+/* Binning is a stable counting sort and each bin is applied in order, */
+/* so the outcome doesn't depend on how many threads there are. */
+
+#define COMBAT_BINS 256
+#define COMBAT_PARTS 32		/* COMBAT_BINS / COMBAT_PARTS bins per part */
+#define CONTACT_DAMAGE 1	/* per tick, for running into things */
+
+struct attack_intent {
+	obj_handle_t target, attacker;
+	int damage;
+};
+
+struct attack_intent *intent = NULL;	/* this tick's, in the order they came in */
+struct attack_intent *binned_intent = NULL;	/* the same, sorted by bin */
+obj_handle_t *combat_dead = NULL;	/* per bin, starting at combat_bin_start[bin] */
+int nintents = 0, intentsize = 0;
+int combat_bin_start[COMBAT_BINS + 1];
+int combat_ndead[COMBAT_BINS];
+
+struct combat_stats {
+	int ticks;		/* ticks with any fighting */
+	long long intents, deaths;
+	int max_intents;	/* most in one tick */
+	long long usecs;
+} combat_stats;
+
+void add_attack_intent(obj_handle_t target, obj_handle_t attacker, int damage)
+{
+	if (nintents >= intentsize) {
+		intentsize = intentsize ? intentsize * 2 : 1024;
+		intent = (struct attack_intent *) game_realloc(ALLOC_SIM, intent, sizeof(*intent) * intentsize);
+		binned_intent = (struct attack_intent *)
+			game_realloc(ALLOC_SIM, binned_intent, sizeof(*binned_intent) * intentsize);
+		combat_dead = (obj_handle_t *) game_realloc(ALLOC_SIM, combat_dead, sizeof(*combat_dead) * intentsize);
+	}
+	intent[nintents].target = target;
+	intent[nintents].attacker = attacker;
+	intent[nintents].damage = damage;
+	nintents++;
+}
+
+static inline int combat_bin(obj_handle_t h)
+{
+	return (h & OBJ_INDEX_MASK) % COMBAT_BINS;
+}
+
+static void apply_damage_part(int part, void *arg)
+{
+	int b, i, ndead;
+	struct attack_intent *a;
+	struct game_obj_t *o;
+	struct health_data *h;
+
+	for (b = part * (COMBAT_BINS / COMBAT_PARTS); b < (part + 1) * (COMBAT_BINS / COMBAT_PARTS); b++) {
+		ndead = 0;
+		for (i = combat_bin_start[b]; i < combat_bin_start[b + 1]; i++) {
+			a = &binned_intent[i];
+			o = obj_lookup(a->target);
+			if (o == NULL || !o->alive)
+				continue;
+			h = obj_health(o);
+			if (h == NULL || h->hp <= 0)
+				continue;
+			h->hp -= a->damage;
+			h->last_attacker = a->attacker;
+			h->hit_time = timer;
+			if (h->hp <= 0)	/* only the killing blow gets here */
+				combat_dead[combat_bin_start[b] + ndead++] = a->target;
+		}
+		combat_ndead[b] = ndead;
+	}
+}
+
+/* run after the projectiles have moved, this tick's hits are all in */
+void resolve_combat()
+{
+	int i, b, count[COMBAT_BINS];
+	struct game_obj_t *o, *other;
+	long long start;
+
+	nintents = 0;
+	for (i = 0; i < nproj_hits; i++)
+		add_attack_intent(proj_hit[i].target, proj_hit[i].owner, proj_hit[i].damage);
+	for (i = 0; i < ncontacts; i++) {
+		o = obj_lookup(contact[i].a);
+		other = obj_lookup(contact[i].b);
+		if (o == NULL || other == NULL || o->otype == other->otype)
+			continue;	/* things of a kind just jostle each other */
+		add_attack_intent(contact[i].a, contact[i].b, CONTACT_DAMAGE);
+		add_attack_intent(contact[i].b, contact[i].a, CONTACT_DAMAGE);
+	}
+	if (nintents == 0)
+		return;
+	start = usecs_now();
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nintents; i++)
+		count[combat_bin(intent[i].target)]++;
+	combat_bin_start[0] = 0;
+	for (b = 0; b < COMBAT_BINS; b++)
+		combat_bin_start[b + 1] = combat_bin_start[b] + count[b];
+	memcpy(count, combat_bin_start, sizeof(count));
+	for (i = 0; i < nintents; i++)
+		binned_intent[count[combat_bin(intent[i].target)]++] = intent[i];
+
+	run_parallel(apply_damage_part, COMBAT_PARTS, NULL);
+
+	for (b = 0; b < COMBAT_BINS; b++)
+		for (i = 0; i < combat_ndead[b]; i++) {
+			o = obj_lookup(combat_dead[combat_bin_start[b] + i]);
+			if (o == NULL)
+				continue;
+			kill_object(o);
+			combat_stats.deaths++;
+		}
+
+	combat_stats.ticks++;
+	combat_stats.intents += nintents;
+	if (nintents > combat_stats.max_intents)
+		combat_stats.max_intents = nintents;
+	combat_stats.usecs += usecs_now() - start;
+}
+
+void print_combat_stats()
+{
+	struct combat_stats *c = &combat_stats;
+
+	if (c->ticks == 0)
+		return;
+	printf("combat: %lld attacks over %d ticks (most %d in one), %lld killed, "
+		"%.1f usecs/tick, %d threads\n",
+		c->intents, c->ticks, c->max_intents, c->deaths,
+		(double) c->usecs / c->ticks, nworkers);
+}
+
+/* combat code ends      */
+/*************************/
+
+/********************************/
+/* object scheduler code begins */
+
+struct game_obj_t **live_objs = NULL;	/* objects to be moved or drawn, in slot order */
+struct game_obj_t **sched_objs = NULL;	/* same objects, sorted by type */
+int sched_size = 0;			/* room in live_objs and sched_objs */
+int sched_start[257];			/* type t is sched_objs[sched_start[t]] up to sched_start[t+1] */
+
+/* make sure live_objs and sched_objs can hold every object there is */
+static void grow_schedule()
+{
+	if (sched_size >= obj_capacity)
+		return;
+	sched_size = obj_capacity;
+	live_objs = (struct game_obj_t **) game_realloc(ALLOC_OBJECTS, live_objs, sizeof(*live_objs) * sched_size);
+	sched_objs = (struct game_obj_t **) game_realloc(ALLOC_OBJECTS, sched_objs, sizeof(*sched_objs) * sched_size);
+}
+
+/* counting sort of objs by otype, slot order is kept within each type */
+static void schedule_by_type(struct game_obj_t **objs, int n)
+{
+	int i, t;
+	int next[256];
+
+	memset(next, 0, sizeof(next));
+	for (i = 0; i < n; i++)
+		next[(unsigned char) objs[i]->otype]++;
+	sched_start[0] = 0;
+	for (t = 0; t < 256; t++) {
+		sched_start[t + 1] = sched_start[t] + next[t];
+		next[t] = sched_start[t];
+	}
+	for (i = 0; i < n; i++)
+		sched_objs[next[(unsigned char) objs[i]->otype]++] = objs[i];
+}
+
+int nscheduled = 0;	/* how many objects the move passes are working on */
+unsigned int move_sum = 0;	/* sum of where everything is after the move pass */
+
+/* gather up this tick's live objects for the steer and move passes */
+void schedule_moves()
+{
+	int i, n;
+
+	grow_schedule();
+	n = 0;
+	for (i=0;i<=highest_object_number;i++)
+		if (gobj(i)->alive)
+			live_objs[n++] = gobj(i);
+	schedule_by_type(live_objs, n);
+	nscheduled = n;
+}
+
+/* let the types which steer their objects as a group, do so */
+void run_steer_pass()
+{
+	int t, count;
+
+	for (t = 0; t < 256; t++) {
+		count = sched_start[t + 1] - sched_start[t];
+		if (count == 0 || obj_type[t] == NULL || obj_type[t]->steer_batch == NULL)
+			continue;
+		obj_type[t]->steer_batch(&sched_objs[sched_start[t]], count);
+	}
+}
+
+/* move every live object, one type at a time */
+void run_move_pass()
+{
+	int i, j, t, n = nscheduled, count;
+	struct game_obj_t **span, *o;
+	unsigned int sum;
+	long long start;
+
+	for (t = 0; t < 256; t++) {
+		count = sched_start[t + 1] - sched_start[t];
+		if (count == 0)
+			continue;
+		span = &sched_objs[sched_start[t]];
+		start = trace_begin();
+		if (obj_type[t] && obj_type[t]->move_batch)
+			obj_type[t]->move_batch(span, count);
+		else
+			for (j = 0; j < count; j++)	/* compatibility path */
+				if (span[j]->alive)
+					span[j]->move(span[j]);
+		trace_end(obj_type[t] ? obj_type[t]->name : "untyped", start, count);
+	}
+
+	/* and a cheap sum of where everything ended up, for the idle check */
+	sum = n;
+	for (i = 0; i < n; i++) {
+		o = live_objs[i];
+		if (!o->alive)
+			continue;
+		update_obj_tile(o);
+		sum = (sum ^ (o->x + o->y * 65599 + o->vx * 31 + o->vy * 17 + o->bearing)) * 16777619;
+	}
+	move_sum = sum;
+}
+
+/* draw the given objects, one type at a time */
+void run_draw_pass(struct game_obj_t **objs, int n, GtkWidget *w)
+{
+	int j, t, count;
+	struct game_obj_t **span;
+
+	grow_schedule();	/* there may not have been a tick since the arena grew */
+	schedule_by_type(objs, n);
+	for (t = 0; t < 256; t++) {
+		count = sched_start[t + 1] - sched_start[t];
+		if (count == 0)
+			continue;
+		span = &sched_objs[sched_start[t]];
+		if (obj_type[t] && obj_type[t]->draw_batch) {
+			obj_type[t]->draw_batch(span, count, w);
+			continue;
+		}
+		for (j = 0; j < count; j++)	/* compatibility path */
+			span[j]->draw(span[j], w);
+	}
+}
+
+/* object scheduler code ends   */
+/********************************/
+
+/*****************************/
+/* battalion code begins     */
+
+/* Soldiers don't find their own way anywhere.  They belong to a */
+/* battalion, which is an object of its own (drawn as a flag) holding */
+/* the handles of its soldiers and each one's place in the formation, */
+/* relative to the flag.  Each tick the battalion works out where the */
+/* flag goes, looking at the terrain, once for the lot of them; then */
+/* each soldier just heads for its place in the formation, which is a */
+/* few multiplies and adds, done four at a time. */
+
+#define MAX_BATTALIONS 256
+#define MAX_BATTALION_SIZE 256	/* soldiers in one battalion */
+#define MAX_SOLDIERS 262144
+#define SOLDIER_SPACING 20	/* between places in the formation */
+#define BATTALION_SPEED 3	/* per tick, on grass */
+#define MAX_TURN 2		/* most the formation turns per tick, out of NANGLES */
+
+struct battalion_data {
+	obj_handle_t member[MAX_BATTALION_SIZE];
+	float slotx[MAX_BATTALION_SIZE];	/* each soldier's place, relative to */
+	float sloty[MAX_BATTALION_SIZE];	/* the flag, facing up */
+	int nmembers;
+	int goalx, goaly;	/* where we're going */
+	int dir;		/* which of dir8x/dir8y we went last, -1 for none */
+	int heading;		/* which way the formation faces, 0 .. NANGLES-1, 0 is up */
+};
+
+struct soldier_data {
+	struct health_data health;
+	obj_handle_t battalion;
+};
+
+static const float dir8x[8] = { 0, 0.7071, 1, 0.7071, 0, -0.7071, -1, -0.7071 };
+static const float dir8y[8] = { -1, -0.7071, 0, 0.7071, 1, 0.7071, 0, -0.7071 };
+
+/* scratch for the catch up step, grown as needed */
+float *formation_x = NULL, *formation_y = NULL;
+int *formation_vx = NULL, *formation_vy = NULL;
+int formation_size = 0;
+
+/* Velocity for each soldier to close a quarter of the gap to its place */
+/* in the formation, at most maxv.  Places are relative to the flag at */
+/* (fx, fy), rotated by the angle whose cosine and sine are c and s. */
+static void formation_catch_up(const float *slotx, const float *sloty,
+	const float *x, const float *y, int *vx, int *vy, int n,
+	float fx, float fy, float c, float s, float maxv)
+{
+	int i = 0;
+	float tx, ty, dx, dy;
+#ifdef __SSE2__
+	__m128 vc = _mm_set1_ps(c), vs = _mm_set1_ps(s);
+	__m128 vfx = _mm_set1_ps(fx), vfy = _mm_set1_ps(fy);
+	__m128 gain = _mm_set1_ps(0.25f), hi = _mm_set1_ps(maxv), lo = _mm_set1_ps(-maxv);
+	__m128 sx, sy, vtx, vty, vdx, vdy;
+
+	for (; i + 4 <= n; i += 4) {
+		sx = _mm_loadu_ps(&slotx[i]);
+		sy = _mm_loadu_ps(&sloty[i]);
+		vtx = _mm_add_ps(vfx, _mm_sub_ps(_mm_mul_ps(sx, vc), _mm_mul_ps(sy, vs)));
+		vty = _mm_add_ps(vfy, _mm_add_ps(_mm_mul_ps(sx, vs), _mm_mul_ps(sy, vc)));
+		vdx = _mm_mul_ps(_mm_sub_ps(vtx, _mm_loadu_ps(&x[i])), gain);
+		vdy = _mm_mul_ps(_mm_sub_ps(vty, _mm_loadu_ps(&y[i])), gain);
+		vdx = _mm_min_ps(_mm_max_ps(vdx, lo), hi);
+		vdy = _mm_min_ps(_mm_max_ps(vdy, lo), hi);
+		_mm_storeu_si128((__m128i *) &vx[i], _mm_cvtps_epi32(vdx));
+		_mm_storeu_si128((__m128i *) &vy[i], _mm_cvtps_epi32(vdy));
+	}
+#endif
+	for (; i < n; i++) {
+		tx = fx + slotx[i] * c - sloty[i] * s;
+		ty = fy + slotx[i] * s + sloty[i] * c;
+		dx = (tx - x[i]) * 0.25f;
+		dy = (ty - y[i]) * 0.25f;
+		dx = dx < -maxv ? -maxv : (dx > maxv ? maxv : dx);
+		dy = dy < -maxv ? -maxv : (dy > maxv ? maxv : dy);
+		vx[i] = lrintf(dx);
+		vy[i] = lrintf(dy);
+	}
+}
+
+/* pick which way the flag goes: of the 8 directions, the one which gets */
+/* closest to the goal a square from here, with a penalty for rough going. */
+static void battalion_steer(struct game_obj_t *o, struct battalion_data *b)
+{
+	struct game_obj_t *p;
+	int d, best = -1, cost, lx, ly, want, turn;
+	float dx, dy, score, best_score = 0;
+
+	p = nearest_player(o->x, o->y);
+	if (p) {
+		b->goalx = p->x;
+		b->goaly = p->y;
+	}
+	dx = b->goalx - o->x;
+	dy = b->goaly - o->y;
+	if (dx * dx + dy * dy < (float) mapsquarewidth * mapsquarewidth / 4) {
+		o->vx = o->vy = 0;	/* there, or near enough */
+		b->dir = -1;
+		return;
+	}
+
+	for (d = 0; d < 8; d++) {
+		lx = o->x + dir8x[d] * mapsquarewidth;
+		ly = o->y + dir8y[d] * mapsquarewidth;
+		cost = terrain_cost_at(lx, ly);
+		if (cost == 0)
+			continue;
+		dx = b->goalx - lx;
+		dy = b->goaly - ly;
+		score = sqrtf(dx * dx + dy * dy) + (cost - 1) * mapsquarewidth;
+		if (d == b->dir)
+			score -= mapsquarewidth / 4;	/* don't dither between two ways */
+		if (best < 0 || score < best_score) {
+			best = d;
+			best_score = score;
+		}
+	}
+	if (best < 0) {
+		o->vx = o->vy = 0;	/* boxed in */
+		b->dir = -1;
+		return;
+	}
+	b->dir = best;
+
+	/* slower over rough ground */
+	cost = terrain_cost_at(o->x, o->y);
+	if (cost == 0)
+		cost = 1;
+	o->vx = lrintf(dir8x[best] * BATTALION_SPEED * 2 / cost) / 2;
+	o->vy = lrintf(dir8y[best] * BATTALION_SPEED * 2 / cost) / 2;
+	if (o->vx == 0 && o->vy == 0) {
+		o->vx = dir8x[best] < -0.5 ? -1 : (dir8x[best] > 0.5);
+		o->vy = dir8y[best] < -0.5 ? -1 : (dir8y[best] > 0.5);
+	}
+
+	/* swing the formation round to face the way we're going, a bit at a time */
+	want = best * NANGLES / 8;
+	turn = (want - b->heading + NANGLES + NANGLES / 2) % NANGLES - NANGLES / 2;
+	if (turn > MAX_TURN)
+		turn = MAX_TURN;
+	if (turn < -MAX_TURN)
+		turn = -MAX_TURN;
+	b->heading = (b->heading + turn + NANGLES) % NANGLES;
+}
+
+/* send each soldier toward its place, forgetting the dead ones */
+static void battalion_lead(struct game_obj_t *o, struct battalion_data *b)
+{
+	struct game_obj_t *m;
+	int i, n;
+	double angle;
+
+	/* a dead soldier's place is taken by the last one in the list */
+	for (i = 0; i < b->nmembers; ) {
+		if (obj_lookup(b->member[i]) != NULL) {
+			i++;
+			continue;
+		}
+		b->member[i] = b->member[--b->nmembers];
+	}
+	n = b->nmembers;
+	if (n == 0)
+		return;
+
+	if (formation_size < n) {
+		formation_size = MAX_BATTALION_SIZE;
+		formation_x = (float *) game_realloc(ALLOC_SIM, formation_x, sizeof(float) * formation_size);
+		formation_y = (float *) game_realloc(ALLOC_SIM, formation_y, sizeof(float) * formation_size);
+		formation_vx = (int *) game_realloc(ALLOC_SIM, formation_vx, sizeof(int) * formation_size);
+		formation_vy = (int *) game_realloc(ALLOC_SIM, formation_vy, sizeof(int) * formation_size);
+	}
+	for (i = 0; i < n; i++) {
+		m = obj_lookup(b->member[i]);
+		formation_x[i] = m->x;
+		formation_y[i] = m->y;
+	}
+	angle = (2.0 * 3.1415927 * b->heading) / NANGLES;
+	/* aim for where the places will be once the flag has moved */
+	formation_catch_up(b->slotx, b->sloty, formation_x, formation_y,
+		formation_vx, formation_vy, n,
+		o->x + o->vx, o->y + o->vy, cos(angle), sin(angle),
+		BATTALION_SPEED * 2 + 2);
+	for (i = 0; i < n; i++) {
+		m = obj_lookup(b->member[i]);
+		m->vx = formation_vx[i];
+		m->vy = formation_vy[i];
+	}
+}
+
+void battalion_steer_batch(struct game_obj_t **o, int n)
+{
+	int i;
+	struct battalion_data *b;
+
+	for (i = 0; i < n; i++) {
+		if (!o[i]->alive)
+			continue;
+		b = obj_cold(o[i]);
+		battalion_steer(o[i], b);
+		battalion_lead(o[i], b);
+	}
+}
+
+/* flags and soldiers both just go where they've been pointed */
+void formation_move(struct game_obj_t *o)
+{
+	o->x += o->vx;
+	o->y += o->vy;
+	keep_on_map(o);
+}
+
+void formation_move_batch(struct game_obj_t **o, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		formation_move(o[i]);
+}
+
+void battalion_destroy(struct game_obj_t *o)
+{
+	struct battalion_data *b = obj_cold(o);
+	struct game_obj_t *m;
+	int i;
+
+	/* leaderless soldiers stand still */
+	for (i = 0; i < b->nmembers; i++) {
+		m = obj_lookup(b->member[i]);
+		if (m == NULL)
+			continue;
+		m->vx = m->vy = 0;
+		((struct soldier_data *) obj_cold(m))->battalion = NO_OBJ;
+	}
+	b->nmembers = 0;
+	generic_destroy_func(o);
+}
+
+struct obj_type_t battalion_type = {
+	.otype = OBJ_TYPE_BATTALION,
+	.name = "battalion",
+	.steer_batch = battalion_steer_batch,
+	.move_batch = formation_move_batch,
+	.draw_batch = generic_draw_batch,
+	.destroy = battalion_destroy,
+	.max = MAX_BATTALIONS,
+	.cold_size = sizeof(struct battalion_data),
+};
+
+struct obj_type_t soldier_type = {
+	.otype = OBJ_TYPE_SOLDIER,
+	.name = "soldier",
+	.move_batch = formation_move_batch,
+	.draw_batch = generic_draw_batch,
+	.max = MAX_SOLDIERS,
+	.cold_size = sizeof(struct soldier_data),
+	.maxhp = 10,
+	.avoid_radius = 8,
+	.side = SIDE_ENEMY,
+	.influence = 2,
+};
+
+/* a battalion of rows x cols soldiers, the flag in the middle of the formation. */
+/* Anything past MAX_BATTALION_SIZE soldiers is left out. */
+struct game_obj_t *add_battalion(int x, int y, int rows, int cols, int color)
+{
+	struct game_obj_t *o, *m;
+	struct battalion_data *b;
+	int r, c, n;
+
+	o = add_generic_object(x, y, 0, 0, formation_move, generic_draw, color,
+		&flag_vect, 0, OBJ_TYPE_BATTALION, 1);
+	if (o == NULL)
+		return NULL;
+	b = obj_cold(o);
+	b->nmembers = 0;
+	b->goalx = x;
+	b->goaly = y;
+	b->dir = -1;
+	b->heading = 0;
+
+	/* front rank first, so as soldiers die the back ranks thin out */
+	for (r = 0; r < rows; r++)
+		for (c = 0; c < cols && b->nmembers < MAX_BATTALION_SIZE; c++) {
+			n = b->nmembers;
+			b->slotx[n] = (c - (cols - 1) / 2.0) * SOLDIER_SPACING;
+			b->sloty[n] = (r - (rows - 1) / 2.0) * SOLDIER_SPACING;
+			m = add_generic_object(x + b->slotx[n], y + b->sloty[n], 0, 0,
+				formation_move, generic_draw, color, &soldier_vect,
+				1, OBJ_TYPE_SOLDIER, 1);
+			if (m == NULL)
+				return o;
+			((struct soldier_data *) obj_cold(m))->battalion = obj_handle(o);
+			b->member[b->nmembers++] = obj_handle(m);
+		}
+	return o;
+}
+
+void add_demo_battalions()
+{
+	int w = mapxdim * mapsquarewidth, h = mapydim * mapsquarewidth;
+
+	add_battalion(w / 8, h / 8, 8, 25, RED);
+	add_battalion(w - w / 8, h / 8, 8, 25, ORANGE);
+	add_battalion(w / 8, h - h / 8, 8, 25, MAGENTA);
+	add_battalion(w - w / 8, h - h / 8, 8, 25, CYAN);
+}
+
+/* battalion code ends       */
+/*****************************/
+
+/*********************************/
+/* crowd avoidance code begins   */
+
+/* Nothing stops objects which are steered toward the same spot from */
+/* piling up on top of each other.  Between the steer and move passes, */
+/* run_avoid_pass() nudges the velocity of each object whose type has */
+/* an avoid_radius away from any others it overlaps.  Neighbours are */
+/* found with a grid of AVOID_CELL squares, rebuilt every tick with a */
+/* counting sort, so the objects in each row of cells are contiguous, */
+/* one array per field.  Each object only writes its own new velocity, */
+/* so bands of rows are done in parallel. */
+
+#define AVOID_CELL 32		/* at least twice the biggest avoid_radius */
+#define AVOID_PUSH 0.5f		/* how much of the overlap to push apart per tick */
+#define AVOID_MAX_PUSH 4.0f
+#define AVOID_PARTS 64
+
+struct avoid_grid {
+	int n, size;
+	struct game_obj_t **gathered;	/* in schedule order */
+	int *cell;			/* cell of gathered[i] */
+	struct game_obj_t **obj;	/* the rest are in cell order */
+	float *x, *y, *vx, *vy, *r;
+	float *nvx, *nvy;		/* the nudged velocities */
+	int *cell_start;		/* cell c is cell_start[c] .. cell_start[c + 1] - 1 */
+	int gridw, gridh;
+	int ticks;
+	long long usecs;
+	int max_n;
+} avoid;
+
+static void grow_avoid_grid(int n)
+{
+	struct avoid_grid *a = &avoid;
+
+	if (a->gridw == 0) {
+		a->gridw = mapxdim * mapsquarewidth / AVOID_CELL + 1;
+		a->gridh = mapydim * mapsquarewidth / AVOID_CELL + 1;
+		a->cell_start = (int *) game_malloc(ALLOC_SIM, sizeof(int) * (a->gridw * a->gridh + 1));
+	}
+	if (n <= a->size)
+		return;
+	a->size = n * 2;
+	a->gathered = (struct game_obj_t **) game_realloc(ALLOC_SIM, a->gathered, sizeof(*a->gathered) * a->size);
+	a->obj = (struct game_obj_t **) game_realloc(ALLOC_SIM, a->obj, sizeof(*a->obj) * a->size);
+	a->cell = (int *) game_realloc(ALLOC_SIM, a->cell, sizeof(int) * a->size);
+	a->x = (float *) game_realloc(ALLOC_SIM, a->x, sizeof(float) * a->size);
+	a->y = (float *) game_realloc(ALLOC_SIM, a->y, sizeof(float) * a->size);
+	a->vx = (float *) game_realloc(ALLOC_SIM, a->vx, sizeof(float) * a->size);
+	a->vy = (float *) game_realloc(ALLOC_SIM, a->vy, sizeof(float) * a->size);
+	a->r = (float *) game_realloc(ALLOC_SIM, a->r, sizeof(float) * a->size);
+	a->nvx = (float *) game_realloc(ALLOC_SIM, a->nvx, sizeof(float) * a->size);
+	a->nvy = (float *) game_realloc(ALLOC_SIM, a->nvy, sizeof(float) * a->size);
+}
+
+/* add up how far object i overlaps objects j0 .. j1-1, as a vector away from them */
+static void avoid_overlap(int i, int j0, int j1, float *px, float *py)
+{
+	struct avoid_grid *a = &avoid;
+	float xi = a->x[i], yi = a->y[i], ri = a->r[i];
+	float dx, dy, d2, rs, d;
+	int j = j0;
+#ifdef __SSE2__
+	__m128 vxi = _mm_set1_ps(xi), vyi = _mm_set1_ps(yi), vri = _mm_set1_ps(ri);
+	__m128 zero = _mm_setzero_ps(), sumx = zero, sumy = zero;
+	__m128 vdx, vdy, vd2, vrs, vd, f, mask;
+	float tx[4], ty[4];
+
+	for (; j + 4 <= j1; j += 4) {
+		vdx = _mm_sub_ps(vxi, _mm_loadu_ps(&a->x[j]));
+		vdy = _mm_sub_ps(vyi, _mm_loadu_ps(&a->y[j]));
+		vd2 = _mm_add_ps(_mm_mul_ps(vdx, vdx), _mm_mul_ps(vdy, vdy));
+		vrs = _mm_add_ps(vri, _mm_loadu_ps(&a->r[j]));
+		/* overlapping, and not ourself */
+		mask = _mm_and_ps(_mm_cmplt_ps(vd2, _mm_mul_ps(vrs, vrs)), _mm_cmpgt_ps(vd2, zero));
+		vd = _mm_sqrt_ps(vd2);
+		f = _mm_and_ps(mask, _mm_div_ps(_mm_sub_ps(vrs, vd), vd));
+		sumx = _mm_add_ps(sumx, _mm_mul_ps(f, vdx));
+		sumy = _mm_add_ps(sumy, _mm_mul_ps(f, vdy));
+	}
+	_mm_storeu_ps(tx, sumx);
+	_mm_storeu_ps(ty, sumy);
+	*px += tx[0] + tx[1] + tx[2] + tx[3];
+	*py += ty[0] + ty[1] + ty[2] + ty[3];
+#endif
+	for (; j < j1; j++) {
+		dx = xi - a->x[j];
+		dy = yi - a->y[j];
+		d2 = dx * dx + dy * dy;
+		rs = ri + a->r[j];
+		if (d2 >= rs * rs || d2 <= 0)
+			continue;
+		d = sqrtf(d2);
+		*px += dx * (rs - d) / d;
+		*py += dy * (rs - d) / d;
+	}
+}
+
+static void avoid_part(int part, void *arg)
+{
+	struct avoid_grid *a = &avoid;
+	int row, col, c, i, nrow, lo, hi;
+	int first = part * a->gridh / AVOID_PARTS, last = (part + 1) * a->gridh / AVOID_PARTS;
+	float px, py;
+
+	for (row = first; row < last; row++)
+		for (col = 0; col < a->gridw; col++) {
+			c = row * a->gridw + col;
+			lo = col > 0 ? col - 1 : 0;
+			hi = col < a->gridw - 1 ? col + 1 : col;
+			for (i = a->cell_start[c]; i < a->cell_start[c + 1]; i++) {
+				px = py = 0;
+				/* 3 cells in a row are contiguous */
+				for (nrow = row - 1; nrow <= row + 1; nrow++) {
+					if (nrow < 0 || nrow >= a->gridh)
+						continue;
+					avoid_overlap(i, a->cell_start[nrow * a->gridw + lo],
+						a->cell_start[nrow * a->gridw + hi + 1], &px, &py);
+				}
+				px *= AVOID_PUSH;
+				py *= AVOID_PUSH;
+				px = px < -AVOID_MAX_PUSH ? -AVOID_MAX_PUSH : (px > AVOID_MAX_PUSH ? AVOID_MAX_PUSH : px);
+				py = py < -AVOID_MAX_PUSH ? -AVOID_MAX_PUSH : (py > AVOID_MAX_PUSH ? AVOID_MAX_PUSH : py);
+				a->nvx[i] = a->vx[i] + px;
+				a->nvy[i] = a->vy[i] + py;
+			}
+		}
+}
+
+/* after steering, before moving */
+void run_avoid_pass()
+{
+	struct avoid_grid *a = &avoid;
+	struct game_obj_t **span;
+	struct game_obj_t *o;
+	int t, i, j, n, count, cx, cy, ncells;
+	long long start = usecs_now();
+
+	n = 0;
+	for (t = 0; t < 256; t++)
+		if (obj_type[t] && obj_type[t]->avoid_radius > 0)
+			n += sched_start[t + 1] - sched_start[t];
+	if (n == 0)
+		return;
+	grow_avoid_grid(n);
+	ncells = a->gridw * a->gridh;
+
+	/* count objects per cell */
+	memset(a->cell_start, 0, sizeof(int) * (ncells + 1));
+	n = 0;
+	for (t = 0; t < 256; t++) {
+		if (obj_type[t] == NULL || obj_type[t]->avoid_radius <= 0)
+			continue;
+		count = sched_start[t + 1] - sched_start[t];
+		span = &sched_objs[sched_start[t]];
+		for (j = 0; j < count; j++) {
+			o = span[j];
+			if (!o->alive)
+				continue;
+			cx = o->x / AVOID_CELL;
+			cy = o->y / AVOID_CELL;
+			cx = cx < 0 ? 0 : (cx >= a->gridw ? a->gridw - 1 : cx);
+			cy = cy < 0 ? 0 : (cy >= a->gridh ? a->gridh - 1 : cy);
+			a->gathered[n] = o;
+			a->cell[n] = cy * a->gridw + cx;
+			a->cell_start[a->cell[n] + 1]++;
+			n++;
+		}
+	}
+	for (i = 0; i < ncells; i++)
+		a->cell_start[i + 1] += a->cell_start[i];
+
+	/* scatter into cell order, cell_start[c] is used as the fill pointer */
+	/* for cell c and ends up at the start of cell c + 1, then gets put back */
+	for (i = 0; i < n; i++) {
+		o = a->gathered[i];
+		j = a->cell_start[a->cell[i]]++;
+		a->obj[j] = o;
+		a->x[j] = o->x;
+		a->y[j] = o->y;
+		a->vx[j] = o->vx;
+		a->vy[j] = o->vy;
+		a->r[j] = obj_type[(unsigned char) o->otype]->avoid_radius;
+	}
+	for (i = ncells; i > 0; i--)
+		a->cell_start[i] = a->cell_start[i - 1];
+	a->cell_start[0] = 0;
+	a->n = n;
+
+	run_parallel(avoid_part, AVOID_PARTS, NULL);
+
+	for (i = 0; i < n; i++) {
+		a->obj[i]->vx = lrintf(a->nvx[i]);
+		a->obj[i]->vy = lrintf(a->nvy[i]);
+	}
+
+	a->ticks++;
+	a->usecs += usecs_now() - start;
+	if (n > a->max_n)
+		a->max_n = n;
+}
+
+void print_avoid_stats()
+{
+	if (avoid.ticks == 0)
+		return;
+	printf("crowd avoidance: %.1f usecs/tick, up to %d objects\n",
+		(double) avoid.usecs / avoid.ticks, avoid.max_n);
+}
+
+/* crowd avoidance code ends     */
+/*********************************/
+
+/*****************************/
+/* AI scheduler code begins  */
+
+/* Things which think (their type has a think function) are queued in */
+/* buckets by how much their thinking matters: near a player or in */
+/* a fight they think every tick, further off less often.  Each tick */
+/* run_ai() works through the buckets, most important first, thinking */
+/* for whoever is due until the time budget is used up; the rest wait */
+/* at the front of their queues for the next tick.  Thinking only steers */
+/* and shoots, the move passes do the moving, so an agent which misses */
+/* a turn just carries on doing what it was doing. */
+
+#define AI_NEAR 0
+#define AI_MID 1
+#define AI_FAR 2
+#define AI_BUCKETS 3
+#define DEFAULT_AI_BUDGET 2000	/* usecs per tick, see --ai-budget */
+#define AI_COMBAT_TICKS 60	/* counts as in a fight for this long after being hit */
+
+static const int ai_period[AI_BUCKETS] = { 1, 8, 32 };	/* ticks between thinks */
+static const char *ai_bucket_name[AI_BUCKETS] = { "near", "mid", "far" };
+
+struct ai_entry {
+	obj_handle_t h;
+	int due;		/* tick it should think at */
+};
+
+/* A ring of agents in the order they're due.  Agents which have just */
+/* thought are queued on the end with the same period, so the queue stays */
+/* sorted by due.  New agents, whose first thinks are staggered, are held */
+/* in incoming until run_ai() sorts them and merges them in. */
+struct ai_bucket {
+	struct ai_entry *q;
+	int head, n, size;	/* size is a power of 2 */
+	struct ai_entry *incoming;
+	int nincoming, incomingsize;
+	long long thinks;
+	long long late;		/* total ticks overdue, over all thinks */
+	int max_late;
+	int starved_ticks;	/* ticks which ended with agents here overdue */
+};
+
+struct ai_scheduler {
+	struct ai_bucket b[AI_BUCKETS];
+	int budget_usecs;	/* 0 for no time limit */
+	int max_thinks;		/* per tick, 0 for no limit.  Deterministic, unlike the clock. */
+	int ticks, out_of_time;
+	long long usecs;
+} ai = { .budget_usecs = DEFAULT_AI_BUDGET };
+
+/* make room for n agents in b's ring */
+static void ai_grow(struct ai_bucket *b, int n)
+{
+	struct ai_entry *q;
+	int i, size = b->size ? b->size : 256;
+
+	if (n <= b->size)
+		return;
+	while (size < n)
+		size *= 2;
+	q = (struct ai_entry *) game_malloc(ALLOC_AI, sizeof(*q) * size);
+	for (i = 0; i < b->n; i++)
+		q[i] = b->q[(b->head + i) & (b->size - 1)];
+	free(b->q);
+	b->q = q;
+	b->head = 0;
+	b->size = size;
+}
+
+static void ai_push(int bucket, obj_handle_t h, int due)
+{
+	struct ai_bucket *b = &ai.b[bucket];
+
+	ai_grow(b, b->n + 1);
+	b->q[(b->head + b->n) & (b->size - 1)].h = h;
+	b->q[(b->head + b->n) & (b->size - 1)].due = due;
+	b->n++;
+}
+
+static inline void ai_pop(struct ai_bucket *b)
+{
+	b->head = (b->head + 1) & (b->size - 1);
+	b->n--;
+}
+
+/* how much does o's thinking matter right now?  This goes by where the */
+/* players are rather than where the viewport is, which is different on */
+/* every machine in a networked game. */
+static int ai_bucket_for(struct game_obj_t *o)
+{
+	struct game_obj_t *p = nearest_player(o->x, o->y);
+	struct health_data *h = obj_health(o);
+	int dx, dy;
+
+	if (h && h->last_attacker != NO_OBJ && timer - h->hit_time < AI_COMBAT_TICKS)
+		return AI_NEAR;
+	if (p == NULL)
+		return AI_FAR;
+	dx = abs(o->x - p->x);
+	dy = abs(o->y - p->y);
+	if (dx < SCREEN_WIDTH && dy < SCREEN_HEIGHT)
+		return AI_NEAR;
+	if (dx < 3 * SCREEN_WIDTH && dy < 3 * SCREEN_HEIGHT)
+		return AI_MID;
+	return AI_FAR;
+}
+
+/* start o thinking, staggered so a crowd added at once doesn't all think at once */
+void ai_add_agent(struct game_obj_t *o)
+{
+	struct ai_bucket *b = &ai.b[ai_bucket_for(o)];
+
+	if (b->nincoming >= b->incomingsize) {
+		b->incomingsize = b->incomingsize ? b->incomingsize * 2 : 256;
+		b->incoming = (struct ai_entry *)
+			game_realloc(ALLOC_AI, b->incoming, sizeof(*b->incoming) * b->incomingsize);
+	}
+	b->incoming[b->nincoming].h = obj_handle(o);
+	b->incoming[b->nincoming].due = timer + 1 + o->number % ai_period[b - ai.b];
+	b->nincoming++;
+}
+
+static inline int ai_entry_compare(const struct ai_entry *x, const struct ai_entry *y)
+{
+	if (x->due != y->due)
+		return x->due - y->due;
+	return (x->h & OBJ_INDEX_MASK) - (y->h & OBJ_INDEX_MASK);
+}
+
+/* Heapsort, in place.  Not qsort(), which mallocs behind our back */
+/* for big arrays, and a battle's worth of agents can arrive at once. */
+static void ai_sort(struct ai_entry *a, int n)
+{
+	struct ai_entry t;
+	int i, child, parent, end;
+
+	for (i = n / 2 - 1, end = n; end > 1; ) {
+		if (i >= 0) {		/* still building the heap */
+			parent = i--;
+		} else {		/* move the biggest to the end */
+			end--;
+			t = a[0];
+			a[0] = a[end];
+			a[end] = t;
+			parent = 0;
+		}
+		for (;;) {		/* sift it down */
+			child = 2 * parent + 1;
+			if (child >= end)
+				break;
+			if (child + 1 < end && ai_entry_compare(&a[child + 1], &a[child]) > 0)
+				child++;
+			if (ai_entry_compare(&a[child], &a[parent]) <= 0)
+				break;
+			t = a[parent];
+			a[parent] = a[child];
+			a[child] = t;
+			parent = child;
+		}
+	}
+}
+
+/* merge the new agents into the queue, keeping it sorted by due */
+static void ai_merge_incoming(struct ai_bucket *b)
+{
+	struct ai_entry *q, *in = b->incoming;
+	int i = 0, j = 0, k = 0, n = b->n + b->nincoming;
+
+	ai_sort(in, b->nincoming);
+	q = arena_new(&tick_arena, struct ai_entry, n);
+	while (i < b->n || j < b->nincoming) {
+		if (j >= b->nincoming ||
+			(i < b->n && b->q[(b->head + i) & (b->size - 1)].due <= in[j].due))
+			q[k++] = b->q[(b->head + i++) & (b->size - 1)];
+		else
+			q[k++] = in[j++];
+	}
+	b->nincoming = 0;
+	b->n = 0;
+	b->head = 0;
+	ai_grow(b, n);
+	memcpy(b->q, q, sizeof(*q) * n);
+	b->n = n;
+}
+
+static inline int ai_out_of_time(long long start, int nthinks)
+{
+	if (ai.max_thinks && nthinks >= ai.max_thinks)
+		return 1;
+	return ai.budget_usecs && usecs_now() - start >= ai.budget_usecs;
+}
+
+void run_ai()
+{
+	struct ai_bucket *b;
+	struct ai_entry e;
+	struct game_obj_t *o;
+	int k, late, bucket, nthinks = 0, out = 0;
+	long long start = usecs_now();
+
+	for (k = 0; k < AI_BUCKETS; k++)
+		if (ai.b[k].nincoming)
+			ai_merge_incoming(&ai.b[k]);
+
+	for (k = 0; k < AI_BUCKETS && !out; k++) {
+		b = &ai.b[k];
+		while (b->n > 0) {
+			e = b->q[b->head];
+			o = obj_lookup(e.h);
+			if (o == NULL || !o->alive) {	/* dead, forget it */
+				ai_pop(b);
+				continue;
+			}
+			if (e.due > timer)
+				break;	/* nobody else here is due either */
+			if (ai_out_of_time(start, nthinks)) {
+				out = 1;
+				break;
+			}
+			ai_pop(b);
+			obj_type[(unsigned char) o->otype]->think(o);
+			nthinks++;
+			late = timer - e.due;
+			b->thinks++;
+			b->late += late;
+			if (late > b->max_late)
+				b->max_late = late;
+			bucket = ai_bucket_for(o);
+			ai_push(bucket, e.h, timer + ai_period[bucket]);
+		}
+	}
+
+	for (k = 0; k < AI_BUCKETS; k++) {
+		b = &ai.b[k];
+		if (b->n > 0 && b->q[b->head].due <= timer)
+			b->starved_ticks++;	/* (or the head is dead, which is near enough) */
+	}
+	ai.ticks++;
+	ai.out_of_time += out;
+	ai.usecs += usecs_now() - start;
+}
+
+void print_ai_stats()
+{
+	struct ai_bucket *b;
+	int k;
+
+	if (ai.ticks == 0)
+		return;
+	printf("ai: %.1f usecs/tick, out of time on %d of %d ticks (budget %d usecs, %d thinks)\n",
+		(double) ai.usecs / ai.ticks, ai.out_of_time, ai.ticks,
+		ai.budget_usecs, ai.max_thinks);
+	for (k = 0; k < AI_BUCKETS; k++) {
+		b = &ai.b[k];
+		printf("  %-4s: %d queued, %lld thinks, %.2f ticks late on average, "
+			"%d at worst, starved on %d ticks\n",
+			ai_bucket_name[k], b->n, b->thinks,
+			b->thinks ? (double) b->late / b->thinks : 0.0,
+			b->max_late, b->starved_ticks);
+	}
+}
+
+/* AI scheduler code ends    */
+/*****************************/
+
+/*****************************/
+/* enemy code begins         */
+
+#define MAX_ENEMIES 65536
+#define ENEMY_SPEED 3
+#define ENEMY_SIGHT (6 * SCREEN_HEIGHT / 8)	/* notices the player this close */
+#define ENEMY_RANGE (3 * SCREEN_HEIGHT / 8)	/* and shoots this close */
+#define ENEMY_RELOAD 20				/* ticks between shots */
+
+struct enemy_data {
+	struct health_data health;
+	int goalx, goaly;	/* where we're wandering to */
+	int reloading;		/* enemy_reloaded() is due, no shooting till then */
+};
+
+/* timer event, ENEMY_RELOAD ticks after a shot */
+void enemy_reloaded(struct game_obj_t *o, int arg)
+{
+	struct enemy_data *e = obj_cold(o);
+
+	e->reloading = 0;
+}
+
+static void head_for(struct game_obj_t *o, int x, int y, int speed)
+{
+	float dx = x - o->x, dy = y - o->y, d = sqrtf(dx * dx + dy * dy);
+
+	if (d < speed) {
+		o->vx = o->vy = 0;
+		return;
+	}
+	o->vx = lrintf(dx * speed / d);
+	o->vy = lrintf(dy * speed / d);
+}
+
+void enemy_think(struct game_obj_t *o)
+{
+	struct enemy_data *e = obj_cold(o);
+	struct game_obj_t *p = nearest_player(o->x, o->y);
+	float dx, dy, d, score, best_score;
+	int i, x, y, tile;
+
+	if (p) {
+		dx = p->x - o->x;
+		dy = p->y - o->y;
+		d = sqrtf(dx * dx + dy * dy);
+		if (d < ENEMY_SIGHT) {
+			/* close in, but not right up to it */
+			if (d > ENEMY_RANGE / 2)
+				head_for(o, p->x, p->y, ENEMY_SPEED);
+			else
+				o->vx = o->vy = 0;
+			if (d < ENEMY_RANGE && !e->reloading && d > 0) {
+				fire_projectile(obj_handle(o), o->x, o->y,
+					lrintf(dx * PROJECTILE_SPEED / d),
+					lrintf(dy * PROJECTILE_SPEED / d),
+					ENEMY_RANGE / PROJECTILE_SPEED + 2, PROJECTILE_DAMAGE);
+				e->reloading = 1;
+				schedule_timer_event(o->number, ENEMY_RELOAD, enemy_reloaded, 0);
+			}
+			return;
+		}
+	}
+
+	/* nothing to shoot at, wander about, preferring places where */
+	/* our side is strong and theirs isn't */
+	if (abs(e->goalx - o->x) < 2 * ENEMY_SPEED && abs(e->goaly - o->y) < 2 * ENEMY_SPEED) {
+		best_score = 0;
+		for (i = 0; i < 4; i++) {
+			x = o->x + (randomn(11) - 5) * mapsquarewidth;
+			y = o->y + (randomn(11) - 5) * mapsquarewidth;
+			/* near the edge, a goal off the map could never be */
+			/* reached, and would be scored from outside the map */
+			clamp_to_map(&x, &y);
+			tile = txy(x / mapsquarewidth, y / mapsquarewidth);
+			score = influence.raw[0] ?
+				influence_at(SIDE_ENEMY, tile) - influence_at(SIDE_PLAYER, tile) : 0;
+			if (i == 0 || score > best_score) {
+				best_score = score;
+				e->goalx = x;
+				e->goaly = y;
+			}
+		}
+	}
+	head_for(o, e->goalx, e->goaly, ENEMY_SPEED);
+}
+
+struct obj_type_t enemy_type = {
+	.otype = OBJ_TYPE_ENEMY,
+	.name = "enemy",
+	.think = enemy_think,
+	.move_batch = formation_move_batch,
+	.draw_batch = generic_draw_batch,
+	.max = MAX_ENEMIES,
+	.cold_size = sizeof(struct enemy_data),
+	.maxhp = 30,
+	.avoid_radius = 12,
+	.side = SIDE_ENEMY,
+	.influence = 10,
+};
+
+struct game_obj_t *add_enemy(int x, int y)
+{
+	struct game_obj_t *o;
+	struct enemy_data *e;
+
+	o = add_generic_object(x, y, 0, 0, formation_move, generic_draw, WHITE,
+		&enemy_vect, 1, OBJ_TYPE_ENEMY, 1);
+	if (o == NULL)
+		return NULL;
+	e = obj_cold(o);
+	e->goalx = x;
+	e->goaly = y;
+	e->reloading = 0;
+	ai_add_agent(o);
+	if (obj_lookup(the_enemy) == NULL)
+		the_enemy = obj_handle(o);
+	return o;
+}
+
+/* n enemies dotted about, but not right on top of the players */
+void add_demo_enemies(int n)
+{
+	struct game_obj_t *p;
+	int i, x, y;
+
+	for (i = 0; i < n; i++) {
+		x = randomn(mapxdim * mapsquarewidth);
+		y = randomn(mapydim * mapsquarewidth);
+		p = nearest_player(x, y);
+		if (p && abs(x - p->x) < 2 * ENEMY_SIGHT && abs(y - p->y) < 2 * ENEMY_SIGHT)
+			continue;
+		add_enemy(x, y);
+	}
+}
+
+/* enemy code ends           */
+/*****************************/
+
+void player_move_batch(struct game_obj_t **o, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		player_move(o[i]);
+}
+
+struct player_data {
+	struct health_data health;
+};
+
+struct obj_type_t player_type = {
+	.otype = OBJ_TYPE_PLAYER,
+	.name = "player",
+	.move_batch = player_move_batch,
+	.draw_batch = generic_draw_batch,
+	.max = MAXPLAYERS,
+	.cold_size = sizeof(struct player_data),
+	.maxhp = 100,
+	.side = SIDE_PLAYER,
+	.influence = 100,
+};
+
+void init_obj_types()
+{
+	memset(obj_type, 0, sizeof(obj_type));
+	register_obj_type(&player_type);
+	register_obj_type(&battalion_type);
+	register_obj_type(&soldier_type);
+	register_obj_type(&enemy_type);
+}
+
+/* where each player starts, relative to the middle of the map, and its color */
+static const int player_start_x[MAXPLAYERS] = { 0, 300, -300, 0, 0, 300, -300, 300 };
+static const int player_start_y[MAXPLAYERS] = { 0, 0, 0, 300, -300, 300, -300, -300 };
+static const int player_color[MAXPLAYERS] = {
+	YELLOW, CYAN, MAGENTA, WHITE, ORANGE, GREEN, BLUE, RED };
+
+/* let player id into the game.  Its input counts from the next tick. */
+struct game_obj_t *add_player(int id)
+{
+	struct game_obj_t *o;
+
+	if (active_players & (1U << id))
+		return obj_lookup(player_obj[id]);
+	o = add_generic_object(
+		mapxdim * mapsquarewidth / 2 + player_start_x[id],
+		mapydim * mapsquarewidth / 2 + player_start_y[id],
+		0, 0, player_move, player_draw,
+		player_color[id], &player_vect, 1, OBJ_TYPE_PLAYER, 1);
+	if (o == NULL)
+		return NULL;
+	player_obj[id] = obj_handle(o);
+	player_input_from[id] = timer;
+	active_players |= 1U << id;
+	if (id == local_player)
+		the_player = player_obj[id];
+	return o;
+}
+
+/* players 0 .. n-1 start the game, the rest may join later */
+void init_players(int n)
+{
+	struct my_point_t *points;
+	int i;
+
+	spin_points(player_vect.p, player_vect.npoints, &points, NANGLES, 0, 0);
+	player_vect.p = points;
+	player_vect.nframes = NANGLES;
+	calc_vect_bbox(&player_vect);
+	for (i = 0; i < MAXPLAYERS; i++)
+		player_obj[i] = NO_OBJ;
+	active_players = 0;
+	for (i = 0; i < n && i < MAXPLAYERS; i++)
+		add_player(i);
+}
+
+/*****************************/
+/* audio code begins         */
+
+/* A software mixer on a thread of its own.  The game thread never */
+/* touches a voice: it puts play, stop and volume commands on a lock */
+/* free queue, which the mixer reads once per block of AUDIO_BLOCK */
+/* frames before mixing up to AUDIO_VOICES voices into it, and hands */
+/* the block to a sink.  If the queue is full the command is dropped, */
+/* the game doesn't wait.  The sinks are null (for timing the mixer), */
+/* wav:file (for headless runs) and oss[:device].  Sounds are made up */
+/* at startup, there are no sound files.  Sound follows what the */
+/* game's counters say happened each tick, see audio_game_events(), */
+/* so it has no effect on the game, and a networked game can have */
+/* sound on one machine and not another. */
+
+#define AUDIO_RATE 22050
+#define AUDIO_BLOCK 256		/* frames, mono 16 bit, about 11.6 ms */
+#define AUDIO_VOICES 64
+#define AUDIO_QUEUE 256		/* commands, must be a power of 2 */
+#define MUSIC_VOICE 0		/* the rest are for sound effects */
+
+#define AUDIO_PLAY 0
+#define AUDIO_STOP 1
+#define AUDIO_VOLUME 2
+
+#define SOUND_SHOT 0
+#define SOUND_HIT 1
+#define SOUND_BOOM 2
+#define SOUND_MUSIC 3
+#define NSOUNDS 4
+
+struct sound {
+	short *data;
+	int len;
+};
+
+struct audio_cmd {
+	int op, voice, sound, loop;
+	float volume;
+	long long when;		/* usecs_now() when it was queued */
+};
+
+struct voice {
+	struct sound *s;	/* NULL when the voice is free */
+	int pos, loop;
+	short gain;		/* volume, 32767 is 1.0 */
+	long long when;		/* when the play command was queued, 0 once it's heard */
+};
+
+struct audio_sink;
+
+typedef int audio_sink_open(struct audio_sink *sink, const char *arg);
+typedef int audio_sink_write(struct audio_sink *sink, short *frames, int n);
+typedef void audio_sink_close(struct audio_sink *sink);
+
+struct audio_sink {
+	const char *name;
+	audio_sink_open *open;
+	audio_sink_write *write;
+	audio_sink_close *close;
+	int paced;		/* write() waits for the device, so the mixer needn't */
+	FILE *f;
+	int fd;
+	long long frames;	/* written */
+};
+
+struct audio {
+	struct audio_sink *sink;	/* NULL with no --audio */
+	struct sound sound[NSOUNDS];
+	struct audio_cmd q[AUDIO_QUEUE];
+	volatile gint head;	/* commands queued, only the game thread moves it */
+	volatile gint tail;	/* commands taken, only the mixer moves it */
+	struct voice voice[AUDIO_VOICES];	/* only the mixer touches these */
+	int next_voice;		/* game thread's, for handing out effect voices */
+	int effects, music;	/* keysoundeffects, keymusic */
+	volatile int stop;
+	GThread *thread;
+	int last_shots, last_hits;	/* what audio_game_events() saw last tick */
+	long long last_deaths;
+	/* stats */
+	int blocks, dropped, late;
+	long long mix_usecs, worst_mix_usecs;
+	long long latency_usecs, worst_latency_usecs;
+	int nlatency;
+} audio;
+
+/* the sinks */
+
+static int null_sink_open(struct audio_sink *sink, const char *arg)
+{
+	return 1;
+}
+
+static int null_sink_write(struct audio_sink *sink, short *frames, int n)
+{
+	return 1;
+}
+
+static void null_sink_close(struct audio_sink *sink)
+{
+}
+
+static void wav_put(FILE *f, unsigned int v, int bytes)
+{
+	while (bytes--) {
+		fputc(v & 0xff, f);
+		v >>= 8;
+	}
+}
+
+static void wav_header(FILE *f, unsigned int data_bytes)
+{
+	fwrite("RIFF", 4, 1, f);
+	wav_put(f, 36 + data_bytes, 4);
+	fwrite("WAVEfmt ", 8, 1, f);
+	wav_put(f, 16, 4);		/* fmt chunk size */
+	wav_put(f, 1, 2);		/* PCM */
+	wav_put(f, 1, 2);		/* mono */
+	wav_put(f, AUDIO_RATE, 4);
+	wav_put(f, AUDIO_RATE * 2, 4);	/* bytes per second */
+	wav_put(f, 2, 2);		/* bytes per frame */
+	wav_put(f, 16, 2);		/* bits per sample */
+	fwrite("data", 4, 1, f);
+	wav_put(f, data_bytes, 4);
+}
+
+static int wav_sink_open(struct audio_sink *sink, const char *arg)
+{
+	if (arg == NULL) {
+		fprintf(stderr, "battallica: --audio wav:file wants a file name\n");
+		return 0;
+	}
+	sink->f = fopen(arg, "w");
+	if (sink->f == NULL) {
+		fprintf(stderr, "battallica: can't write %s: %s\n", arg, strerror(errno));
+		return 0;
+	}
+	wav_header(sink->f, 0);	/* sizes get filled in at the end */
+	return 1;
+}
+
+static int wav_sink_write(struct audio_sink *sink, short *frames, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		wav_put(sink->f, (unsigned short) frames[i], 2);
+	return !ferror(sink->f);
+}
+
+static void wav_sink_close(struct audio_sink *sink)
+{
+	rewind(sink->f);
+	wav_header(sink->f, sink->frames * 2);
+	fclose(sink->f);
+}
+
+static int oss_sink_open(struct audio_sink *sink, const char *arg)
+{
+	int fmt = AFMT_S16_NE, channels = 1, rate = AUDIO_RATE;
+	int frag = (4 << 16) | 9;	/* 4 fragments of 512 bytes, a block each */
+
+	if (arg == NULL)
+		arg = "/dev/dsp";
+	sink->fd = open(arg, O_WRONLY);
+	if (sink->fd < 0) {
+		fprintf(stderr, "battallica: can't open %s: %s\n", arg, strerror(errno));
+		return 0;
+	}
+	ioctl(sink->fd, SNDCTL_DSP_SETFRAGMENT, &frag);
+	if (ioctl(sink->fd, SNDCTL_DSP_SETFMT, &fmt) < 0 || fmt != AFMT_S16_NE ||
+		ioctl(sink->fd, SNDCTL_DSP_CHANNELS, &channels) < 0 || channels != 1 ||
+		ioctl(sink->fd, SNDCTL_DSP_SPEED, &rate) < 0) {
+		fprintf(stderr, "battallica: %s won't do 16 bit mono\n", arg);
+		close(sink->fd);
+		return 0;
+	}
+	if (rate != AUDIO_RATE)
+		fprintf(stderr, "battallica: %s is running at %d Hz, not %d, sound will be off key\n",
+			arg, rate, AUDIO_RATE);
+	return 1;
+}
+
+static int oss_sink_write(struct audio_sink *sink, short *frames, int n)
+{
+	return write(sink->fd, frames, n * sizeof(*frames)) == (ssize_t) (n * sizeof(*frames));
+}
+
+static void oss_sink_close(struct audio_sink *sink)
+{
+	close(sink->fd);
+}
+
+struct audio_sink audio_sinks[] = {
+	{ .name = "null", .open = null_sink_open, .write = null_sink_write,
+		.close = null_sink_close, },
+	{ .name = "wav", .open = wav_sink_open, .write = wav_sink_write,
+		.close = wav_sink_close, },
+	{ .name = "oss", .open = oss_sink_open, .write = oss_sink_write,
+		.close = oss_sink_close, .paced = 1, },
+};
+
+/* the mixer */
+
+/* add n samples of in, at gain, to out, saturating */
+static void mix_voice(short *out, const short *in, int n, short gain)
+{
+	int i = 0, v;
+#ifdef __SSE2__
+	__m128i g = _mm_set1_epi16(gain), s;
+
+	for (; i + 8 <= n; i += 8) {
+		s = _mm_mulhi_epi16(_mm_loadu_si128((const __m128i *) &in[i]), g);
+		s = _mm_adds_epi16(s, s);	/* mulhi halved it */
+		_mm_storeu_si128((__m128i *) &out[i],
+			_mm_adds_epi16(_mm_loadu_si128((const __m128i *) &out[i]), s));
+	}
+#endif
+	for (; i < n; i++) {
+		v = out[i] + ((in[i] * gain) >> 15);
+		out[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+	}
+}
+
+static void mix_block(short *out, int *heard)
+{
+	struct voice *v;
+	int i, n, done;
+
+	memset(out, 0, sizeof(*out) * AUDIO_BLOCK);
+	for (i = 0; i < AUDIO_VOICES; i++) {
+		v = &audio.voice[i];
+		if (v->s == NULL)
+			continue;
+		for (done = 0; done < AUDIO_BLOCK && v->s; done += n) {
+			n = MIN(AUDIO_BLOCK - done, v->s->len - v->pos);
+			mix_voice(out + done, v->s->data + v->pos, n, v->gain);
+			v->pos += n;
+			if (v->pos >= v->s->len) {
+				if (v->loop)
+					v->pos = 0;
+				else
+					v->s = NULL;
+			}
+		}
+		if (v->when)
+			heard[i] = 1;
+	}
+}
+
+static void run_audio_commands()
+{
+	struct audio_cmd *c;
+	struct voice *v;
+	int tail = audio.tail;
+
+	while (tail != g_atomic_int_get(&audio.head)) {
+		c = &audio.q[tail & (AUDIO_QUEUE - 1)];
+		v = &audio.voice[c->voice];
+		switch (c->op) {
+		case AUDIO_PLAY:
+			v->s = &audio.sound[c->sound];
+			v->pos = 0;
+			v->loop = c->loop;
+			v->gain = c->volume * 32767;
+			v->when = c->when;
+			break;
+		case AUDIO_STOP:
+			v->s = NULL;
+			break;
+		case AUDIO_VOLUME:
+			v->gain = c->volume * 32767;
+			break;
+		}
+		tail++;
+		g_atomic_int_set(&audio.tail, tail);
+	}
+}
+
+static gpointer audio_thread(gpointer data)
+{
+	struct audio_sink *sink = audio.sink;
+	short block[AUDIO_BLOCK];
+	int heard[AUDIO_VOICES];
+	long long start, tstart, now, next, usecs, block_usecs;
+	int i;
+
+	trace_register_thread("audio");
+	block_usecs = 1000000LL * AUDIO_BLOCK / AUDIO_RATE;
+	next = usecs_now();
+	while (!audio.stop) {
+		start = usecs_now();
+		tstart = trace_begin();
+		memset(heard, 0, sizeof(heard));
+		run_audio_commands();
+		mix_block(block, heard);
+		usecs = usecs_now() - start;
+		audio.mix_usecs += usecs;
+		if (usecs > audio.worst_mix_usecs)
+			audio.worst_mix_usecs = usecs;
+		trace_end("mix_block", tstart, audio.blocks);
+
+		if (sink->write(sink, block, AUDIO_BLOCK))
+			sink->frames += AUDIO_BLOCK;
+		audio.blocks++;
+
+		/* from being asked for, to being handed to the sink */
+		now = usecs_now();
+		for (i = 0; i < AUDIO_VOICES; i++) {
+			if (!heard[i])
+				continue;
+			usecs = now - audio.voice[i].when;
+			audio.latency_usecs += usecs;
+			audio.nlatency++;
+			if (usecs > audio.worst_latency_usecs)
+				audio.worst_latency_usecs = usecs;
+			audio.voice[i].when = 0;
+		}
+
+		if (sink->paced)
+			continue;
+		next += block_usecs;
+		if (next < now - 4 * block_usecs) {	/* fell well behind, don't try to catch up */
+			audio.late++;
+			next = now;
+		}
+		if (next > now)
+			g_usleep(next - now);
+	}
+	return NULL;
+}
+
+/* the game thread's end */
+
+static void audio_command(int op, int voice, int sound, int loop, float volume)
+{
+	struct audio_cmd *c;
+	int head = audio.head;
+
+	if (audio.sink == NULL)
+		return;
+	if (head - g_atomic_int_get(&audio.tail) >= AUDIO_QUEUE) {
+		audio.dropped++;
+		return;
+	}
+	c = &audio.q[head & (AUDIO_QUEUE - 1)];
+	c->op = op;
+	c->voice = voice;
+	c->sound = sound;
+	c->loop = loop;
+	c->volume = volume;
+	c->when = usecs_now();
+	g_atomic_int_set(&audio.head, head + 1);
+}
+
+/* play a sound effect on the next voice, which steals the oldest one */
+void play_sound(int sound, float volume)
+{
+	if (!audio.effects)
+		return;
+	if (volume > 1.0)
+		volume = 1.0;
+	audio.next_voice = audio.next_voice % (AUDIO_VOICES - 1) + 1;	/* not MUSIC_VOICE */
+	audio_command(AUDIO_PLAY, audio.next_voice, sound, 0, volume);
+}
+
+void toggle_sound_effects()
+{
+	int i;
+
+	audio.effects = !audio.effects;
+	if (!audio.effects)
+		for (i = 0; i < AUDIO_VOICES; i++)
+			if (i != MUSIC_VOICE)
+				audio_command(AUDIO_STOP, i, 0, 0, 0.0);
+}
+
+void toggle_music()
+{
+	audio.music = !audio.music;
+	if (audio.music)
+		audio_command(AUDIO_PLAY, MUSIC_VOICE, SOUND_MUSIC, 1, 0.4);
+	else
+		audio_command(AUDIO_STOP, MUSIC_VOICE, 0, 0, 0.0);
+}
+
+/* once a tick, after the tick: a sound for whatever went on in it */
+void audio_game_events()
+{
+	int shots = projectiles.fired - audio.last_shots;
+	int hits = projectiles.hit - audio.last_hits;
+	long long deaths = combat_stats.deaths - audio.last_deaths;
+
+	audio.last_shots = projectiles.fired;
+	audio.last_hits = projectiles.hit;
+	audio.last_deaths = combat_stats.deaths;
+	if (shots > 0)
+		play_sound(SOUND_SHOT, 0.2 + 0.05 * shots);
+	if (hits > 0)
+		play_sound(SOUND_HIT, 0.3 + 0.05 * hits);
+	if (deaths > 0)
+		play_sound(SOUND_BOOM, 0.5 + 0.1 * deaths);
+}
+
+/* making up the sounds */
+
+static unsigned int audio_noise_seed = 1;	/* not sim_rng, sound mustn't touch the game */
+
+static float audio_noise()
+{
+	audio_noise_seed = audio_noise_seed * 1103515245 + 12345;
+	return ((audio_noise_seed >> 16) & 0x7fff) / 16384.0 - 1.0;
+}
+
+static void new_sound(struct sound *s, float seconds)
+{
+	s->len = seconds * AUDIO_RATE;
+	s->data = (short *) game_malloc(ALLOC_AUDIO, sizeof(*s->data) * s->len);
+}
+
+static void make_sounds()
+{
+	static const float notes[] = { 110.0, 130.8, 164.8, 196.0, 164.8, 130.8, 98.0, 123.5 };
+	struct sound *s;
+	float t, f, phase = 0.0, lp = 0.0;
+	int i, note, note_len;
+
+	/* a falling square wave */
+	s = &audio.sound[SOUND_SHOT];
+	new_sound(s, 0.08);
+	for (i = 0; i < s->len; i++) {
+		t = (float) i / s->len;
+		phase += (1200.0 - 800.0 * t) / AUDIO_RATE;
+		s->data[i] = (phase - floor(phase) < 0.5 ? 1 : -1) * 12000 * (1.0 - t);
+	}
+
+	/* a click of noise */
+	s = &audio.sound[SOUND_HIT];
+	new_sound(s, 0.1);
+	for (i = 0; i < s->len; i++) {
+		t = (float) i / s->len;
+		s->data[i] = audio_noise() * 16000 * (1.0 - t) * (1.0 - t);
+	}
+
+	/* low passed noise, dying away */
+	s = &audio.sound[SOUND_BOOM];
+	new_sound(s, 0.6);
+	for (i = 0; i < s->len; i++) {
+		t = (float) i / s->len;
+		lp += 0.08 * (audio_noise() - lp);
+		s->data[i] = lp * 60000 * (1.0 - t) * (1.0 - t);
+	}
+
+	/* a bass line to go round and round */
+	s = &audio.sound[SOUND_MUSIC];
+	note_len = AUDIO_RATE / 4;
+	new_sound(s, NPOINTS(notes) / 4.0);
+	phase = 0.0;
+	for (i = 0; i < s->len; i++) {
+		note = i / note_len;
+		f = notes[note % NPOINTS(notes)];
+		t = (float) (i % note_len) / note_len;
+		phase += f / AUDIO_RATE;
+		/* a triangle, which fades over each note */
+		s->data[i] = (4.0 * fabs(phase - floor(phase) - 0.5) - 1.0) * 14000 * (1.0 - 0.7 * t);
+	}
+}
+
+/* --audio null, wav:file or oss[:device].  Needs g_thread_init() done. */
+void init_audio(const char *spec)
+{
+	char name[16];
+	const char *arg;
+	int i, n;
+
+	arg = strchr(spec, ':');
+	n = arg ? arg - spec : (int) strlen(spec);
+	snprintf(name, sizeof(name), "%.*s", n, spec);
+	if (arg)
+		arg++;
+	for (i = 0; i < (int) NPOINTS(audio_sinks); i++)
+		if (strcmp(audio_sinks[i].name, name) == 0)
+			break;
+	if (i >= (int) NPOINTS(audio_sinks)) {
+		fprintf(stderr, "battallica: --audio wants null, wav:file or oss[:device], not '%s'\n", spec);
+		exit(1);
+	}
+	if (!audio_sinks[i].open(&audio_sinks[i], arg)) {
+		fprintf(stderr, "battallica: carrying on without sound\n");
+		return;
+	}
+	make_sounds();
+	audio.sink = &audio_sinks[i];
+	audio.effects = 1;
+	audio.thread = g_thread_try_new("audio", audio_thread, NULL, NULL);
+	if (audio.thread == NULL) {
+		audio.sink->close(audio.sink);
+		audio.sink = NULL;
+		fprintf(stderr, "battallica: can't start the audio thread, carrying on without sound\n");
+	}
+}
+
+void finish_audio()
+{
+	if (audio.thread == NULL)
+		return;
+	audio.stop = 1;
+	g_thread_join(audio.thread);
+	audio.thread = NULL;
+	audio.sink->close(audio.sink);
+}
+
+void print_audio_stats()
+{
+	if (audio.blocks == 0)
+		return;
+	printf("audio: %s sink, %d blocks of %d frames, mixing %.1f usecs a block (worst %lld)\n",
+		audio.sink->name, audio.blocks, AUDIO_BLOCK,
+		(double) audio.mix_usecs / audio.blocks, audio.worst_mix_usecs);
+	printf("  command to sink %.1f ms on average, %.1f ms at worst, %d commands dropped, fell behind %d times\n",
+		audio.nlatency ? audio.latency_usecs / 1000.0 / audio.nlatency : 0.0,
+		audio.worst_latency_usecs / 1000.0, audio.dropped, audio.late);
+}
+
+/* audio code ends           */
+/*****************************/
+
+/**********************************/
+/* keyboard handling stuff begins */
+
+struct keyname_value_entry {
+	char *name;
+	unsigned int value;
+} keyname_value_map[] = {
+	{ "a", GDK_a }, 
+	{ "b", GDK_b }, 
+	{ "c", GDK_c }, 
+	{ "d", GDK_d }, 
+	{ "e", GDK_e }, 
+	{ "f", GDK_f }, 
+	{ "g", GDK_g }, 
+	{ "h", GDK_h }, 
+	{ "i", GDK_i }, 
+	{ "j", GDK_j }, 
+	{ "k", GDK_k }, 
+	{ "l", GDK_l }, 
+	{ "m", GDK_m }, 
+	{ "n", GDK_n }, 
+	{ "o", GDK_o }, 
+	{ "p", GDK_p }, 
+	{ "q", GDK_q }, 
+	{ "r", GDK_r }, 
+	{ "s", GDK_s }, 
+	{ "t", GDK_t }, 
+	{ "u", GDK_u }, 
+	{ "v", GDK_v }, 
+	{ "w", GDK_w }, 
+	{ "x", GDK_x }, 
+	{ "y", GDK_y }, 
+	{ "z", GDK_z }, 
+	{ "A", GDK_A }, 
+	{ "B", GDK_B }, 
+	{ "C", GDK_C }, 
+	{ "D", GDK_D }, 
+	{ "E", GDK_E }, 
+	{ "F", GDK_F }, 
+	{ "G", GDK_G }, 
+	{ "H", GDK_H }, 
+	{ "I", GDK_I }, 
+	{ "J", GDK_J }, 
+	{ "K", GDK_K }, 
+	{ "L", GDK_L }, 
+	{ "M", GDK_M }, 
+	{ "N", GDK_N }, 
+	{ "O", GDK_O }, 
+	{ "P", GDK_P }, 
+	{ "Q", GDK_Q }, 
+	{ "R", GDK_R }, 
+	{ "S", GDK_S }, 
+	{ "T", GDK_T }, 
+	{ "U", GDK_U }, 
+	{ "V", GDK_V }, 
+	{ "W", GDK_W }, 
+	{ "X", GDK_X }, 
+	{ "Y", GDK_Y }, 
+	{ "Z", GDK_Z }, 
+	{ "0", GDK_0 }, 
+	{ "1", GDK_1 }, 
+	{ "2", GDK_2 }, 
+	{ "3", GDK_3 }, 
+	{ "4", GDK_4 }, 
+	{ "5", GDK_5 }, 
+	{ "6", GDK_6 }, 
+	{ "7", GDK_7 }, 
+	{ "8", GDK_8 }, 
+	{ "9", GDK_9 }, 
+	{ "-", GDK_minus }, 
+	{ "+", GDK_plus }, 
+	{ "=", GDK_equal }, 
+	{ "?", GDK_question }, 
+	{ ".", GDK_period }, 
+	{ ",", GDK_comma }, 
+	{ "<", GDK_less }, 
+	{ ">", GDK_greater }, 
+	{ ":", GDK_colon }, 
+	{ ";", GDK_semicolon }, 
+	{ "@", GDK_at }, 
+	{ "*", GDK_asterisk }, 
+	{ "$", GDK_dollar }, 
+	{ "%", GDK_percent }, 
+	{ "&", GDK_ampersand }, 
+	{ "'", GDK_apostrophe }, 
+	{ "(", GDK_parenleft }, 
+	{ ")", GDK_parenright }, 
+	{ "space", GDK_space }, 
+	{ "enter", GDK_Return }, 
+	{ "return", GDK_Return }, 
+	{ "backspace", GDK_BackSpace }, 
+	{ "delete", GDK_Delete }, 
+	{ "pause", GDK_Pause }, 
+	{ "scrolllock", GDK_Scroll_Lock }, 
+	{ "escape", GDK_Escape }, 
+	{ "sysreq", GDK_Sys_Req }, 
+	{ "left", GDK_Left }, 
+	{ "right", GDK_Right }, 
+	{ "up", GDK_Up }, 
+	{ "down", GDK_Down }, 
+	{ "kp_home", GDK_KP_Home }, 
+	{ "kp_down", GDK_KP_Down }, 
+	{ "kp_up", GDK_KP_Up }, 
+	{ "kp_left", GDK_KP_Left }, 
+	{ "kp_right", GDK_KP_Right }, 
+	{ "kp_end", GDK_KP_End }, 
+	{ "kp_delete", GDK_KP_Delete }, 
+	{ "kp_insert", GDK_KP_Insert }, 
+	{ "home", GDK_Home }, 
+	{ "down", GDK_Down }, 
+	{ "up", GDK_Up }, 
+	{ "left", GDK_Left }, 
+	{ "right", GDK_Right }, 
+	{ "end", GDK_End }, 
+	{ "delete", GDK_Delete }, 
+	{ "insert", GDK_Insert }, 
+	{ "kp_0", GDK_KP_0 }, 
+	{ "kp_1", GDK_KP_1 }, 
+	{ "kp_2", GDK_KP_2 }, 
+	{ "kp_3", GDK_KP_3 }, 
+	{ "kp_4", GDK_KP_4 }, 
+	{ "kp_5", GDK_KP_5 }, 
+	{ "kp_6", GDK_KP_6 }, 
+	{ "kp_7", GDK_KP_7 }, 
+	{ "kp_8", GDK_KP_8 }, 
+	{ "kp_9", GDK_KP_9 }, 
+	{ "f1", GDK_F1 }, 
+	{ "f2", GDK_F2 }, 
+	{ "f3", GDK_F3 }, 
+	{ "f4", GDK_F4 }, 
+	{ "f5", GDK_F5 }, 
+	{ "f6", GDK_F6 }, 
+	{ "f7", GDK_F7 }, 
+	{ "f9", GDK_F9 }, 
+	{ "f9", GDK_F9 }, 
+	{ "f10", GDK_F10 }, 
+	{ "f11", GDK_F11 }, 
+	{ "f12", GDK_F12 }, 
+};
+
+enum keyaction { keynone, keydown, keyup, keyleft, keyright, 
+		keylaser, keytransform, 
+		keyquarter, keypause, key2, key3, key4, key5, key6,
+		key7, key8, keysuicide, keyfullscreen, keythrust, 
+		keysoundeffects, keymusic, keyquit, keytogglemissilealarm,
+		keypausehelp, keyreverse, keytrace, keyhud, keyviews
+};
+
+enum keyaction keymap[256];
+enum keyaction ffkeymap[256];
+unsigned char *keycharmap[256];
+
+char *keyactionstring[] = {
+	"none", "down", "up", "left", "right", 
+	"laser", "bomb", "chaff", "gravitybomb",
+	"quarter", "pause", "2x", "3x", "4x", "5x", "6x",
+	"7x", "8x", "suicide", "fullscreen", "thrust", 
+	"soundeffect", "music", "quit", "missilealarm", "help", "reverse",
+	"trace", "hud", "views"
+};
+void init_keymap()
+{
+	memset(keymap, 0, sizeof(keymap));
+	memset(ffkeymap, 0, sizeof(ffkeymap));
+	memset(keycharmap, 0, sizeof(keycharmap));
+
+	keymap[GDK_j] = keydown;
+	ffkeymap[GDK_Down & 0x00ff] = keydown;
+
+	keymap[GDK_k] = keyup;
+	ffkeymap[GDK_Up & 0x00ff] = keyup;
+
+	keymap[GDK_l] = keyright;
+	ffkeymap[GDK_Right & 0x00ff] = keyright;
+	keymap[GDK_period] = keyright;
+	keymap[GDK_greater] = keyright;
+
+	keymap[GDK_h] = keyleft;
+	ffkeymap[GDK_Left & 0x00ff] = keyleft;
+	keymap[GDK_comma] = keyleft;
+	keymap[GDK_less] = keyleft;
+
+	keymap[GDK_space] = keylaser;
+	keymap[GDK_z] = keylaser;
+
+	keymap[GDK_b] = keytransform;
+	keymap[GDK_x] = keythrust;
+	keymap[GDK_p] = keypause;
+	ffkeymap[GDK_F1 & 0x00ff] = keypausehelp;
+	ffkeymap[GDK_F2 & 0x00ff] = keyhud;
+	ffkeymap[GDK_F3 & 0x00ff] = keyviews;
+	ffkeymap[GDK_F9 & 0x00ff] = keytrace;
+	keymap[GDK_q] = keyquarter;
+	keymap[GDK_m] = keymusic;
+	keymap[GDK_s] = keysoundeffects;
+	ffkeymap[GDK_Escape & 0x00ff] = keyquit;
+	keymap[GDK_1] = keytogglemissilealarm;
+
+	keymap[GDK_2] = key2;
+	keymap[GDK_3] = key3;
+	keymap[GDK_4] = key4;
+	keymap[GDK_5] = key5;
+	keymap[GDK_6] = key6;
+	keymap[GDK_7] = key7;
+	keymap[GDK_8] = key8;
+	keymap[GDK_9] = keysuicide;
+
+	ffkeymap[GDK_F11 & 0x00ff] = keyfullscreen;
+}
+
+/* Keys which are held down, one bit per keyaction.  The key callbacks */
+/* only set and clear bits, the game samples them once at the start of */
+/* each tick, so how fast things respond depends on the tick rate and */
+/* not on the keyboard autorepeat rate. */
+unsigned int keys_held = 0;
+unsigned int keys_pressed = 0;	/* pressed since last sample, so quick taps aren't lost */
+unsigned int keys_this_tick = 0; /* what the current tick sees */
+
+#define KEYBIT(ka) (1U << (ka))
+
+/* Input latency instrumentation.  Each key event is timestamped, tagged */
+/* with the tick which first sees it, and when a frame showing that tick */
+/* gets drawn, the latency from event to frame is recorded. */
+#define NLATENCY_STAMPS 64
+#define NLATENCY_BUCKETS 10	/* 0-10ms, 10-20ms, ... 90ms+ */
+
+struct input_stamp {
+	long long when;		/* usecs_now() at key event */
+	int tick;		/* tick which first saw it, -1 if not sampled yet */
+};
+
+struct input_latency_stats {
+	struct input_stamp stamp[NLATENCY_STAMPS];
+	int head, tail;		/* ring buffer of stamps waiting for a frame */
+	int count, dropped;
+	long long total, min, max;	/* usecs */
+	int bucket[NLATENCY_BUCKETS];
+} input_latency;
+
+#ifndef BATTALLICA_BENCH
+static enum keyaction event_keyaction(GdkEventKey *event)
+{
+        if ((event->keyval & 0xff00) == 0) 
+                return keymap[event->keyval];
+        return ffkeymap[event->keyval & 0x00ff];
+}
+
+static void stamp_input_event()
+{
+	struct input_latency_stats *l = &input_latency;
+	int next = (l->head + 1) % NLATENCY_STAMPS;
+
+	if (next == l->tail) {	/* full, forget the oldest */
+		l->tail = (l->tail + 1) % NLATENCY_STAMPS;
+		l->dropped++;
+	}
+	l->stamp[l->head].when = usecs_now();
+	l->stamp[l->head].tick = -1;
+	l->head = next;
+}
+#endif
+
+/* called once a frame, tick is the first tick which will act on what's */
+/* sampled (later than the next one if input is delayed, see --input-delay) */
+void sample_input(int tick)
+{
+	struct input_latency_stats *l = &input_latency;
+	int i;
+
+	keys_this_tick = keys_held | keys_pressed;
+	keys_pressed = 0;
+
+	for (i = l->tail; i != l->head; i = (i + 1) % NLATENCY_STAMPS)
+		if (l->stamp[i].tick == -1)
+			l->stamp[i].tick = tick;
+}
+
+/* called when a frame showing tick "tick" has been drawn */
+void input_frame_drawn(int tick)
+{
+	struct input_latency_stats *l = &input_latency;
+	long long now, latency;
+	int b;
+
+	if (l->tail == l->head)
+		return;
+	now = usecs_now();
+	while (l->tail != l->head) {
+		if (l->stamp[l->tail].tick == -1 || l->stamp[l->tail].tick > tick)
+			break;
+		latency = now - l->stamp[l->tail].when;
+		if (l->count == 0 || latency < l->min)
+			l->min = latency;
+		if (latency > l->max)
+			l->max = latency;
+		l->total += latency;
+		l->count++;
+		b = latency / 10000;
+		if (b >= NLATENCY_BUCKETS)
+			b = NLATENCY_BUCKETS - 1;
+		l->bucket[b]++;
+		l->tail = (l->tail + 1) % NLATENCY_STAMPS;
+	}
+}
+
+void print_input_latency()
+{
+	struct input_latency_stats *l = &input_latency;
+	int i;
+
+	if (l->count == 0)
+		return;
+	printf("input latency: %d events, min %lld us, avg %lld us, max %lld us, %d dropped\n",
+		l->count, l->min, l->total / l->count, l->max, l->dropped);
+	for (i = 0; i < NLATENCY_BUCKETS; i++)
+		if (l->bucket[i])
+			printf("  %3d-%3dms: %d\n", i * 10, (i + 1) * 10, l->bucket[i]);
+}
+
+/* the keys the game itself cares about, the rest are for this machine only */
+#define SIM_KEYS (KEYBIT(keyleft) | KEYBIT(keyright) | KEYBIT(keyup) | \
+		KEYBIT(keydown) | KEYBIT(keylaser))
+
+/* steer a player according to its held keys, once per tick */
+void player_input(struct game_obj_t *p, unsigned int keys)
+{
+	if (p == NULL || !p->alive)
+		return;
+	if ((keys & KEYBIT(keyleft)) && p->vx > -MAX_PLAYER_VX)
+		p->vx--;
+	if ((keys & KEYBIT(keyright)) && p->vx < MAX_PLAYER_VX)
+		p->vx++;
+	if ((keys & KEYBIT(keyup)) && p->vy > -MAX_PLAYER_VY)
+		p->vy--;
+	if ((keys & KEYBIT(keydown)) && p->vy < MAX_PLAYER_VY)
+		p->vy++;
+	if (keys & KEYBIT(keylaser))
+		fire_from_nose(p);
+}
+
+/*****************************/
+/* idle code begins          */
+
+/* A game which is sitting there doing nothing shouldn't cost any CPU. */
+/* When it's paused, or nothing at all in it has changed for IDLE_TICKS */
+/* ticks, advance_game() takes itself off the timer, and nothing more */
+/* is simulated or drawn until a key is pressed or the window wants */
+/* repainting.  Only when playing alone, a networked game has to keep */
+/* ticking for the others. */
+
+#define IDLE_TICKS (2 * 30)	/* nothing's changed for this long, stop ticking */
+
+struct idle {
+	int paused;
+	int pause_pressed;	/* keypause since the last tick */
+	int sleeping;		/* advance_game() is off the timer */
+	int static_ticks;	/* ticks in a row in which nothing changed */
+	unsigned int last_sum, last_rng;
+	int last_vpx, last_vpy;
+	int sleeps;
+	long long slept_at, slept_usecs;
+} idle;
+
+GSourceFunc tick_function = NULL;	/* what the tick timer calls, advance_game() */
+
+/* put the tick timer back, after a key or an expose */
+void wake_game()
+{
+	if (!idle.sleeping)
+		return;
+	idle.sleeping = 0;
+	idle.slept_usecs += usecs_now() - idle.slept_at;
+	timer_tag = g_timeout_add(1000 / frame_rate_hz, tick_function, NULL);
+}
+
+/* the main window got repainted: tick, in case it was something changing */
+void expose_wakes_game()
+{
+	if (!idle.paused)
+		wake_game();
+}
+
+static int go_to_sleep()
+{
+	idle.sleeping = 1;
+	idle.sleeps++;
+	idle.slept_at = usecs_now();
+	timer_tag = 0;
+	return FALSE;	/* which takes us off the timer */
+}
+
+/* At the start of a tick: FALSE to skip it and stop ticking, paused */
+int idle_before_tick(int must_tick)
+{
+	if (idle.pause_pressed) {
+		idle.pause_pressed = 0;
+		if (!must_tick)
+			idle.paused = !idle.paused;
+		idle.static_ticks = 0;
+	}
+	return idle.paused ? go_to_sleep() : TRUE;
+}
+
+/* At the end of a tick: FALSE to stop ticking, nothing's changing */
+int idle_after_tick(int must_tick)
+{
+	int changed;
+
+	changed = move_sum != idle.last_sum || sim_rng != idle.last_rng ||
+		game_state.vp.x != idle.last_vpx || game_state.vp.y != idle.last_vpy ||
+		projectiles.n != 0 || timer_wheel.pending != 0 || keys_held != 0;
+	idle.last_sum = move_sum;
+	idle.last_rng = sim_rng;
+	idle.last_vpx = game_state.vp.x;
+	idle.last_vpy = game_state.vp.y;
+	idle.static_ticks = changed ? 0 : idle.static_ticks + 1;
+	if (must_tick || idle.static_ticks < IDLE_TICKS)
+		return TRUE;
+	return go_to_sleep();
+}
+
+void print_idle_stats()
+{
+	if (idle.sleeps == 0)
+		return;
+	if (idle.sleeping)
+		idle.slept_usecs += usecs_now() - idle.slept_at;
+	printf("idle: stopped ticking %d times, for %.1f seconds in all\n",
+		idle.sleeps, idle.slept_usecs / 1000000.0);
+}
+
+/* idle code ends            */
+/*****************************/
+
+#ifndef BATTALLICA_BENCH
+static gint key_press_cb(GtkWidget* widget, GdkEventKey* event, gpointer data)
 {
 	enum keyaction ka;
-        if ((event->keyval & 0xff00) == 0) 
-                ka = keymap[event->keyval];
-        else
-                ka = ffkeymap[event->keyval & 0x00ff];
 
-        switch (ka) {
-        case keyfullscreen: {
-			if (fullscreen) {
-				gtk_window_unfullscreen(GTK_WINDOW(window));
-				fullscreen = 0;
-				/* configure_event takes care of resizing drawing area, etc. */
-			} else {
-				gtk_window_fullscreen(GTK_WINDOW(window));
-				fullscreen = 1;
-				/* configure_event takes care of resizing drawing area, etc. */
+	ka = event_keyaction(event);
+	if (ka == keynone)
+		return FALSE;
+	stamp_input_event();
+	keys_held |= KEYBIT(ka);
+	keys_pressed |= KEYBIT(ka);
+	wake_game();
+
+        switch (ka) {
+        case keyfullscreen: {
+			if (fullscreen) {
+				gtk_window_unfullscreen(GTK_WINDOW(window));
+				fullscreen = 0;
+				/* configure_event takes care of resizing drawing area, etc. */
+			} else {
+				gtk_window_fullscreen(GTK_WINDOW(window));
+				fullscreen = 1;
+				/* configure_event takes care of resizing drawing area, etc. */
+			}
+			return TRUE;
+		}
+	case keyquit:	in_the_process_of_quitting = !in_the_process_of_quitting;
+			break;
+	case keytrace:	trace_toggle_requested = 1;
+			break;
+	case keypause:	idle.pause_pressed = 1;
+			break;
+	case keysoundeffects:
+			toggle_sound_effects();
+			break;
+	case keymusic:	toggle_music();
+			break;
+	case keyhud:	hud_debug = !hud_debug;
+			break;
+	case keyviews:	view_layout_requested = (view_layout + 1) % NVIEW_LAYOUTS;
+			break;
+	default:	/* movement etc. is done from keys_held, once per tick */
+		break;
+	}
+	return FALSE;
+}
+
+static gint key_release_cb(GtkWidget* widget, GdkEventKey* event, gpointer data)
+{
+	enum keyaction ka;
+
+	ka = event_keyaction(event);
+	if (ka == keynone)
+		return FALSE;
+	stamp_input_event();
+	keys_held &= ~KEYBIT(ka);
+	return FALSE;
+}
+#endif
+
+/* keyboard handling stuff ends */
+/**********************************/
+
+/* What one player did in one tick.  This is all that goes over the */
+/* network in a networked game, see lockstep_frame(). */
+struct tick_command {
+	unsigned int keys;	/* SIM_KEYS held */
+	unsigned char join;	/* player number + 1 to let in this tick, 0 for none */
+};
+
+/* Run the game for one tick given everybody's commands for it.  All of */
+/* the game's state changes in here and nowhere else, so copies of the */
+/* game given the same commands stay the same. */
+void simulate_tick(struct tick_command cmd[MAXPLAYERS])
+{
+	int i, p;
+	long long start = trace_begin(), t;
+
+	timer++;
+	t = trace_begin();
+	run_timer_events();
+	trace_end("run_timer_events", t, timer);
+	for (i = 0; i < MAXPLAYERS; i++)
+		if ((active_players & (1U << i)) && timer > player_input_from[i])
+			player_input(obj_lookup(player_obj[i]), cmd[i].keys);
+	for (i = 0; i < MAXPLAYERS; i++) {
+		p = cmd[i].join - 1;
+		if (p < 0 || p >= MAXPLAYERS || (active_players & (1U << p)))
+			continue;
+		if (add_player(p))
+			player_input_from[p] = timer + JOIN_INPUT_LEAD;
+	}
+	t = trace_begin();
+	run_ai();
+	trace_end("run_ai", t, 0);
+
+	t = trace_begin();
+	schedule_moves();
+	run_steer_pass();
+	trace_end("schedule_and_steer", t, nscheduled);
+	t = trace_begin();
+	run_avoid_pass();
+	trace_end("run_avoid_pass", t, 0);
+	t = trace_begin();
+	run_move_pass();
+	trace_end("run_move_pass", t, nscheduled);
+	t = trace_begin();
+	update_influence();
+	trace_end("update_influence", t, 0);
+	t = trace_begin();
+	detect_collisions();
+	trace_end("detect_collisions", t, 0);
+	t = trace_begin();
+	move_projectiles();
+	trace_end("move_projectiles", t, projectiles.n);
+	t = trace_begin();
+	resolve_combat();
+	trace_end("resolve_combat", t, 0);
+	arena_reset(&tick_arena);
+	trace_end("simulate_tick", start, timer);
+}
+
+/*********************************/
+/* game state snapshot code begins */
+
+/* save_sim() writes everything the game's future depends on into a */
+/* buffer and load_sim() puts it back, which is how a player joining a */
+/* networked game late, or one which has got out of step, catches up. */
+/* Only state goes in: what's rebuilt every tick anyway (the move */
+/* schedule, sweep and prune order, contacts) or can be worked out */
+/* from the rest (tile occupancy, raw influence) is left out, as is */
+/* anything which is only to do with drawing.  Pointers go in as */
+/* indexes into the sim tables, everything else as it is in memory, */
+/* so snapshots only make sense between copies of the same build on */
+/* the same kind of machine. */
+
+#define SIM_SNAPSHOT_VERSION 1
+
+struct sim_buf {
+	unsigned char *data;
+	int len, size;
+	int pos;		/* where the next sb_get() reads from */
+	int bad;		/* an sb_get() ran off the end */
+};
+
+/* the same in every copy of the game, or snapshots won't load */
+void init_sim_tables()
+{
+	sim_register(&sim_move_funcs, (void *) player_move);
+	sim_register(&sim_move_funcs, (void *) formation_move);
+	sim_register(&sim_draw_funcs, (void *) player_draw);
+	sim_register(&sim_draw_funcs, (void *) generic_draw);
+	sim_register(&sim_vects, &player_vect);
+	sim_register(&sim_vects, &soldier_vect);
+	sim_register(&sim_vects, &flag_vect);
+	sim_register(&sim_vects, &enemy_vect);
+	sim_register(&sim_event_funcs, (void *) enemy_reloaded);
+}
+
+/* what's saved of each object slot */
+struct sim_obj {
+	int generation;
+	int move, draw, v;	/* indexes into the tables above */
+	int x, y, vx, vy, bearing, color, alive, otype;
+	obj_handle_t next, prev;
+	int ontargetlist, tile;
+};
+
+static void sb_need(struct sim_buf *b, int n)
+{
+	if (b->len + n <= b->size)
+		return;
+	if (b->size == 0)
+		b->size = 4096;
+	while (b->size < b->len + n)
+		b->size *= 2;
+	b->data = (unsigned char *) game_realloc(ALLOC_NET, b->data, b->size);
+}
+
+static void sb_put(struct sim_buf *b, const void *p, int n)
+{
+	if (n <= 0)
+		return;
+	sb_need(b, n);
+	memcpy(&b->data[b->len], p, n);
+	b->len += n;
+}
+
+static inline void sb_put_int(struct sim_buf *b, int v)
+{
+	sb_put(b, &v, sizeof(v));
+}
+
+static void sb_get(struct sim_buf *b, void *p, int n)
+{
+	if (n <= 0)
+		return;
+	if (b->bad || b->pos + n > b->len) {
+		b->bad = 1;
+		memset(p, 0, n);
+		return;
+	}
+	memcpy(p, &b->data[b->pos], n);
+	b->pos += n;
+}
+
+static inline int sb_get_int(struct sim_buf *b)
+{
+	int v;
+
+	sb_get(b, &v, sizeof(v));
+	return v;
+}
+
+static void sb_skip(struct sim_buf *b, int n)
+{
+	if (n < 0 || b->bad || b->pos + n > b->len) {
+		b->bad = 1;
+		return;
+	}
+	b->pos += n;
+}
+
+/* back from an index, a bad one is a bad snapshot */
+static inline void *sim_entry(struct sim_table *t, int i, struct sim_buf *b)
+{
+	if (i >= 0 && i < t->n)
+		return t->entry[i];
+	b->bad = 1;
+	return NULL;
+}
+
+static inline int obj_allocated(int i)
+{
+	return (free_obj_bitmap[i >> 5] >> (i & 31)) & 1;
+}
+
+void save_sim(struct sim_buf *b)
+{
+	struct game_obj_t *o;
+	struct obj_type_t *t;
+	struct timer_event *ev;
+	struct projectile_pool *p = &projectiles;
+	struct ai_bucket *ab;
+	struct sim_obj r;
+	int i, k, e, side, n = mapxdim * mapydim;
+
+	b->len = 0;
+	sb_put_int(b, SIM_SNAPSHOT_VERSION);
+	sb_put_int(b, timer);
+	sb_put_int(b, (int) sim_rng);
+	sb_put_int(b, (int) active_players);
+	sb_put(b, player_obj, sizeof(player_obj));
+	sb_put(b, player_input_from, sizeof(player_input_from));
+	sb_put_int(b, (int) target_head);
+	sb_put_int(b, (int) the_enemy);
+
+	/* every object slot up to the highest, then the type specific */
+	/* data of the ones in use */
+	sb_put_int(b, highest_object_number);
+	sb_put(b, free_obj_bitmap, sizeof(*free_obj_bitmap) * ((highest_object_number >> 5) + 1));
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		r.generation = o->generation;
+		r.move = sim_lookup(&sim_move_funcs, (void *) o->move);
+		r.draw = sim_lookup(&sim_draw_funcs, (void *) o->draw);
+		r.v = sim_lookup(&sim_vects, o->v);
+		r.x = o->x;
+		r.y = o->y;
+		r.vx = o->vx;
+		r.vy = o->vy;
+		r.bearing = o->bearing;
+		r.color = o->color;
+		r.alive = o->alive;
+		r.otype = o->otype;
+		r.next = o->next;
+		r.prev = o->prev;
+		r.ontargetlist = o->ontargetlist;
+		r.tile = o->tile;
+		sb_put(b, &r, sizeof(r));
+	}
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		t = obj_type[(unsigned char) o->otype];
+		if (obj_allocated(i) && t && t->cold_size > 0)
+			sb_put(b, obj_cold(o), t->cold_size);
+	}
+
+	/* what's on the timer wheel, in no particular order */
+	for (k = 0; k < TW_LEVELS * TW_SIZE; k++)
+		for (e = timer_wheel.head[k]; e >= 0; e = timer_wheel.ev[e].next) {
+			ev = &timer_wheel.ev[e];
+			if (ev->func == NULL)
+				continue;
+			sb_put_int(b, 1);
+			sb_put_int(b, (int) ev->when);
+			sb_put_int(b, ev->obj);
+			sb_put_int(b, sim_lookup(&sim_event_funcs, (void *) ev->func));
+			sb_put_int(b, ev->arg);
+		}
+	sb_put_int(b, 0);
+
+	sb_put_int(b, p->n);
+	sb_put(b, p->x, sizeof(*p->x) * p->n);
+	sb_put(b, p->y, sizeof(*p->y) * p->n);
+	sb_put(b, p->ox, sizeof(*p->ox) * p->n);
+	sb_put(b, p->oy, sizeof(*p->oy) * p->n);
+	sb_put(b, p->vx, sizeof(*p->vx) * p->n);
+	sb_put(b, p->vy, sizeof(*p->vy) * p->n);
+	sb_put(b, p->ttl, sizeof(*p->ttl) * p->n);
+	sb_put(b, p->damage, sizeof(*p->damage) * p->n);
+	sb_put(b, p->owner, sizeof(*p->owner) * p->n);
+
+	for (k = 0; k < AI_BUCKETS; k++) {
+		ab = &ai.b[k];
+		sb_put_int(b, ab->n);
+		for (i = 0; i < ab->n; i++)
+			sb_put(b, &ab->q[(ab->head + i) & (ab->size - 1)], sizeof(struct ai_entry));
+		sb_put_int(b, ab->nincoming);
+		sb_put(b, ab->incoming, sizeof(struct ai_entry) * ab->nincoming);
+	}
+
+	/* the blurred maps, and the raw ones being blurred, if any */
+	sb_put_int(b, influence.raw[0] != NULL);
+	if (influence.raw[0] == NULL)
+		return;
+	for (side = 0; side < NSIDES; side++)
+		sb_put(b, influence.front[side], sizeof(float) * n);
+	k = influence.state != INFLUENCE_IDLE;
+	sb_put_int(b, k);
+	if (k)
+		for (side = 0; side < NSIDES; side++)
+			sb_put(b, influence.snapshot[side], sizeof(float) * n);
+}
+
+/* is h nobody, or one of the high + 1 slots in a snapshot? */
+static inline int sim_handle_ok(obj_handle_t h, int high)
+{
+	return h == NO_OBJ || (int) (h & OBJ_INDEX_MASK) <= high;
+}
+
+/* Go through a snapshot the way load_sim() will, but without touching */
+/* the game: every object handle in it has to be nobody or one of its */
+/* own slots, and every table index and count in range.  Returns 0 if */
+/* something isn't. */
+static int sim_check(struct sim_buf *b)
+{
+	struct sim_obj r;
+	struct obj_type_t *t;
+	struct ai_entry a;
+	obj_handle_t h[MAXPLAYERS + 2];
+	unsigned int bits;
+	int i, j, k, high, bitmap, cold = 0, n = mapxdim * mapydim;
+	int count[256];
+
+	b->pos = 0;
+	b->bad = 0;
+	if (sb_get_int(b) != SIM_SNAPSHOT_VERSION)
+		return 0;
+	sb_skip(b, 3 * sizeof(int));	/* timer, sim_rng, active_players */
+	sb_get(b, h, sizeof(player_obj));
+	sb_skip(b, sizeof(player_input_from));
+	h[MAXPLAYERS] = (obj_handle_t) sb_get_int(b);		/* target_head */
+	h[MAXPLAYERS + 1] = (obj_handle_t) sb_get_int(b);	/* the_enemy */
+	high = sb_get_int(b);
+	if (b->bad || high < 0 || high >= max_objects)
+		return 0;
+	for (i = 0; i < MAXPLAYERS + 2; i++)
+		if (!sim_handle_ok(h[i], high))
+			return 0;
+	bitmap = b->pos;
+	sb_skip(b, sizeof(*free_obj_bitmap) * ((high >> 5) + 1));
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i <= high; i++) {
+		sb_get(b, &r, sizeof(r));
+		if (b->bad || !sim_handle_ok(r.next, high) || !sim_handle_ok(r.prev, high) ||
+			r.move < 0 || r.move >= sim_move_funcs.n ||
+			r.draw < 0 || r.draw >= sim_draw_funcs.n ||
+			r.v < 0 || r.v >= sim_vects.n || r.tile < -1 || r.tile >= n)
+			return 0;
+		memcpy(&bits, &b->data[bitmap + (i >> 5) * sizeof(bits)], sizeof(bits));
+		t = obj_type[(unsigned char) r.otype];
+		if (!((bits >> (i & 31)) & 1) || t == NULL)
+			continue;
+		if (++count[(unsigned char) r.otype] > t->max)
+			return 0;
+		cold += t->cold_size;
+	}
+	sb_skip(b, cold);
+
+	while (sb_get_int(b)) {
+		sb_skip(b, sizeof(int));	/* when */
+		i = sb_get_int(b);
+		k = sb_get_int(b);
+		sb_skip(b, sizeof(int));	/* arg */
+		if (i < -1 || i > high || k < 0 || k >= sim_event_funcs.n)
+			return 0;
+	}
+
+	k = sb_get_int(b);
+	if (k < 0 || k > projectiles.max)
+		return 0;
+	sb_skip(b, 8 * sizeof(int) * k);	/* x, y, ox, oy, vx, vy, ttl, damage */
+	for (i = 0; i < k; i++) {
+		sb_get(b, &h[0], sizeof(h[0]));	/* owner */
+		if (!sim_handle_ok(h[0], high))
+			return 0;
+	}
+
+	for (j = 0; j < AI_BUCKETS * 2; j++) {	/* the queue, then incoming */
+		k = sb_get_int(b);
+		if (b->bad || k < 0 || k > max_objects)
+			return 0;
+		for (i = 0; i < k; i++) {
+			sb_get(b, &a, sizeof(a));
+			if (!sim_handle_ok(a.h, high))
+				return 0;
+		}
+	}
+
+	k = sb_get_int(b);
+	if (k != (influence.raw[0] != NULL))
+		return 0;
+	if (k) {
+		sb_skip(b, NSIDES * sizeof(float) * n);
+		if (sb_get_int(b))
+			sb_skip(b, NSIDES * sizeof(float) * n);
+	}
+	return !b->bad;
+}
+
+/* replace the game with what save_sim() saved.  Returns 0, with the */
+/* game left alone, if it doesn't make sense. */
+int load_sim(struct sim_buf *b)
+{
+	struct game_obj_t *o;
+	struct obj_type_t *t;
+	struct projectile_pool *p = &projectiles;
+	struct ai_bucket *ab;
+	struct sim_obj r;
+	int i, k, high, nblocks, when, obj, func, arg, side, n = mapxdim * mapydim;
+
+	if (!sim_check(b))
+		return 0;
+	b->pos = 0;
+	b->bad = 0;
+	sb_get_int(b);	/* the version, sim_check() has looked */
+	influence_wait();
+
+	timer = sb_get_int(b);
+	sim_rng = (unsigned int) sb_get_int(b);
+	active_players = (unsigned int) sb_get_int(b);
+	sb_get(b, player_obj, sizeof(player_obj));
+	sb_get(b, player_input_from, sizeof(player_input_from));
+	target_head = (obj_handle_t) sb_get_int(b);
+	the_enemy = (obj_handle_t) sb_get_int(b);
+
+	high = sb_get_int(b);
+	if (b->bad || high < 0 || high >= max_objects)
+		return 0;
+	while (obj_capacity <= high)
+		if (grow_obj_arena() < 0)
+			return 0;
+	for (i = high + 1; i <= highest_object_number; i++)
+		memset(gobj(i), 0, sizeof(struct game_obj_t));
+	highest_object_number = high;
+	nblocks = (high >> 5) + 1;
+	sb_get(b, free_obj_bitmap, sizeof(*free_obj_bitmap) * nblocks);
+	memset(&free_obj_bitmap[nblocks], 0, sizeof(*free_obj_bitmap) * (nbitblocks - nblocks));
+	for (first_free_block = 0; first_free_block < nbitblocks &&
+		free_obj_bitmap[first_free_block] == 0xffffffff; first_free_block++)
+		;
+
+	for (i = 0; i <= high; i++) {
+		o = gobj(i);
+		sb_get(b, &r, sizeof(r));
+		o->number = i;
+		o->generation = r.generation;
+		o->move = (obj_move_func *) sim_entry(&sim_move_funcs, r.move, b);
+		o->draw = (obj_draw_func *) sim_entry(&sim_draw_funcs, r.draw, b);
+		o->v = (struct my_vect_obj *) sim_entry(&sim_vects, r.v, b);
+		o->x = r.x;
+		o->y = r.y;
+		o->vx = r.vx;
+		o->vy = r.vy;
+		o->bearing = r.bearing;
+		o->color = r.color;
+		o->alive = r.alive;
+		o->otype = r.otype;
+		o->cold = -1;
+		o->next = r.next;
+		o->prev = r.prev;
+		o->ontargetlist = r.ontargetlist;
+		o->tile = r.tile;
+		memset(&o->drawn, 0, sizeof(o->drawn));
+		o->drawn_bearing = 0;
+	}
+
+	/* hand out cold slots afresh, they needn't be where they were */
+	for (i = 0; i < 256; i++)
+		if (obj_type[i]) {
+			obj_type[i]->count = 0;
+			obj_type[i]->cold_next = 0;
+			obj_type[i]->ncold_free = 0;
+		}
+	live_objects = 0;
+	for (i = 0; i <= high; i++) {
+		if (!obj_allocated(i))
+			continue;
+		o = gobj(i);
+		live_objects++;
+		t = obj_type[(unsigned char) o->otype];
+		if (t == NULL)
+			continue;
+		if (t->count >= t->max)
+			return 0;
+		t->count++;
+		if (t->cold_size > 0) {
+			o->cold = alloc_cold(t);
+			sb_get(b, obj_cold(o), t->cold_size);
+		}
+	}
+	if (live_objects > peak_live_objects)
+		peak_live_objects = live_objects;
+
+	init_timer_wheel();
+	while (sb_get_int(b)) {
+		when = sb_get_int(b);
+		obj = sb_get_int(b);
+		func = sb_get_int(b);
+		arg = sb_get_int(b);
+		if (b->bad || obj < -1 || obj > high)
+			return 0;
+		timer_wheel_add(obj, (unsigned int) when, (obj_event_func *) sim_entry(&sim_event_funcs, func, b), arg);
+	}
+
+	k = sb_get_int(b);
+	if (k < 0 || k > p->max)
+		return 0;
+	p->n = k;
+	sb_get(b, p->x, sizeof(*p->x) * k);
+	sb_get(b, p->y, sizeof(*p->y) * k);
+	sb_get(b, p->ox, sizeof(*p->ox) * k);
+	sb_get(b, p->oy, sizeof(*p->oy) * k);
+	sb_get(b, p->vx, sizeof(*p->vx) * k);
+	sb_get(b, p->vy, sizeof(*p->vy) * k);
+	sb_get(b, p->ttl, sizeof(*p->ttl) * k);
+	sb_get(b, p->damage, sizeof(*p->damage) * k);
+	sb_get(b, p->owner, sizeof(*p->owner) * k);
+	nproj_hits = 0;
+	nproj_erase = 0;
+
+	for (k = 0; k < AI_BUCKETS; k++) {
+		ab = &ai.b[k];
+		i = sb_get_int(b);
+		if (b->bad || i < 0 || i > max_objects)
+			return 0;
+		ab->n = 0;
+		ab->head = 0;
+		ai_grow(ab, i);
+		sb_get(b, ab->q, sizeof(struct ai_entry) * i);
+		ab->n = i;
+		i = sb_get_int(b);
+		if (b->bad || i < 0 || i > max_objects)
+			return 0;
+		if (i > ab->incomingsize) {
+			ab->incomingsize = i;
+			ab->incoming = (struct ai_entry *)
+				game_realloc(ALLOC_AI, ab->incoming, sizeof(*ab->incoming) * ab->incomingsize);
+		}
+		sb_get(b, ab->incoming, sizeof(struct ai_entry) * i);
+		ab->nincoming = i;
+	}
+
+	k = sb_get_int(b);
+	if (k != (influence.raw[0] != NULL))
+		return 0;
+	if (k) {
+		for (side = 0; side < NSIDES; side++)
+			sb_get(b, influence.front[side], sizeof(float) * n);
+		influence.state = INFLUENCE_IDLE;
+		if (sb_get_int(b)) {
+			for (side = 0; side < NSIDES; side++)
+				sb_get(b, influence.snapshot[side], sizeof(float) * n);
+			blur_influence();
+			influence.state = INFLUENCE_READY;
+		}
+		for (side = 0; side < NSIDES; side++)
+			memset(influence.raw[side], 0, sizeof(int) * n);
+	}
+
+	/* now work out the rest from the objects */
+	if (tile_occupancy)
+		memset(tile_occupancy, 0, sizeof(*tile_occupancy) * n);
+	for (i = 0; i <= high; i++) {
+		o = gobj(i);
+		if (!obj_allocated(i) || o->tile < 0)
+			continue;
+		if (tile_occupancy)
+			tile_occupancy[o->tile]++;
+		influence_move(o, -1, o->tile);
+	}
+	if (minimap_pixmap)
+		for (i = 0; i < n; i++)
+			minimap_mark_dirty(i, MINIMAP_DIRTY_UNITS);
+	nsap = 0;
+	if (in_sap)
+		memset(in_sap, 0, in_sap_size);
+	ncontacts = 0;
+
+	the_player = (active_players & (1U << local_player)) ? player_obj[local_player] : NO_OBJ;
+	if (the_player != NO_OBJ)
+		game_state.vp.obj = the_player;
+	full_redraw = 1;
+	return !b->bad;
+}
+
+static inline unsigned int hash_int(unsigned int h, int v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, v >>= 8)
+		h = (h ^ (v & 0xff)) * 16777619U;
+	return h;
+}
+
+/* a hash of what matters, to check that copies of the game agree */
+unsigned int sim_hash()
+{
+	unsigned int h = 2166136261U;
+	struct game_obj_t *o;
+	struct health_data *hd;
+	int i;
+
+	h = hash_int(h, timer);
+	h = hash_int(h, (int) sim_rng);
+	h = hash_int(h, (int) active_players);
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		if (!o->alive)
+			continue;
+		h = hash_int(h, i);
+		h = hash_int(h, o->generation);
+		h = hash_int(h, o->x);
+		h = hash_int(h, o->y);
+		h = hash_int(h, o->vx);
+		h = hash_int(h, o->vy);
+		h = hash_int(h, o->bearing);
+		hd = obj_health(o);
+		h = hash_int(h, hd ? hd->hp : 0);
+	}
+	h = hash_int(h, projectiles.n);
+	for (i = 0; i < projectiles.n; i++) {
+		h = hash_int(h, projectiles.x[i]);
+		h = hash_int(h, projectiles.y[i]);
+	}
+	return h;
+}
+
+static void sb_put_varint(struct sim_buf *b, unsigned int v)
+{
+	unsigned char c;
+
+	do {
+		c = v & 0x7f;
+		v >>= 7;
+		if (v)
+			c |= 0x80;
+		sb_put(b, &c, 1);
+	} while (v);
+}
+
+static unsigned int sb_get_varint(struct sim_buf *b)
+{
+	unsigned int v = 0;
+	unsigned char c;
+	int shift = 0;
+
+	do {
+		sb_get(b, &c, 1);
+		v |= (unsigned int) (c & 0x7f) << shift;
+		shift += 7;
+	} while ((c & 0x80) && shift < 35);
+	return v;
+}
+
+static inline unsigned char delta_byte(struct sim_buf *base, struct sim_buf *in, int i)
+{
+	return in->data[i] ^ (i < base->len ? base->data[i] : 0);
+}
+
+/* are the 4 bytes from i the same as base's? */
+static inline int delta_quiet(struct sim_buf *base, struct sim_buf *in, int i)
+{
+	return i + 4 <= in->len && !delta_byte(base, in, i) && !delta_byte(base, in, i + 1) &&
+		!delta_byte(base, in, i + 2) && !delta_byte(base, in, i + 3);
+}
+
+/* Write in as its difference from base: alternate runs of bytes which */
+/* are the same as base's and which aren't, each run preceded by its */
+/* length, the changed ones xored with base's.  Most of a game is the */
+/* terrain-sized influence maps and objects which haven't changed */
+/* much since tick 0, so this comes out a lot smaller than in. */
+static void delta_encode(struct sim_buf *base, struct sim_buf *in, struct sim_buf *out)
+{
+	int i = 0, j, run;
+
+	out->len = 0;
+	while (i < in->len) {
+		for (run = 0; i + run < in->len && delta_byte(base, in, i + run) == 0; run++)
+			;
+		sb_put_varint(out, run);
+		i += run;
+		for (run = 0; i + run < in->len && !delta_quiet(base, in, i + run); run++)
+			;
+		sb_put_varint(out, run);
+		sb_need(out, run);
+		for (j = 0; j < run; j++)
+			out->data[out->len++] = delta_byte(base, in, i + j);
+		i += run;
+	}
+}
+
+/* the other way, rawlen being the length of what was encoded */
+static int delta_decode(struct sim_buf *base, struct sim_buf *in, int rawlen, struct sim_buf *out)
+{
+	int o = 0, j, run;
+
+	in->pos = 0;
+	in->bad = 0;
+	out->len = 0;
+	sb_need(out, rawlen);
+	out->len = rawlen;
+	while (in->pos < in->len) {
+		run = (int) sb_get_varint(in);
+		if (in->bad || run < 0 || run > rawlen - o)
+			return -1;
+		for (j = 0; j < run; j++, o++)
+			out->data[o] = o < base->len ? base->data[o] : 0;
+		run = (int) sb_get_varint(in);
+		if (in->bad || run < 0 || run > rawlen - o || run > in->len - in->pos)
+			return -1;
+		for (j = 0; j < run; j++, o++)
+			out->data[o] = in->data[in->pos++] ^ (o < base->len ? base->data[o] : 0);
+	}
+	return o == rawlen ? 0 : -1;
+}
+
+/* game state snapshot code ends */
+/*********************************/
+
+/***********************************/
+/* lockstep networking code begins */
+
+/* In a networked game every machine runs the whole game, and all that */
+/* goes between them is each player's tick_command for each tick.  No */
+/* tick is run until everybody's command for it is in, so every copy */
+/* runs the same ticks with the same commands and, the game being */
+/* deterministic, stays the same.  To hide the network's latency the */
+/* keys sampled on a frame go in the command for input_delay ticks */
+/* later, so normally the other players' commands are in by the time */
+/* they're needed.  Each packet carries every command the peer it's */
+/* going to hasn't acknowledged yet, so a lost packet only costs a */
+/* little time, and the traffic depends on the number of players, not */
+/* on the size of the battle. */
+/* */
+/* Player 0 is the authority.  A player joining late asks it to be let */
+/* in, the authority puts the join in one of its commands so everybody */
+/* adds the new player on the same tick, then sends the newcomer a */
+/* snapshot of the game as of that tick.  Snapshots go as their */
+/* difference from the game at tick 0, which everybody makes for */
+/* themselves, in chunks the receiver asks for a window at a time. */
+/* Every NET_HASH_PERIOD ticks each machine hashes its game and sends */
+/* the hash along with its commands; a player whose hash doesn't match */
+/* the authority's asks it for a snapshot too, loads it and runs the */
+/* ticks since then again from the commands it already has. */
+
+#define NET_CMD_RING 256	/* ticks of commands kept, per player */
+#define NET_MAX_CMDS 32		/* most commands in one packet */
+#define NET_MAX_CATCHUP 8	/* most ticks run in one frame when behind */
+#define NET_HASH_PERIOD 8	/* ticks between hashes */
+#define NET_HASH_RING 64	/* hashes kept */
+#define NET_CHUNK 1024		/* snapshot bytes per packet */
+#define NET_MAX_SNAPSHOT (0xffff * NET_CHUNK)	/* as many chunks as a chunk number can count */
+#define NET_MAX_RAW_SNAPSHOT (1 << 30)	/* bytes, once delta_decode()d */
+#define NET_SNAP_WINDOW 32	/* snapshot chunks asked for at once */
+#define NET_RETRY_FRAMES 10	/* ask again if nothing comes for this long */
+#define NET_MAX_PACKET 1400
+#define NET_HEADER 8		/* 'B' 'L' type from, then the sender's timer */
+#define DEFAULT_INPUT_DELAY 3	/* ticks, see --input-delay */
+#define DEFAULT_NET_AI_THINKS 500	/* see --ai-thinks */
+
+#define NET_INPUT 1		/* hash tick, hash, first tick, n, n x (keys, join) */
+#define NET_JOIN 2		/* let me in */
+#define NET_SNAP_REQUEST 3	/* tick (-1 for a fresh one), first chunk, count */
+#define NET_SNAP_CHUNK 4	/* tick, raw length, length, chunk, nchunks, data */
+
+int input_delay = DEFAULT_INPUT_DELAY;
+
+struct lockstep;
+typedef int net_send_func(struct lockstep *ls, int to, const unsigned char *buf, int len);
+typedef int net_recv_func(struct lockstep *ls, unsigned char *buf, int size);
+
+struct lockstep {
+	int id, npeers;		/* we're player id of npeers */
+	int delay;		/* input delay, ticks */
+	int joined;		/* in the game yet? */
+	int frame;
+	int last_local;		/* latest tick we've made our command for */
+	struct tick_command cmd[MAXPLAYERS][NET_CMD_RING];
+	int cmd_tick[MAXPLAYERS][NET_CMD_RING];	/* which tick each one is for */
+	int cmd_frame[NET_CMD_RING];	/* frame our own was made on */
+	int acked[MAXPLAYERS];	/* latest tick each peer said it had run */
+	unsigned int join_wanted;	/* authority: players asking to be let in */
+	unsigned int join_sched;	/* and those with a join on its way */
+
+	int hash_tick[NET_HASH_RING];	/* our hashes */
+	unsigned int hash[NET_HASH_RING];
+	int auth_tick[NET_HASH_RING];	/* the authority's */
+	unsigned int auth_hash[NET_HASH_RING];
+	int latest_hash_tick;
+	unsigned int latest_hash;
+
+	struct sim_buf *baseline;	/* the game at tick 0 */
+	struct sim_buf raw;		/* save_sim() output, scratch */
+	struct sim_buf served;		/* authority: the snapshot being handed out */
+	int served_tick, served_rawlen;
+
+	int want_snap;		/* waiting for a snapshot */
+	int rx_tick, rx_rawlen, rx_nchunks, rx_count;	/* the one coming in */
+	int rx_asked, rx_asked_frame;	/* chunks asked for up to, and when */
+	unsigned char *rx_have;		/* per chunk */
+	struct sim_buf rx;
+
+	net_send_func *send;
+	net_recv_func *recv;
+
+	/* stats */
+	long long bytes_sent, bytes_recv, snap_bytes_sent;
+	long long snap_raw_total, snap_total;	/* bytes before and after delta_encode() */
+	int packets_sent, packets_recv;
+	int wrong_source;	/* packets claiming to be from a player who's elsewhere */
+	int steps, stalls, desyncs, resyncs, snaps_made, join_frame;
+	long long latency_frames;
+	int latency_count;
+	long long usecs, sim_usecs;
+};
+
+struct lockstep *net = NULL;	/* NULL when playing alone */
+
+struct lockstep *new_lockstep(int id, int npeers, int delay, struct sim_buf *baseline,
+	net_send_func *send, net_recv_func *recv)
+{
+	struct lockstep *ls = (struct lockstep *) game_malloc(ALLOC_NET, sizeof(*ls));
+	int i, j;
+
+	memset(ls, 0, sizeof(*ls));
+	ls->id = id;
+	ls->npeers = npeers;
+	ls->delay = delay;
+	ls->baseline = baseline;
+	ls->send = send;
+	ls->recv = recv;
+	for (i = 0; i < MAXPLAYERS; i++) {
+		for (j = 0; j < NET_CMD_RING; j++)
+			ls->cmd_tick[i][j] = -1;
+		ls->acked[i] = -1;
+	}
+	for (j = 0; j < NET_HASH_RING; j++)
+		ls->hash_tick[j] = ls->auth_tick[j] = -1;
+	ls->latest_hash_tick = -1;
+	ls->served_tick = -1;
+	ls->rx_tick = -1;
+	ls->rx_asked_frame = -NET_RETRY_FRAMES;
+	ls->last_local = timer;
+	ls->joined = (active_players >> id) & 1;
+	ls->want_snap = !ls->joined;
+	return ls;
+}
+
+static unsigned char *put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static unsigned char *put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static inline unsigned int get32(const unsigned char *p)
+{
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned char *net_header(struct lockstep *ls, unsigned char *p, int type)
+{
+	*p++ = 'B';
+	*p++ = 'L';
+	*p++ = type;
+	*p++ = ls->id;
+	return put32(p, ls->joined ? timer : -1);
+}
+
+static void net_send(struct lockstep *ls, int to, unsigned char *buf, int len)
+{
+	if (to == ls->id)
+		return;
+	ls->send(ls, to, buf, len);
+	ls->bytes_sent += len;
+	ls->packets_sent++;
+}
+
+/* authority: snapshot the game as it is now, to hand out */
+static void net_make_snapshot(struct lockstep *ls)
+{
+	save_sim(&ls->raw);
+	delta_encode(ls->baseline, &ls->raw, &ls->served);
+	if (ls->served.len > NET_MAX_SNAPSHOT || ls->raw.len > NET_MAX_RAW_SNAPSHOT) {
+		fprintf(stderr, "battallica: the game is too big to send, %d bytes\n", ls->raw.len);
+		exit(1);
+	}
+	ls->served_tick = timer;
+	ls->served_rawlen = ls->raw.len;
+	ls->snaps_made++;
+	ls->snap_raw_total += ls->raw.len;
+	ls->snap_total += ls->served.len;
+}
+
+static void net_send_chunks(struct lockstep *ls, int to, int first, int count)
+{
+	unsigned char buf[NET_MAX_PACKET], *p;
+	int c, n, nchunks = (ls->served.len + NET_CHUNK - 1) / NET_CHUNK;
+
+	for (c = first; c < first + count && c < nchunks; c++) {
+		n = ls->served.len - c * NET_CHUNK;
+		if (n > NET_CHUNK)
+			n = NET_CHUNK;
+		p = net_header(ls, buf, NET_SNAP_CHUNK);
+		p = put32(p, ls->served_tick);
+		p = put32(p, ls->served_rawlen);
+		p = put32(p, ls->served.len);
+		p = put16(p, c);
+		p = put16(p, nchunks);
+		memcpy(p, &ls->served.data[c * NET_CHUNK], n);
+		p += n;
+		net_send(ls, to, buf, p - buf);
+		ls->snap_bytes_sent += p - buf;
+	}
+}
+
+/* somebody's hash or the authority's for tick just came in, do they agree? */
+static void net_check_hash(struct lockstep *ls, int tick)
+{
+	int slot = (tick / NET_HASH_PERIOD) % NET_HASH_RING;
+
+	if (ls->id == 0 || ls->want_snap || ls->hash_tick[slot] != tick ||
+		ls->auth_tick[slot] != tick || ls->hash[slot] == ls->auth_hash[slot])
+		return;
+	fprintf(stderr, "battallica: player %d out of step at tick %d, asking for a snapshot\n",
+		ls->id, tick);
+	ls->desyncs++;
+	ls->want_snap = 1;
+	ls->rx_tick = -1;
+	ls->rx_asked_frame = ls->frame - NET_RETRY_FRAMES;
+}
+
+/* run tick timer + 1 */
+static void net_step(struct lockstep *ls, struct tick_command cmd[MAXPLAYERS])
+{
+	long long start = usecs_now();
+	int slot, p;
+
+	simulate_tick(cmd);
+	ls->sim_usecs += usecs_now() - start;
+	ls->steps++;
+
+	slot = timer % NET_CMD_RING;
+	if (ls->cmd_tick[ls->id][slot] == timer && timer > player_input_from[ls->id]) {
+		ls->latency_frames += ls->frame - ls->cmd_frame[slot];
+		ls->latency_count++;
+	}
+
+	/* authority: somebody just got in, send them the game */
+	p = cmd[0].join - 1;
+	if (ls->id == 0 && p >= 0 && p < ls->npeers) {
+		ls->join_sched &= ~(1U << p);
+		net_make_snapshot(ls);
+		net_send_chunks(ls, p, 0, NET_SNAP_WINDOW);
+	}
+
+	if (timer % NET_HASH_PERIOD == 0) {
+		slot = (timer / NET_HASH_PERIOD) % NET_HASH_RING;
+		ls->hash_tick[slot] = timer;
+		ls->hash[slot] = sim_hash();
+		ls->latest_hash_tick = timer;
+		ls->latest_hash = ls->hash[slot];
+		net_check_hash(ls, timer);
+	}
+}
+
+/* everybody's commands for tick t, if they're all in */
+static int net_commands_for(struct lockstep *ls, int t, struct tick_command cmd[MAXPLAYERS])
+{
+	int p, slot = t % NET_CMD_RING;
+
+	memset(cmd, 0, sizeof(*cmd) * MAXPLAYERS);
+	for (p = 0; p < ls->npeers; p++) {
+		if (!(active_players & (1U << p)) || t <= player_input_from[p])
+			continue;
+		if (ls->cmd_tick[p][slot] != t)
+			return 0;
+		cmd[p] = ls->cmd[p][slot];
+		if (p != 0)
+			cmd[p].join = 0;	/* only the authority lets people in */
+	}
+	return 1;
+}
+
+/* our commands up to input delay ticks ahead, all with the same keys */
+static void net_make_commands(struct lockstep *ls, unsigned int keys)
+{
+	struct tick_command *c;
+	int t, p;
+
+	if (ls->last_local < timer)
+		ls->last_local = timer;
+	while (ls->last_local < timer + 1 + ls->delay) {
+		t = ++ls->last_local;
+		c = &ls->cmd[ls->id][t % NET_CMD_RING];
+		c->keys = keys & SIM_KEYS;
+		c->join = 0;
+		for (p = 0; p < MAXPLAYERS && ls->join_wanted; p++)
+			if (ls->join_wanted & (1U << p)) {
+				c->join = p + 1;
+				ls->join_wanted &= ~(1U << p);
+				ls->join_sched |= 1U << p;
+				break;
 			}
-			return TRUE;
+		ls->cmd_tick[ls->id][t % NET_CMD_RING] = t;
+		ls->cmd_frame[t % NET_CMD_RING] = ls->frame;
+	}
+}
+
+/* send each peer the commands of ours it hasn't had, and our latest hash */
+static void net_send_inputs(struct lockstep *ls)
+{
+	unsigned char buf[NET_MAX_PACKET], *p;
+	struct tick_command *c;
+	int to, t, first, n;
+
+	for (to = 0; to < ls->npeers; to++) {
+		if (to == ls->id)
+			continue;
+		first = ls->acked[to] >= 0 ? ls->acked[to] + 1 : ls->last_local - NET_MAX_CMDS + 1;
+		if (first <= ls->last_local - NET_CMD_RING)
+			first = ls->last_local - NET_CMD_RING + 1;
+		if (first < 1)
+			first = 1;
+		n = ls->last_local - first + 1;
+		if (n < 0)
+			n = 0;
+		if (n > NET_MAX_CMDS)
+			n = NET_MAX_CMDS;
+		p = net_header(ls, buf, NET_INPUT);
+		p = put32(p, ls->latest_hash_tick);
+		p = put32(p, ls->latest_hash);
+		p = put32(p, first);
+		*p++ = n;
+		for (t = first; t < first + n; t++) {
+			c = &ls->cmd[ls->id][t % NET_CMD_RING];
+			p = put32(p, c->keys);
+			*p++ = c->join;
 		}
-	case keyquit:	in_the_process_of_quitting = !in_the_process_of_quitting;
-			break;
-	case keyleft:	if (the_player->vx > -MAX_PLAYER_VX)
-				the_player->vx--;
+		net_send(ls, to, buf, p - buf);
+	}
+}
+
+static void net_got_input(struct lockstep *ls, int from, unsigned char *p, int len)
+{
+	int i, t, n, first, hash_tick, slot;
+	unsigned int hash;
+
+	if (len < 13)
+		return;
+	hash_tick = (int) get32(p);
+	hash = get32(p + 4);
+	first = (int) get32(p + 8);
+	n = p[12];
+	p += 13;
+	if (len < 13 + n * 5)
+		return;
+	for (i = 0; i < n; i++, p += 5) {
+		t = first + i;
+		if (t < 1)
+			continue;
+		slot = t % NET_CMD_RING;
+		if (ls->cmd_tick[from][slot] > t)
+			continue;	/* an old one, we've moved on */
+		ls->cmd_tick[from][slot] = t;
+		ls->cmd[from][slot].keys = get32(p);
+		ls->cmd[from][slot].join = p[4];
+	}
+	if (from == 0 && hash_tick >= 0) {
+		slot = (hash_tick / NET_HASH_PERIOD) % NET_HASH_RING;
+		ls->auth_tick[slot] = hash_tick;
+		ls->auth_hash[slot] = hash;
+		net_check_hash(ls, hash_tick);
+	}
+}
+
+/* authority: from wants in, or it's in but hasn't got the game yet */
+static void net_got_join(struct lockstep *ls, int from)
+{
+	if (ls->id != 0 || (ls->join_sched & (1U << from)))
+		return;
+	if (!(active_players & (1U << from))) {
+		ls->join_wanted |= 1U << from;
+		return;
+	}
+	if (ls->served_tick < player_input_from[from] - JOIN_INPUT_LEAD)
+		net_make_snapshot(ls);
+	net_send_chunks(ls, from, 0, NET_SNAP_WINDOW);
+}
+
+/* authority: from wants some (more) of a snapshot */
+static void net_got_snap_request(struct lockstep *ls, int from, unsigned char *p, int len)
+{
+	int tick, first, count;
+
+	if (ls->id != 0 || len < 8)
+		return;
+	tick = (int) get32(p);
+	first = get16(p + 4);
+	count = get16(p + 6);
+	if (count > NET_SNAP_WINDOW)
+		count = NET_SNAP_WINDOW;
+	if (tick >= 0 && tick == ls->served_tick) {
+		net_send_chunks(ls, from, first, count);
+		return;
+	}
+	/* a new one, unless the one we have is recent enough to catch up from */
+	if (ls->served_tick < 0 || timer - ls->served_tick > NET_CMD_RING / 2)
+		net_make_snapshot(ls);
+	net_send_chunks(ls, from, 0, NET_SNAP_WINDOW);
+}
+
+/* the snapshot is all in, replace our game with it */
+static void net_load_snapshot(struct lockstep *ls)
+{
+	struct tick_command cmd[MAXPLAYERS];
+	int i, old_timer = timer;
+
+	if (delta_decode(ls->baseline, &ls->rx, ls->rx_rawlen, &ls->raw) < 0) {
+		ls->rx_tick = -1;	/* try again */
+		return;
+	}
+	if (!load_sim(&ls->raw)) {
+		fprintf(stderr, "battallica: player %d got a bad snapshot for tick %d\n",
+			ls->id, ls->rx_tick);
+		exit(1);
+	}
+	ls->want_snap = 0;
+	ls->rx_tick = -1;
+	for (i = 0; i < NET_HASH_RING; i++)
+		ls->hash_tick[i] = -1;
+	if (ls->joined) {
+		/* back to where we were, with the commands we've already had */
+		ls->resyncs++;
+		while (timer < old_timer && net_commands_for(ls, timer + 1, cmd))
+			net_step(ls, cmd);
+	} else {
+		ls->joined = 1;
+		ls->join_frame = ls->frame;
+	}
+	if (ls->last_local < timer)
+		ls->last_local = timer;
+}
+
+static void net_got_chunk(struct lockstep *ls, int from, unsigned char *p, int len)
+{
+	int tick, rawlen, total, c, nchunks;
+
+	if (!ls->want_snap || from != 0 || len < 16)
+		return;
+	tick = (int) get32(p);
+	rawlen = (int) get32(p + 4);
+	total = (int) get32(p + 8);
+	c = get16(p + 12);
+	nchunks = get16(p + 14);
+	p += 16;
+	len -= 16;
+	if (tick < 0 || tick < ls->rx_tick || total <= 0 || total > NET_MAX_SNAPSHOT ||
+		rawlen <= 0 || rawlen > NET_MAX_RAW_SNAPSHOT ||
+		nchunks != (total + NET_CHUNK - 1) / NET_CHUNK || c >= nchunks)
+		return;
+	/* every chunk of one snapshot says the same about it */
+	if (tick == ls->rx_tick && (rawlen != ls->rx_rawlen || total != ls->rx.len ||
+		nchunks != ls->rx_nchunks))
+		return;
+	if (tick != ls->rx_tick) {	/* a newer one, start again */
+		ls->rx_tick = tick;
+		ls->rx_rawlen = rawlen;
+		ls->rx_nchunks = nchunks;
+		ls->rx_count = 0;
+		ls->rx.len = 0;
+		sb_need(&ls->rx, total);
+		ls->rx.len = total;
+		ls->rx_have = (unsigned char *) game_realloc(ALLOC_NET, ls->rx_have, nchunks);
+		memset(ls->rx_have, 0, nchunks);
+		ls->rx_asked = NET_SNAP_WINDOW;	/* the authority sends the first lot unasked */
+	}
+	if (ls->rx_have[c] || len != (c == nchunks - 1 ? total - c * NET_CHUNK : NET_CHUNK))
+		return;
+	memcpy(&ls->rx.data[c * NET_CHUNK], p, len);
+	ls->rx_have[c] = 1;
+	ls->rx_count++;
+	ls->rx_asked_frame = ls->frame;
+	if (ls->rx_count == ls->rx_nchunks)
+		net_load_snapshot(ls);
+}
+
+/* ask the authority for (more of) a snapshot, if it's time to */
+static void net_ask_for_snapshot(struct lockstep *ls)
+{
+	unsigned char buf[NET_MAX_PACKET], *p;
+	int c;
+
+	if (ls->rx_tick < 0) {
+		if (ls->frame - ls->rx_asked_frame < NET_RETRY_FRAMES)
+			return;
+		p = net_header(ls, buf, ls->joined ? NET_SNAP_REQUEST : NET_JOIN);
+		if (ls->joined) {
+			p = put32(p, -1);
+			p = put16(p, 0);
+			p = put16(p, NET_SNAP_WINDOW);
+		}
+		net_send(ls, 0, buf, p - buf);
+		ls->rx_asked_frame = ls->frame;
+		return;
+	}
+	for (c = 0; c < ls->rx_nchunks && ls->rx_have[c]; c++)
+		;
+	if (c < ls->rx_asked && ls->frame - ls->rx_asked_frame < NET_RETRY_FRAMES)
+		return;	/* still coming */
+	p = net_header(ls, buf, NET_SNAP_REQUEST);
+	p = put32(p, ls->rx_tick);
+	p = put16(p, c);
+	p = put16(p, NET_SNAP_WINDOW);
+	net_send(ls, 0, buf, p - buf);
+	ls->rx_asked = c + NET_SNAP_WINDOW;
+	ls->rx_asked_frame = ls->frame;
+}
+
+static void net_receive(struct lockstep *ls)
+{
+	unsigned char buf[NET_MAX_PACKET];
+	int len, from, ack;
+
+	while ((len = ls->recv(ls, buf, sizeof(buf))) > 0) {
+		if (len < NET_HEADER || buf[0] != 'B' || buf[1] != 'L')
+			continue;
+		from = buf[3];
+		if (from >= ls->npeers || from == ls->id)
+			continue;
+		ls->bytes_recv += len;
+		ls->packets_recv++;
+		ack = (int) get32(&buf[4]);
+		if (ack > ls->acked[from])
+			ls->acked[from] = ack;
+		switch (buf[2]) {
+		case NET_INPUT:
+			net_got_input(ls, from, buf + NET_HEADER, len - NET_HEADER);
 			break;
-	case keyright:	if (the_player->vx < MAX_PLAYER_VX)
-				the_player->vx++;
+		case NET_JOIN:
+			net_got_join(ls, from);
 			break;
-	case keyup:	if (the_player->vy > -MAX_PLAYER_VY)
-				the_player->vy--;
+		case NET_SNAP_REQUEST:
+			net_got_snap_request(ls, from, buf + NET_HEADER, len - NET_HEADER);
 			break;
-	case keydown:	if (the_player->vy < MAX_PLAYER_VY)
-				the_player->vy++;
+		case NET_SNAP_CHUNK:
+			net_got_chunk(ls, from, buf + NET_HEADER, len - NET_HEADER);
 			break;
-	default:
-		break;
+		}
 	}
-	return FALSE;
 }
 
-static gint key_release_cb(GtkWidget* widget, GdkEventKey* event, gpointer data)
+/* once a frame: deal with the network, and run as many ticks as we can */
+void lockstep_frame(struct lockstep *ls, unsigned int keys)
+{
+	struct tick_command cmd[MAXPLAYERS];
+	long long start = usecs_now();
+	int p, n = 0, ahead = 0;
+
+	ls->frame++;
+	net_receive(ls);
+	if (ls->want_snap && ls->id != 0)
+		net_ask_for_snapshot(ls);
+	if (ls->joined) {
+		/* a tick a frame, more if somebody else has got further */
+		for (p = 0; p < ls->npeers; p++)
+			if (p != ls->id && ls->acked[p] > ahead)
+				ahead = ls->acked[p];
+		net_make_commands(ls, keys);
+		while ((n == 0 || (n < NET_MAX_CATCHUP && timer < ahead)) &&
+			net_commands_for(ls, timer + 1, cmd)) {
+			net_step(ls, cmd);
+			net_make_commands(ls, keys);
+			n++;
+		}
+		if (n == 0)
+			ls->stalls++;
+		net_send_inputs(ls);
+	}
+	ls->usecs += usecs_now() - start;
+}
+
+void print_net_stats(struct lockstep *ls)
+{
+	double secs;
+
+	if (ls == NULL || ls->frame == 0)
+		return;
+	secs = (double) ls->frame / frame_rate_hz;
+	printf("net: player %d of %d, at tick %d, %d ticks run, stalled %d of %d frames\n",
+		ls->id, ls->npeers, timer, ls->steps, ls->stalls, ls->frame);
+	printf("  sent %lld bytes in %d packets (%.0f bytes/sec, %lld of them snapshots), "
+		"received %lld bytes in %d packets\n",
+		ls->bytes_sent, ls->packets_sent, ls->bytes_sent / secs, ls->snap_bytes_sent,
+		ls->bytes_recv, ls->packets_recv);
+	if (ls->latency_count)
+		printf("  input takes effect after %.1f frames on average (input delay %d ticks)\n",
+			(double) ls->latency_frames / ls->latency_count, ls->delay);
+	if (ls->snaps_made)
+		printf("  %d snapshots made, %lld bytes each, %lld before compression\n",
+			ls->snaps_made, ls->snap_total / ls->snaps_made,
+			ls->snap_raw_total / ls->snaps_made);
+	if (ls->wrong_source)
+		printf("  %d packets dropped, not from where that player's others came from\n",
+			ls->wrong_source);
+	printf("  %d times out of step, %d resyncs", ls->desyncs, ls->resyncs);
+	if (ls->join_frame)
+		printf(", joined on frame %d", ls->join_frame);
+	printf("\n  networking %.1f usecs/frame on top of %.1f usecs/frame running the game\n",
+		(double) (ls->usecs - ls->sim_usecs) / ls->frame, (double) ls->sim_usecs / ls->frame);
+}
+
+/* UDP, one socket talking to everybody.  Where each player's packets */
+/* come from is taken from its first one, its join or its first input, */
+/* and after that a packet claiming to be from it which comes from */
+/* anywhere else is dropped. */
+struct udp_net {
+	int fd;
+	struct sockaddr_in addr[MAXPLAYERS];
+	struct sockaddr_in from[MAXPLAYERS];	/* where they've been sending from */
+	int heard[MAXPLAYERS];			/* from[] is set */
+	int n;
+} udp;
+
+#ifndef BATTALLICA_BENCH
+static int udp_send(struct lockstep *ls, int to, const unsigned char *buf, int len)
+{
+	return sendto(udp.fd, buf, len, 0, (struct sockaddr *) &udp.addr[to], sizeof(udp.addr[to]));
+}
+
+static int udp_recv(struct lockstep *ls, unsigned char *buf, int size)
+{
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	int len, id;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		len = recvfrom(udp.fd, buf, size, MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+		if (len < NET_HEADER || buf[3] >= udp.n)
+			return len;	/* net_receive() throws those away */
+		id = buf[3];
+		if (!udp.heard[id]) {
+			udp.from[id] = from;
+			udp.heard[id] = 1;
+			return len;
+		}
+		if (from.sin_addr.s_addr == udp.from[id].sin_addr.s_addr &&
+			from.sin_port == udp.from[id].sin_port)
+			return len;
+		ls->wrong_source++;
+	}
+}
+#endif
+
+/* peers is host:port,host:port,... for players 0, 1, ... in order, we */
+/* listen on id's port.  Returns the number of peers. */
+int init_udp(const char *peers, int id)
+{
+	char *s = strdup(peers), *entry, *colon, *save = NULL;
+	struct hostent *h;
+	struct sockaddr_in me;
+
+	udp.n = 0;
+	for (entry = strtok_r(s, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+		if (udp.n >= MAXPLAYERS) {
+			fprintf(stderr, "battallica: at most %d players\n", MAXPLAYERS);
+			exit(1);
+		}
+		colon = strrchr(entry, ':');
+		if (colon == NULL) {
+			fprintf(stderr, "battallica: bad peer '%s', want host:port\n", entry);
+			exit(1);
+		}
+		*colon = '\0';
+		h = gethostbyname(entry);
+		if (h == NULL || h->h_addrtype != AF_INET) {
+			fprintf(stderr, "battallica: unknown host '%s'\n", entry);
+			exit(1);
+		}
+		memset(&udp.addr[udp.n], 0, sizeof(udp.addr[udp.n]));
+		udp.addr[udp.n].sin_family = AF_INET;
+		udp.addr[udp.n].sin_port = htons(atoi(colon + 1));
+		memcpy(&udp.addr[udp.n].sin_addr, h->h_addr_list[0], sizeof(struct in_addr));
+		udp.n++;
+	}
+	free(s);
+	if (id < 0 || id >= udp.n) {
+		fprintf(stderr, "battallica: --net-id %d, but there are %d peers\n", id, udp.n);
+		exit(1);
+	}
+	udp.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp.fd < 0) {
+		fprintf(stderr, "battallica: socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	memset(&me, 0, sizeof(me));
+	me.sin_family = AF_INET;
+	me.sin_addr.s_addr = htonl(INADDR_ANY);
+	me.sin_port = udp.addr[id].sin_port;
+	if (bind(udp.fd, (struct sockaddr *) &me, sizeof(me)) < 0) {
+		fprintf(stderr, "battallica: can't listen on port %d: %s\n",
+			ntohs(me.sin_port), strerror(errno));
+		exit(1);
+	}
+	fcntl(udp.fd, F_SETFL, O_NONBLOCK);
+	return udp.n;
+}
+
+/* Loopback: several copies of the game in this one process, the network */
+/* between them a queue with a delay and some packet loss.  See */
+/* run_loopback(). */
+struct loopback_packet {
+	int to, due, len;	/* len -1 once delivered */
+	unsigned char data[NET_MAX_PACKET];
+};
+
+struct loopback_net {
+	struct loopback_packet *pkt;
+	int npkts, size;
+	int frame;
+	int latency;		/* frames */
+	int loss;		/* percent */
+	unsigned int rng;	/* not sim_rng, that's the game's */
+	int lost;
+} loopback = { .rng = 0x1234567 };
+
+static unsigned int loopback_random()
+{
+	loopback.rng ^= loopback.rng << 13;
+	loopback.rng ^= loopback.rng >> 17;
+	loopback.rng ^= loopback.rng << 5;
+	return loopback.rng;
+}
+
+static int loopback_send(struct lockstep *ls, int to, const unsigned char *buf, int len)
+{
+	struct loopback_packet *pk;
+
+	if ((int) (loopback_random() % 100) < loopback.loss) {
+		loopback.lost++;
+		return len;
+	}
+	if (loopback.npkts >= loopback.size) {
+		loopback.size = loopback.size ? loopback.size * 2 : 256;
+		loopback.pkt = (struct loopback_packet *)
+			game_realloc(ALLOC_NET, loopback.pkt, sizeof(*loopback.pkt) * loopback.size);
+	}
+	pk = &loopback.pkt[loopback.npkts++];
+	pk->to = to;
+	pk->due = loopback.frame + loopback.latency;
+	pk->len = len;
+	memcpy(pk->data, buf, len);
+	return len;
+}
+
+static int loopback_recv(struct lockstep *ls, unsigned char *buf, int size)
+{
+	struct loopback_packet *pk;
+	int i, len;
+
+	for (i = 0; i < loopback.npkts; i++) {
+		pk = &loopback.pkt[i];
+		if (pk->len < 0 || pk->to != ls->id || pk->due > loopback.frame)
+			continue;
+		len = pk->len < size ? pk->len : size;
+		memcpy(buf, pk->data, len);
+		pk->len = -1;
+		return len;
+	}
+	return -1;
+}
+
+/* Run npeers copies of the game for some frames, with all but the last */
+/* playing from the start and the last joining a third of the way in. */
+/* Halfway through, player 1's game is knocked out of step on purpose */
+/* to check that it notices and gets put right.  Each player's game is */
+/* kept as a snapshot and loaded for its turn each frame.  Returns 0 if */
+/* everything went as it should and everybody ends up agreeing. */
+int run_loopback(int npeers, int frames, int latency_ms, int loss)
+{
+	struct lockstep *peer[MAXPLAYERS];
+	struct sim_buf baseline, state[MAXPLAYERS];
+	unsigned int keys[MAXPLAYERS];
+	struct game_obj_t *o;
+	int f, i, j, slot, tick, joiner = npeers - 1, corrupt = npeers > 1 ? 1 : -1;
+	int corrupted = 0, failed = 0;
+
+	loopback.latency = (latency_ms * frame_rate_hz + 999) / 1000;
+	loopback.loss = loss;
+	memset(&baseline, 0, sizeof(baseline));
+	save_sim(&baseline);
+	for (i = 0; i < npeers; i++) {
+		memset(&state[i], 0, sizeof(state[i]));
+		sb_put(&state[i], baseline.data, baseline.len);
+		peer[i] = new_lockstep(i, npeers, input_delay, &baseline,
+			loopback_send, loopback_recv);
+		keys[i] = 0;
+	}
+
+	for (f = 1; f <= frames; f++) {
+		loopback.frame = f;
+		for (i = 0; i < npeers; i++) {
+			if (i == joiner && npeers > 1 && f < frames / 3)
+				continue;
+			local_player = i;
+			if (!load_sim(&state[i])) {
+				fprintf(stderr, "battallica: loopback: can't load player %d's game\n", i);
+				return 1;
+			}
+			if (f % 15 == 0)
+				keys[i] = loopback_random() & SIM_KEYS;
+			lockstep_frame(peer[i], keys[i]);
+			if (i == corrupt && !corrupted && f >= frames / 2 && peer[i]->joined) {
+				for (j = highest_object_number; j >= 0; j--) {
+					o = gobj(j);
+					if (o->alive && o->otype == OBJ_TYPE_ENEMY) {
+						o->x += 9;
+						break;
+					}
+				}
+				corrupted = 1;
+			}
+			save_sim(&state[i]);
+		}
+		for (i = j = 0; i < loopback.npkts; i++)
+			if (loopback.pkt[i].len >= 0)
+				loopback.pkt[j++] = loopback.pkt[i];
+		loopback.npkts = j;
+	}
+
+	printf("loopback: %d players, %d frames, %d ms latency, %d%% loss (%d packets lost)\n",
+		npeers, frames, latency_ms, loss, loopback.lost);
+	tick = -1;
+	for (i = 0; i < npeers; i++) {
+		local_player = i;
+		load_sim(&state[i]);
+		print_net_stats(peer[i]);
+		if (tick < 0 || peer[i]->latest_hash_tick < tick)
+			tick = peer[i]->latest_hash_tick;
+	}
+
+	/* everybody's hash for the latest tick they've all hashed */
+	slot = (tick / NET_HASH_PERIOD) % NET_HASH_RING;
+	for (i = 0; i < npeers; i++) {
+		if (tick < 0 || peer[i]->hash_tick[slot] != tick) {
+			printf("loopback: player %d has no hash for tick %d\n", i, tick);
+			failed = 1;
+		} else if (peer[i]->hash[slot] != peer[0]->hash[slot]) {
+			printf("loopback: player %d disagrees at tick %d\n", i, tick);
+			failed = 1;
+		}
+	}
+	if (npeers > 1 && !peer[joiner]->joined) {
+		printf("loopback: player %d never got in\n", joiner);
+		failed = 1;
+	}
+	if (corrupted && peer[corrupt]->resyncs == 0) {
+		printf("loopback: player %d was knocked out of step and never put right\n", corrupt);
+		failed = 1;
+	}
+	printf("loopback: %s at tick %d\n", failed ? "FAILED" : "everybody agrees", tick);
+	return failed;
+}
+
+/* lockstep networking code ends */
+/***********************************/
+
+/*******************************/
+/* quality governor code begins */
+
+/* Each tick the time spent in advance_game() and drawing is measured */
+/* against the frame budget, 1000000 / frame_rate_hz usecs.  When it */
+/* stays over GOVERNOR_HIGH percent of that for a few ticks, the */
+/* quality goes down a level; when it stays under GOVERNOR_LOW percent */
+/* for a good while, back up one.  The gap between the two and the */
+/* different waits keep it from flapping, and if it has to go back down */
+/* soon after going up, it waits twice as long before trying again. */
+/* Only drawing changes with quality, never the game, so it's safe */
+/* in a networked game.  --quality n fixes the level instead. */
+
+#define GOVERNOR_HIGH 90	/* percent of the frame budget */
+#define GOVERNOR_LOW 60
+#define GOVERNOR_DOWN_TICKS 8	/* ticks in a row over GOVERNOR_HIGH to go down */
+#define GOVERNOR_UP_TICKS 90	/* ticks in a row under GOVERNOR_LOW to go up, at first */
+#define GOVERNOR_MAX_UP_TICKS (30 * 30)
+#define GOVERNOR_SETTLE 15	/* ticks to ignore after a change, while it shows */
+
+struct governor {
+	int fixed;		/* --quality given, don't move it */
+	long long work_usecs;	/* so far this tick */
+	double avg;		/* smoothed work per tick, usecs */
+	int over, under;	/* ticks in a row over GOVERNOR_HIGH, under GOVERNOR_LOW */
+	int settle;
+	int up_ticks;		/* what it takes to go up, now */
+	int last_up;		/* timer when it last went up */
+	int downs, ups;
+	int ticks[QUALITY_LOWEST + 1];	/* at each level */
+} governor = { 0, 0, 0.0, 0, 0, 0, GOVERNOR_UP_TICKS, 0, 0, 0, { 0 } };
+
+/* pick the line drawing functions for the window size and quality */
+void choose_line_functions()
+{
+	if (real_screen_width == 800 && real_screen_height == 600) {
+		current_draw_line = gdk_draw_line;
+		current_draw_rectangle = gdk_draw_rectangle;
+		current_bright_line = unscaled_bright_line;
+	} else {
+		current_draw_line = scaled_line;
+		current_draw_rectangle = scaled_rectangle;
+		current_bright_line = scaled_bright_line;
+		if (thicklines && quality < QUALITY_THIN_LINES)
+			current_draw_line = thick_scaled_line;
+	}
+	if (quality >= QUALITY_THIN_LINES)
+		current_bright_line = thin_bright_line;
+}
+
+void set_quality(int level)
+{
+	quality = level;
+	if (gc)
+		choose_line_functions();
+	full_redraw = 1;
+	governor.over = governor.under = 0;
+	governor.settle = GOVERNOR_SETTLE;
+}
+
+/* once a tick, looking at how long the last one took */
+void govern_quality()
+{
+	long long budget = 1000000 / frame_rate_hz;
+
+	governor.avg += (governor.work_usecs - governor.avg) / 8;
+	governor.work_usecs = 0;
+	governor.ticks[quality]++;
+	if (governor.fixed)
+		return;
+	if (governor.settle > 0) {
+		governor.settle--;
+		return;
+	}
+	if (governor.avg * 100 > budget * GOVERNOR_HIGH) {
+		governor.over++;
+		governor.under = 0;
+	} else if (governor.avg * 100 < budget * GOVERNOR_LOW) {
+		governor.under++;
+		governor.over = 0;
+	} else
+		governor.over = governor.under = 0;
+
+	if (governor.over >= GOVERNOR_DOWN_TICKS && quality < QUALITY_LOWEST) {
+		/* went up too soon?  Then wait longer next time */
+		if (governor.ups && timer - governor.last_up < 2 * governor.up_ticks)
+			governor.up_ticks = MIN(governor.up_ticks * 2, GOVERNOR_MAX_UP_TICKS);
+		else
+			governor.up_ticks = GOVERNOR_UP_TICKS;
+		governor.downs++;
+		set_quality(quality + 1);
+	} else if (governor.under >= governor.up_ticks && quality > QUALITY_FULL) {
+		governor.ups++;
+		governor.last_up = timer;
+		set_quality(quality - 1);
+	}
+}
+
+void print_quality_stats()
+{
+	int i;
+
+	if (governor.downs == 0 && quality == QUALITY_FULL)
+		return;
+	printf("quality: level %d now, %d steps down, %d up, %.1f of %d usecs a tick\n",
+		quality, governor.downs, governor.ups, governor.avg, 1000000 / frame_rate_hz);
+	printf("  ticks at each level:");
+	for (i = 0; i <= QUALITY_LOWEST; i++)
+		printf(" %d", governor.ticks[i]);
+	printf("\n");
+}
+
+/* quality governor code ends   */
+/*******************************/
+
+#ifndef BATTALLICA_BENCH
+/* call back for configure_event (for window resize) */
+static gint main_da_configure(GtkWidget *w, GdkEventConfigure *event)
+{
+	GdkRectangle cliprect;
+
+	/* first time through, gc is null, because gc can't be set without */
+	/* a window, but, the window isn't there yet until it's shown, but */
+	/* the show generates a configure... chicken and egg.  And we can't */
+	/* proceed without gc != NULL...  but, it's ok, because 1st time thru */
+	/* we already sort of know the drawing area/window size. */
+ 
+	if (gc == NULL)
+		return TRUE;
+
+	// gtk_widget_set_size_request(w, w->allocation.width, w->allocation.height);
+	// gtk_window_get_size(GTK_WINDOW (w), &real_screen_width, &real_screen_height);
+	real_screen_width =  w->allocation.width;
+	real_screen_height =  w->allocation.height;
+	xscale_screen = (float) real_screen_width / (float) SCREEN_WIDTH;
+	yscale_screen = (float) real_screen_height / (float) SCREEN_HEIGHT;
+	choose_line_functions();
+	gdk_gc_set_clip_origin(gc, 0, 0);
+	cliprect.x = 0;	
+	cliprect.y = 0;	
+	cliprect.width = real_screen_width;	
+	cliprect.height = real_screen_height;	
+	gdk_gc_set_clip_rectangle(gc, &cliprect);
+	full_redraw = 1;
+	return TRUE;
+}
+#endif
+
+/*****************************/
+/* frame capture code begins */
+
+/* --capture file records the game as it's drawn, for bug reports about */
+/* frame timing, which screen recorders get wrong.  Once a tick the */
+/* finished contents of main_da are grabbed into one of a fixed ring of */
+/* buffers, and a thread of its own turns them into Y4M (4:2:0, what */
+/* ffmpeg and most players take) or, for a file ending in .rgb, raw */
+/* 24 bit RGB, and writes them out.  If the writer falls behind and the */
+/* ring is full the frame is dropped and counted, the game thread never */
+/* waits for it.  Frames are the size the window was when the first one */
+/* was grabbed. */
+
+#define CAPTURE_RING 8		/* frames grabbed but not yet written */
+
+struct capture_frame {
+	unsigned char *pixels;	/* copy of the GdkImage's memory */
+	int frame;		/* nframes when grabbed */
+};
+
+struct capture {
+	char *filename;		/* NULL when not capturing */
+	FILE *f;
+	int raw;		/* raw RGB instead of Y4M */
+	int w, h;
+	GdkImage *image;	/* reused by gdk_drawable_copy_to_image() */
+	int bpl;
+	unsigned int shift[3];	/* red, green, blue, from the visual */
+	struct capture_frame ring[CAPTURE_RING];
+	volatile gint head;	/* frames put in the ring, only the game thread moves it */
+	volatile gint tail;	/* frames written, only the writer moves it */
+	GMutex lock;
+	GCond go;
+	int stop;
+	GThread *thread;
+	unsigned char *out;	/* the writer's converted frame */
+	int grabbed, dropped, written, failed;
+	long long grab_usecs, worst_grab_usecs, write_usecs;
+} capture;
+
+/* a pixel of a 24 bit TrueColor image to r, g, b */
+static inline void capture_rgb(unsigned int p, int *rgb)
+{
+	rgb[0] = (p >> capture.shift[0]) & 0xff;
+	rgb[1] = (p >> capture.shift[1]) & 0xff;
+	rgb[2] = (p >> capture.shift[2]) & 0xff;
+}
+
+static void capture_convert_rgb(unsigned char *pixels)
+{
+	unsigned char *o = capture.out;
+	int x, y, rgb[3];
+
+	for (y = 0; y < capture.h; y++) {
+		unsigned int *row = (unsigned int *) (pixels + y * capture.bpl);
+		for (x = 0; x < capture.w; x++) {
+			capture_rgb(row[x], rgb);
+			*o++ = rgb[0];
+			*o++ = rgb[1];
+			*o++ = rgb[2];
+		}
+	}
+}
+
+/* BT.601 full range, chroma from the average of each 2 x 2 block */
+static void capture_convert_yuv(unsigned char *pixels)
+{
+	unsigned char *yp = capture.out, *u, *v;
+	int x, y, i, j, r, g, b, rgb[3];
+	unsigned int *row;
+
+	u = yp + capture.w * capture.h;
+	v = u + (capture.w / 2) * (capture.h / 2);
+	for (y = 0; y < capture.h; y += 2) {
+		for (x = 0; x < capture.w; x += 2) {
+			r = g = b = 0;
+			for (j = 0; j < 2; j++) {
+				row = (unsigned int *) (pixels + (y + j) * capture.bpl);
+				for (i = 0; i < 2; i++) {
+					capture_rgb(row[x + i], rgb);
+					yp[(y + j) * capture.w + x + i] =
+						(77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8;
+					r += rgb[0];
+					g += rgb[1];
+					b += rgb[2];
+				}
+			}
+			r >>= 2;
+			g >>= 2;
+			b >>= 2;
+			*u++ = 128 + ((-43 * r - 85 * g + 128 * b) >> 8);
+			*v++ = 128 + ((128 * r - 107 * g - 21 * b) >> 8);
+		}
+	}
+}
+
+static gpointer capture_thread(gpointer data)
+{
+	struct capture_frame *c;
+	long long start, tstart;
+	int tail, size;
+
+	trace_register_thread("capture");
+	size = capture.raw ? capture.w * capture.h * 3 : capture.w * capture.h * 3 / 2;
+	for (;;) {
+		tail = capture.tail;
+		g_mutex_lock(&capture.lock);
+		while (g_atomic_int_get(&capture.head) == tail && !capture.stop)
+			g_cond_wait(&capture.go, &capture.lock);
+		g_mutex_unlock(&capture.lock);
+		if (g_atomic_int_get(&capture.head) == tail)
+			break;	/* stopping, and everything's written */
+
+		start = usecs_now();
+		tstart = trace_begin();
+		c = &capture.ring[tail % CAPTURE_RING];
+		if (capture.raw)
+			capture_convert_rgb(c->pixels);
+		else {
+			capture_convert_yuv(c->pixels);
+			fprintf(capture.f, "FRAME\n");
+		}
+		if (fwrite(capture.out, size, 1, capture.f) != 1)
+			capture.failed++;
+		else
+			capture.written++;
+		g_atomic_int_set(&capture.tail, tail + 1);	/* the slot is free again */
+		capture.write_usecs += usecs_now() - start;
+		trace_end("capture_write", tstart, c->frame);
+	}
+	return NULL;
+}
+
+/* undo whatever start_capture() got done before it failed */
+static void abandon_capture()
 {
-	return FALSE;
-}
+	int i;
 
-/* keyboard handling stuff ends */
-/**********************************/
+	if (capture.f) {
+		fclose(capture.f);
+		capture.f = NULL;
+	}
+	for (i = 0; i < CAPTURE_RING; i++) {
+		free(capture.ring[i].pixels);
+		capture.ring[i].pixels = NULL;
+	}
+	free(capture.out);
+	capture.out = NULL;
+	if (capture.image) {
+		g_object_unref(capture.image);
+		capture.image = NULL;
+	}
+}
 
-/* call back for configure_event (for window resize) */
-static gint main_da_configure(GtkWidget *w, GdkEventConfigure *event)
+/* first grab: now the window's there, size everything and start the */
+/* writer.  If anything fails, nothing is left open or allocated. */
+static int start_capture()
 {
-	GdkRectangle cliprect;
+	GdkVisual *visual = gdk_drawable_get_visual(main_da->window);
+	int i;
 
-	/* first time through, gc is null, because gc can't be set without */
-	/* a window, but, the window isn't there yet until it's shown, but */
-	/* the show generates a configure... chicken and egg.  And we can't */
-	/* proceed without gc != NULL...  but, it's ok, because 1st time thru */
-	/* we already sort of know the drawing area/window size. */
- 
-	if (gc == NULL)
-		return TRUE;
+	capture.w = main_da->allocation.width & ~1;	/* 4:2:0 wants even sizes */
+	capture.h = main_da->allocation.height & ~1;
+	capture.image = gdk_image_new(GDK_IMAGE_FASTEST, visual, capture.w, capture.h);
+	if (capture.image == NULL || capture.image->bpp != 4 || visual->red_prec != 8 ||
+		visual->green_prec != 8 || visual->blue_prec != 8) {
+		fprintf(stderr, "battallica: --capture wants a 24 or 32 bit TrueColor display\n");
+		abandon_capture();
+		return 0;
+	}
+	capture.bpl = capture.image->bpl;
+	capture.shift[0] = visual->red_shift;
+	capture.shift[1] = visual->green_shift;
+	capture.shift[2] = visual->blue_shift;
+	for (i = 0; i < CAPTURE_RING; i++)
+		capture.ring[i].pixels = (unsigned char *) game_malloc(ALLOC_CAPTURE, capture.bpl * capture.h);
+	capture.out = (unsigned char *) game_malloc(ALLOC_CAPTURE, capture.w * capture.h * 3);
+	for (i = 0; i < CAPTURE_RING; i++)
+		if (capture.ring[i].pixels == NULL)
+			break;
+	if (i < CAPTURE_RING || capture.out == NULL) {
+		fprintf(stderr, "battallica: not enough memory for --capture\n");
+		abandon_capture();
+		return 0;
+	}
 
-	// gtk_widget_set_size_request(w, w->allocation.width, w->allocation.height);
-	// gtk_window_get_size(GTK_WINDOW (w), &real_screen_width, &real_screen_height);
-	real_screen_width =  w->allocation.width;
-	real_screen_height =  w->allocation.height;
-	xscale_screen = (float) real_screen_width / (float) SCREEN_WIDTH;
-	yscale_screen = (float) real_screen_height / (float) SCREEN_HEIGHT;
-	if (real_screen_width == 800 && real_screen_height == 600) {
-		current_draw_line = gdk_draw_line;
-		current_draw_rectangle = gdk_draw_rectangle;
-		current_bright_line = unscaled_bright_line;
-	} else {
-		current_draw_line = scaled_line;
-		current_draw_rectangle = scaled_rectangle;
-		current_bright_line = scaled_bright_line;
-		if (thicklines)
-			current_draw_line = thick_scaled_line;
+	capture.f = fopen(capture.filename, "w");
+	if (capture.f == NULL) {
+		fprintf(stderr, "battallica: can't write %s: %s\n", capture.filename, strerror(errno));
+		abandon_capture();
+		return 0;
 	}
-	gdk_gc_set_clip_origin(gc, 0, 0);
-	cliprect.x = 0;	
-	cliprect.y = 0;	
-	cliprect.width = real_screen_width;	
-	cliprect.height = real_screen_height;	
-	gdk_gc_set_clip_rectangle(gc, &cliprect);
-	return TRUE;
+	if (!capture.raw)
+		fprintf(capture.f, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+			capture.w, capture.h, frame_rate_hz);
+	g_mutex_init(&capture.lock);
+	g_cond_init(&capture.go);
+	capture.thread = g_thread_try_new("capture", capture_thread, NULL, NULL);
+	if (capture.thread == NULL) {
+		fprintf(stderr, "battallica: can't start the capture thread\n");
+		g_cond_clear(&capture.go);
+		g_mutex_clear(&capture.lock);
+		abandon_capture();
+		return 0;
+	}
+	return 1;
+}
+
+/* once a tick, on the game thread, with the gdk lock held */
+void capture_frame()
+{
+	struct capture_frame *c;
+	long long start, tstart, usecs;
+	int head = capture.head;
+
+	if (capture.filename == NULL || main_da == NULL || main_da->window == NULL)
+		return;
+	if (capture.f == NULL && !start_capture()) {
+		capture.filename = NULL;
+		return;
+	}
+	if (head - g_atomic_int_get(&capture.tail) >= CAPTURE_RING) {
+		capture.dropped++;
+		return;
+	}
+	start = usecs_now();
+	tstart = trace_begin();
+	c = &capture.ring[head % CAPTURE_RING];
+	gdk_drawable_copy_to_image(main_da->window, capture.image, 0, 0, 0, 0,
+		MIN(capture.w, main_da->allocation.width),
+		MIN(capture.h, main_da->allocation.height));
+	memcpy(c->pixels, capture.image->mem, capture.bpl * capture.h);
+	c->frame = nframes;
+	g_atomic_int_set(&capture.head, head + 1);
+	g_mutex_lock(&capture.lock);
+	g_cond_signal(&capture.go);
+	g_mutex_unlock(&capture.lock);
+	usecs = usecs_now() - start;
+	capture.grabbed++;
+	capture.grab_usecs += usecs;
+	if (usecs > capture.worst_grab_usecs)
+		capture.worst_grab_usecs = usecs;
+	trace_end("capture_frame", tstart, nframes);
+}
+
+/* let the writer catch up, then close the file */
+void finish_capture()
+{
+	if (capture.thread == NULL)
+		return;
+	g_mutex_lock(&capture.lock);
+	capture.stop = 1;
+	g_cond_signal(&capture.go);
+	g_mutex_unlock(&capture.lock);
+	g_thread_join(capture.thread);
+	capture.thread = NULL;
+	fclose(capture.f);
+}
+
+void print_capture_stats()
+{
+	if (capture.grabbed == 0)
+		return;
+	printf("capture: %d frames of %dx%d to %s, %d dropped, %d write errors\n",
+		capture.written, capture.w, capture.h, capture.filename,
+		capture.dropped, capture.failed);
+	printf("  game thread %.2f ms/frame (worst %.2f ms), writer %.2f ms/frame\n",
+		capture.grab_usecs / 1000.0 / capture.grabbed,
+		capture.worst_grab_usecs / 1000.0,
+		capture.written ? capture.write_usecs / 1000.0 / capture.written : 0.0);
+	if (capture.raw)
+		printf("  play with: ffplay -f rawvideo -pixel_format rgb24 "
+			"-video_size %dx%d -framerate %d %s\n",
+			capture.w, capture.h, frame_rate_hz, capture.filename);
 }
 
+/* frame capture code ends   */
+/*****************************/
+
+#ifndef BATTALLICA_BENCH
 static gboolean delete_event(GtkWidget *widget, 
 	GdkEvent *event, gpointer data)
 {
@@ -1063,6 +7648,22 @@ static gboolean delete_event(GtkWidget *widget,
     printf("%d frames / %d seconds, %g frames/sec\n", 
 		nframes, (int) (end_time.tv_sec - start_time.tv_sec),
 		(0.0 + nframes) / (0.0 + end_time.tv_sec - start_time.tv_sec));
+    print_input_latency();
+    print_obj_arena_stats();
+    print_projectile_stats();
+    print_combat_stats();
+    print_avoid_stats();
+    print_ai_stats();
+    print_influence_stats();
+    print_net_stats(net);
+    finish_capture();
+    print_capture_stats();
+    print_quality_stats();
+    print_idle_stats();
+    finish_audio();
+    print_audio_stats();
+    print_view_stats();
+    print_alloc_stats();
     return FALSE;
 }
 
@@ -1070,6 +7671,7 @@ static void destroy(GtkWidget *widget, gpointer data)
 {
     gtk_main_quit ();
 }
+#endif
 
 void really_quit()
 {
@@ -1077,22 +7679,38 @@ void really_quit()
 	printf("%d frames / %d seconds, %g frames/sec\n",
 		nframes, (int) (end_time.tv_sec - start_time.tv_sec),
 		(0.0 + nframes) / (0.0 + end_time.tv_sec - start_time.tv_sec));
+	print_input_latency();
+	print_obj_arena_stats();
+	print_projectile_stats();
+	print_combat_stats();
+	print_avoid_stats();
+	print_ai_stats();
+	print_influence_stats();
+	print_net_stats(net);
+	finish_capture();
+	print_capture_stats();
+	print_quality_stats();
+	print_idle_stats();
+	finish_audio();
+	print_audio_stats();
+	print_view_stats();
+	print_alloc_stats();
 	// destroy_event(window, NULL);
 	exit(1); // probably bad form... oh well.
 }
 
-static inline int onscreen(struct game_obj_t *o)
+static inline int onscreen(struct viewport_t *vp, struct game_obj_t *o)
 {
-	return (o->x >= game_state.vp.x && 
-		o->x <= game_state.vp.x + game_state.vp.width &&
-		o->y >= game_state.vp.y && 
-		o->y <= game_state.vp.y + game_state.vp.height);
+	return (o->x >= vp->x && 
+		o->x <= vp->x + vp->width &&
+		o->y >= vp->y && 
+		o->y <= vp->y + vp->height);
 }
 
-static int generic_draw_terrain(GtkWidget *w, char t, int x, int y)
+static int generic_draw_terrain(GtkWidget *w, struct terrain_descriptor_t *t, int x, int y)
 {
 	int x2, y2;
-        gdk_gc_set_foreground(gc, &huex[terrain_type[t]->color]);
+        wwvi_set_foreground(gc, &huex[t->color]);
 	wwvi_draw_rectangle(w->window, gc, 0, x+1, y+1, mapsquarewidth-2, mapsquarewidth-2);
 	x2 = x+mapsquarewidth-1;
 	y2 = y+mapsquarewidth-1;
@@ -1108,85 +7726,789 @@ static int generic_draw_terrain(GtkWidget *w, char t, int x, int y)
 #endif
 	// if (x < 0 || y < 0)
 		//return;
+	if (quality >= QUALITY_PLAIN_TERRAIN)
+		return 2;	/* X requests made */
 	wwvi_draw_line(w->window, gc, x+30, y+30, x+mapsquarewidth-30, y+mapsquarewidth-30);
 	wwvi_draw_line(w->window, gc, x+30, y+mapsquarewidth-30, x+mapsquarewidth-30, y+30);
+	return 4;
 }
  
-static int main_da_expose(GtkWidget *w, GdkEvent *event, gpointer p)
+/*****************************/
+/* HUD code begins           */
+
+/* Score, lives and, with F2, some debug counters, in a stroke font. */
+/* Each glyph is a few strokes on a 3 x 5 grid of points, lettered */
+/*	a b c */
+/*	d e f */
+/*	g h i */
+/*	j k l */
+/*	m n o */
+/* with a space between strokes.  At startup they're turned into */
+/* my_point_t shapes with LINE_BREAKs, like everything else which gets */
+/* drawn, and then into an atlas of ready made segments, one entry per */
+/* character.  Each HUD item keeps the segments for its text, and only */
+/* makes them again when the text changes; for a labelled number only */
+/* the digits get redone, straight from the atlas.  The segments go */
+/* into the same batches as the objects' lines. */
+
+#define HUD_SCALE 4		/* pixels per grid step */
+#define HUD_ADVANCE (3 * HUD_SCALE)	/* from one character to the next */
+#define HUD_HEIGHT (4 * HUD_SCALE)
+#define HUD_MARGIN 10
+#define HUD_MAX_GLYPH_SEGS 8
+#define HUD_MAX_CHARS 32
+
+static const char *glyph_strokes[128] = {
+	['0'] = "acoma mc", ['1'] = "dbn mo", ['2'] = "acigmo", ['3'] = "acom hi",
+	['4'] = "agi co", ['5'] = "cagiom", ['6'] = "camoig", ['7'] = "acn",
+	['8'] = "acoma gi", ['9'] = "igaco",
+	['A'] = "maco gi", ['B'] = "mabfglnm", ['C'] = "camo", ['D'] = "mabflnm",
+	['E'] = "camo gh", ['F'] = "cam gh", ['G'] = "camoih", ['H'] = "am co gi",
+	['I'] = "ac bn mo", ['J'] = "comj", ['K'] = "am cgo", ['L'] = "amo",
+	['M'] = "maeco", ['N'] = "maoc", ['O'] = "acoma", ['P'] = "macig",
+	['Q'] = "acoma ko", ['R'] = "macig ho", ['S'] = "cagiom", ['T'] = "ac bn",
+	['U'] = "amoc", ['V'] = "anc", ['W'] = "amkoc", ['X'] = "ao cm",
+	['Y'] = "aec en", ['Z'] = "acmo",
+	['.'] = "nn", [':'] = "ee kk", ['-'] = "gi", ['/'] = "mc", ['%'] = "mc aa oo",
+};
+
+struct hud_seg {
+	short x1, y1, x2, y2;
+};
+
+struct glyph {
+	int nsegs;
+	struct hud_seg seg[HUD_MAX_GLYPH_SEGS];
+};
+
+struct my_vect_obj font_vect[128];
+struct glyph glyph_atlas[128];
+
+struct hud_item {
+	int x, y, color;
+	int right;		/* x is where the text ends, not where it starts */
+	int shown;
+	char text[HUD_MAX_CHARS + 1];	/* what seg[] is of */
+	int label_len, label_segs;	/* the part of text and seg[] which is the label */
+	int nsegs;
+	struct hud_seg seg[HUD_MAX_CHARS * HUD_MAX_GLYPH_SEGS];
+	int changed;
+	GdkRectangle drawn;	/* window area of what's on screen now */
+};
+
+#define HUD_SCORE 0
+#define HUD_LIVES 1
+#define HUD_OBJECTS 2
+#define HUD_TICK 3
+#define HUD_XREQUESTS 4
+#define NHUD_ITEMS 5
+
+struct hud_item hud[NHUD_ITEMS];
+
+/* turn the stroke strings into shapes, and the shapes into the atlas */
+void init_font()
 {
-	int i, tleft, tright, ttop, tbottom, tx, ty, t_x, t_y;
-	struct viewport_t *vp = &game_state.vp;
+	struct my_point_t *p;
+	const char *s;
+	struct glyph *g;
+	int c, n, j, x1, y1;
+
+	for (c = 0; c < 128; c++) {
+		s = glyph_strokes[c];
+		if (s == NULL)
+			continue;
+		p = (struct my_point_t *) game_malloc(ALLOC_DRAW, sizeof(*p) * (strlen(s) + 1));
+		for (n = 0; *s; s++, n++) {
+			if (*s == ' ') {
+				p[n].x = LINE_BREAK;
+				p[n].y = LINE_BREAK;
+				continue;
+			}
+			p[n].x = ((*s - 'a') % 3) * HUD_SCALE;
+			p[n].y = ((*s - 'a') / 3) * HUD_SCALE;
+		}
+		font_vect[c].p = p;
+		font_vect[c].npoints = n;
+		font_vect[c].nframes = 1;
+
+		/* walk it the way generic_draw() does */
+		g = &glyph_atlas[c];
+		x1 = p[0].x;
+		y1 = p[0].y;
+		for (j = 0; j < n - 1; j++) {
+			if (p[j + 1].x == LINE_BREAK) {
+				j += 2;
+				x1 = p[j].x;
+				y1 = p[j].y;
+			}
+			g->seg[g->nsegs].x1 = x1;
+			g->seg[g->nsegs].y1 = y1;
+			g->seg[g->nsegs].x2 = p[j + 1].x;
+			g->seg[g->nsegs].y2 = p[j + 1].y;
+			g->nsegs++;
+			x1 = p[j + 1].x;
+			y1 = p[j + 1].y;
+		}
+	}
+}
+
+/* where an item's text starts, in game screen coords */
+static inline int hud_x(struct hud_item *h)
+{
+	return h->right ? h->x - (int) strlen(h->text) * HUD_ADVANCE : h->x;
+}
+
+/* lay out text from character from on, from the atlas, after seg[nsegs] */
+static void hud_layout(struct hud_item *h, int from)
+{
+	struct glyph *g;
+	int i, j, x;
+	struct hud_seg *s;
+
+	for (i = from; h->text[i]; i++) {
+		g = &glyph_atlas[(unsigned char) h->text[i] & 0x7f];
+		x = i * HUD_ADVANCE;
+		for (j = 0; j < g->nsegs; j++) {
+			s = &h->seg[h->nsegs++];
+			s->x1 = g->seg[j].x1 + x;
+			s->y1 = g->seg[j].y1;
+			s->x2 = g->seg[j].x2 + x;
+			s->y2 = g->seg[j].y2;
+		}
+	}
+}
+
+/* Show label followed by value.  Nothing is done unless either one */
+/* changed, and if it's only the value, only the digits are redone. */
+void hud_set_number(struct hud_item *h, const char *label, int value)
+{
+	char text[HUD_MAX_CHARS + 1];
+	int len = strlen(label);
+
+	snprintf(text, sizeof(text), "%s%d", label, value);
+	if (strcmp(text, h->text) == 0)
+		return;
+	if (len != h->label_len || strncmp(text, h->text, len) != 0) {
+		h->nsegs = 0;
+		h->label_len = 0;
+		strcpy(h->text, label);
+		hud_layout(h, 0);
+		h->label_len = len;
+		h->label_segs = h->nsegs;
+	}
+	strcpy(h->text, text);
+	h->nsegs = h->label_segs;
+	hud_layout(h, h->label_len);
+	h->changed = 1;
+}
+
+static void hud_show(struct hud_item *h, int shown)
+{
+	if (h->shown == shown)
+		return;
+	h->shown = shown;
+	h->changed = 1;
+}
+
+void init_hud()
+{
+	int i;
+
+	init_font();
+	memset(hud, 0, sizeof(hud));
+	for (i = 0; i < NHUD_ITEMS; i++)
+		hud[i].color = GREEN;
+	hud[HUD_SCORE].x = HUD_MARGIN;
+	hud[HUD_SCORE].y = HUD_MARGIN;
+	hud[HUD_SCORE].shown = 1;
+	hud[HUD_LIVES].x = SCREEN_WIDTH - HUD_MARGIN;
+	hud[HUD_LIVES].y = HUD_MARGIN;
+	hud[HUD_LIVES].right = 1;
+	hud[HUD_LIVES].shown = 1;
+	for (i = HUD_OBJECTS; i <= HUD_XREQUESTS; i++) {
+		hud[i].x = HUD_MARGIN;
+		hud[i].y = SCREEN_HEIGHT - HUD_MARGIN - (HUD_XREQUESTS - i + 1) * (HUD_HEIGHT + HUD_SCALE * 2);
+		hud[i].color = YELLOW;
+	}
+}
+
+/* once a tick, before queue_dirty_rects(), which repaints what changed */
+void update_hud()
+{
+	int i, just_shown = hud_debug && !hud[HUD_TICK].shown;
+
+	hud_set_number(&hud[HUD_SCORE], "SCORE ", game_state.score);
+	hud_set_number(&hud[HUD_LIVES], "LIVES ", game_state.lives);
+	for (i = HUD_OBJECTS; i <= HUD_XREQUESTS; i++)
+		hud_show(&hud[i], hud_debug);
+	/* Only while something's happening, or the counters would change */
+	/* every tick, and repainting them would keep the game awake. */
+	if (hud_debug && (idle.static_ticks == 0 || just_shown)) {
+		hud_set_number(&hud[HUD_OBJECTS], "OBJECTS ", live_objects);
+		hud_set_number(&hud[HUD_TICK], "TICK USECS ", (int) governor.avg);
+		hud_set_number(&hud[HUD_XREQUESTS], "X REQUESTS ", xrequests);
+	}
+	xrequests = 0;
+}
+
+/* into the segment batches, with the objects */
+void draw_hud()
+{
+	struct hud_item *h;
+	struct hud_seg *s;
+	int i, j, x;
+
+	for (i = 0; i < NHUD_ITEMS; i++) {
+		h = &hud[i];
+		if (!h->shown)
+			continue;
+		x = hud_x(h);
+		for (j = 0; j < h->nsegs; j++) {
+			s = &h->seg[j];
+			batch_line(h->color, x + s->x1, h->y + s->y1, x + s->x2, h->y + s->y2);
+		}
+	}
+}
+
+/* HUD code ends             */
+/*****************************/
+
+/*********************************/
+/* dirty rectangle code begins   */
+
+/* Rather than repaint the whole window every tick, we remember the */
+/* window area each object covered when it was last drawn, and each */
+/* tick invalidate only the old and new areas of objects which moved */
+/* or turned.  The areas are merged into a handful of rectangles so we */
+/* don't flood X with tiny invalidations.  If the viewport moves, */
+/* everything moves, and we just repaint the whole thing. */
 
-	tleft = game_state.vp.x / mapsquarewidth;
-	ttop = game_state.vp.y / mapsquarewidth;
-	// printf("left=%d, top=%d\n", tleft, ttop);
+#define MAX_DIRTY_RECTS 8
+#define DIRTY_PAD 2	/* slop for thick lines and rounding */
 
-	tx = tleft * mapsquarewidth + game_state.vp.x % (mapxdim * mapsquarewidth);
-	ty = ttop * mapsquarewidth + game_state.vp.y % (mapydim * mapsquarewidth);
-	// printf("tx=%d,ty=%d\n", tx, ty);
+GdkRectangle dirty_rect[MAX_DIRTY_RECTS];
+int ndirty_rects = 0;
+int last_vpx, last_vpy;		/* viewport position at last frame */
+int last_view_x[MAX_VIEWS], last_view_y[MAX_VIEWS];	/* and the other views' */
+unsigned int last_move_sum;	/* move_sum at last frame */
 
-	t_y = ttop;
-	for (ty = ttop * mapsquarewidth; ty < vp->y + vp->height; ty += mapsquarewidth) {
-		t_x = tleft;
-		if (t_y < 0) {
-			t_y++;
+static inline int rect_area(GdkRectangle *r)
+{
+	return r->width * r->height;
+}
+
+/* the window area an object will be drawn into in view vp, or an */
+/* empty rectangle if it won't be drawn there at all. */
+static void obj_view_box(struct game_obj_t *o, struct viewport_t *vp, GdkRectangle *r)
+{
+	int x1, y1, x2, y2;
+
+	if (!o->alive || o->v == NULL || !onscreen(vp, o)) {
+		memset(r, 0, sizeof(*r));
+		return;
+	}
+	x1 = (o->x + o->v->minx - vp->x + vp->sx) * xscale_screen - DIRTY_PAD;
+	y1 = (o->y + o->v->miny - vp->y + vp->sy) * yscale_screen - DIRTY_PAD;
+	x2 = (o->x + o->v->maxx - vp->x + vp->sx) * xscale_screen + DIRTY_PAD;
+	y2 = (o->y + o->v->maxy - vp->y + vp->sy) * yscale_screen + DIRTY_PAD;
+	r->x = x1;
+	r->y = y1;
+	r->width = x2 - x1 + 1;
+	r->height = y2 - y1 + 1;
+}
+
+/* the same, in the main view */
+static void obj_screen_box(struct game_obj_t *o, GdkRectangle *r)
+{
+	obj_view_box(o, &game_state.vp, r);
+}
+
+/* where a view goes in the window */
+static void view_window_rect(struct viewport_t *vp, GdkRectangle *r)
+{
+	r->x = vp->sx * xscale_screen;
+	r->y = vp->sy * yscale_screen;
+	r->width = (int) ((vp->sx + vp->sw) * xscale_screen) - r->x;
+	r->height = (int) ((vp->sy + vp->sh) * yscale_screen) - r->y;
+}
+
+/* the window area a line in game coords covers */
+static void line_screen_box(int x1, int y1, int x2, int y2, GdkRectangle *r)
+{
+	int t;
+
+	if (x1 > x2) {
+		t = x1; x1 = x2; x2 = t;
+	}
+	if (y1 > y2) {
+		t = y1; y1 = y2; y2 = t;
+	}
+	r->x = (x1 - game_state.vp.x + game_state.vp.sx) * xscale_screen - DIRTY_PAD;
+	r->y = (y1 - game_state.vp.y + game_state.vp.sy) * yscale_screen - DIRTY_PAD;
+	r->width = (x2 - x1) * xscale_screen + 2 * DIRTY_PAD + 1;
+	r->height = (y2 - y1) * yscale_screen + 2 * DIRTY_PAD + 1;
+}
+
+/* the window area a HUD item covers */
+static void hud_box(struct hud_item *h, GdkRectangle *r)
+{
+	int w = strlen(h->text) * HUD_ADVANCE;
+
+	if (!h->shown || w == 0) {
+		memset(r, 0, sizeof(*r));
+		return;
+	}
+	r->x = hud_x(h) * xscale_screen - DIRTY_PAD;
+	r->y = h->y * yscale_screen - DIRTY_PAD;
+	r->width = w * xscale_screen + 2 * DIRTY_PAD + 1;
+	r->height = HUD_HEIGHT * yscale_screen + 2 * DIRTY_PAD + 1;
+}
+
+/* add a rectangle to the dirty set, merging with whatever costs least */
+void add_dirty_rect(GdkRectangle *r)
+{
+	int i, best, growth, best_growth;
+	GdkRectangle u;
+
+	if (r->width <= 0 || r->height <= 0)
+		return;
+
+	/* merge with anything it overlaps, or which it barely grows. */
+	for (i = 0; i < ndirty_rects; i++) {
+		gdk_rectangle_union(&dirty_rect[i], r, &u);
+		if (rect_area(&u) <= rect_area(&dirty_rect[i]) + rect_area(r)) {
+			/* pull the merged one out and add it again, it might */
+			/* now overlap some other rectangle. */
+			ndirty_rects--;
+			dirty_rect[i] = dirty_rect[ndirty_rects];
+			add_dirty_rect(&u);
+			return;
+		}
+	}
+
+	if (ndirty_rects < MAX_DIRTY_RECTS) {
+		dirty_rect[ndirty_rects++] = *r;
+		return;
+	}
+
+	/* Out of rectangles, grow the one which grows the least. */
+	best = 0;
+	best_growth = INT_MAX;
+	for (i = 0; i < ndirty_rects; i++) {
+		gdk_rectangle_union(&dirty_rect[i], r, &u);
+		growth = rect_area(&u) - rect_area(&dirty_rect[i]);
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = i;
+		}
+	}
+	gdk_rectangle_union(&dirty_rect[best], r, &u);
+	ndirty_rects--;
+	dirty_rect[best] = dirty_rect[ndirty_rects];
+	add_dirty_rect(&u);
+}
+
+/* ask for r, or with NULL the whole window, to be exposed.  The bench */
+/* puts its own in, it has no window. */
+static void invalidate_main_da(GdkRectangle *r)
+{
+	if (r == NULL)
+		gtk_widget_queue_draw(main_da);
+	else
+		gdk_window_invalidate_rect(main_da->window, r, FALSE);
+}
+
+void (*invalidate_function)(GdkRectangle *r) = invalidate_main_da;
+
+/* figure out what changed since the last frame and invalidate just that. */
+/* Called once per tick, after everything has moved. */
+void queue_dirty_rects()
+{
+	int i, total, moved;
+	struct game_obj_t *o;
+	struct viewport_t *vp;
+	GdkRectangle r;
+
+	if (game_state.vp.x != last_vpx || game_state.vp.y != last_vpy)
+		full_redraw = 1;
+	last_vpx = game_state.vp.x;
+	last_vpy = game_state.vp.y;
+
+	ndirty_rects = 0;
+	for (i=0;i<=highest_object_number;i++) {
+		o = gobj(i);
+		if (!o->alive && o->drawn.width == 0)
+			continue;
+		obj_screen_box(o, &r);
+		if (!full_redraw && (r.x != o->drawn.x || r.y != o->drawn.y ||
+			r.width != o->drawn.width || r.height != o->drawn.height ||
+			o->bearing != o->drawn_bearing)) {
+			add_dirty_rect(&o->drawn);
+			add_dirty_rect(&r);
+		}
+		o->drawn = r;
+		o->drawn_bearing = o->bearing;
+	}
+
+	for (i = 0; i < NHUD_ITEMS; i++) {
+		if (!hud[i].changed)
 			continue;
+		hud_box(&hud[i], &r);
+		if (!full_redraw) {
+			add_dirty_rect(&hud[i].drawn);
+			add_dirty_rect(&r);
 		}
-		for (tx = tleft * mapsquarewidth; tx < vp->x + vp->width; tx += mapsquarewidth) {
-			if (t_x < 0) {
-				t_x++;
+		hud[i].drawn = r;
+		hud[i].changed = 0;
+	}
+
+	/* The other views follow things which are on the move most of */
+	/* the time, so they're just repainted whole, if anything moved. */
+	moved = move_sum != last_move_sum || projectiles.n != 0 || nproj_erase != 0;
+	last_move_sum = move_sum;
+	for (i = 1; i < game_state.nviews; i++) {
+		vp = view(i);
+		if (!full_redraw && (moved || vp->x != last_view_x[i] || vp->y != last_view_y[i])) {
+			view_window_rect(vp, &r);
+			add_dirty_rect(&r);
+		}
+		last_view_x[i] = vp->x;
+		last_view_y[i] = vp->y;
+	}
+
+	/* Shots move every tick.  What needs repainting is from where the */
+	/* trail started last frame to where it ends now. */
+	for (i = 0; !full_redraw && i < projectiles.n; i++) {
+		line_screen_box(projectiles.ox[i] - projectiles.vx[i], projectiles.oy[i] - projectiles.vy[i],
+			projectiles.x[i], projectiles.y[i], &r);
+		add_dirty_rect(&r);
+	}
+	for (i = 0; !full_redraw && i < nproj_erase; i++) {
+		line_screen_box(proj_erase[i].x1, proj_erase[i].y1,
+			proj_erase[i].x2, proj_erase[i].y2, &r);
+		add_dirty_rect(&r);
+	}
+	nproj_erase = 0;
+
+	if (full_redraw) {
+		invalidate_function(NULL);
+		full_redraw = 0;
+		return;
+	}
+
+	/* If most of the window is dirty anyway, one big invalidate is cheaper. */
+	total = 0;
+	for (i = 0; i < ndirty_rects; i++)
+		total += rect_area(&dirty_rect[i]);
+	if (total > real_screen_width * real_screen_height / 2) {
+		invalidate_function(NULL);
+		return;
+	}
+	for (i = 0; i < ndirty_rects; i++)
+		invalidate_function(&dirty_rect[i]);
+}
+
+/* dirty rectangle code ends     */
+/*********************************/
+
+/*****************************/
+/* viewport code begins      */
+
+/* Besides the main view there can be split screen or picture in */
+/* picture views following battalions (F3, or --views).  Views later */
+/* in the list go on top of earlier ones.  An expose sorts the objects */
+/* and shots into a bin per view in one pass over the arena, leaving */
+/* out anything which would only be drawn under a view on top, then */
+/* draws each view with the gc clipped to its own part of the window. */
+/* The terrain squares under a view on top aren't drawn either, so */
+/* each bit of the window gets its terrain drawn once. */
+
+#define PIP_MARGIN 8	/* between the small view and the edge, screen coords */
+
+int draw_view = 0;			/* which view is being drawn */
+struct game_obj_t **view_bin[MAX_VIEWS];	/* objects to draw in each view */
+int view_nbin[MAX_VIEWS];
+int *view_shots[MAX_VIEWS];		/* shots to draw, indexes into projectiles */
+int view_nshots[MAX_VIEWS];
+GdkRectangle view_rect[MAX_VIEWS];	/* where each view is in the window */
+GdkRectangle view_clip[MAX_VIEWS];	/* and how much of that this expose covers */
+
+/* is r, in window coords, all under the views on top of view v? */
+static int hidden_by_views_above(int v, GdkRectangle *r)
+{
+	int i;
+	GdkRectangle *s;
+
+	for (i = v + 1; i < game_state.nviews; i++) {
+		s = &view_rect[i];
+		if (r->x >= s->x && r->y >= s->y && r->x + r->width <= s->x + s->width &&
+			r->y + r->height <= s->y + s->height)
+			return 1;
+	}
+	return 0;
+}
+
+/* fill the bins for an expose of area, one pass over the objects and */
+/* one over the shots, however many views there are.  The bins come */
+/* from the frame arena. */
+static void cull_views(GdkRectangle *area)
+{
+	int i, v, nviews = game_state.nviews;
+	struct game_obj_t *o;
+	struct viewport_t *vp;
+	GdkRectangle r, clipped;
+
+	for (v = 0; v < nviews; v++) {
+		view_bin[v] = arena_new(&frame_arena, struct game_obj_t *, highest_object_number + 1);
+		view_shots[v] = arena_new(&frame_arena, int, projectiles.n);
+		view_window_rect(view(v), &view_rect[v]);
+		if (!gdk_rectangle_intersect(&view_rect[v], area, &view_clip[v]))
+			view_clip[v].width = 0;
+		view_nbin[v] = 0;
+		view_nshots[v] = 0;
+	}
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		if (!o->alive || o->v == NULL)
+			continue;
+		for (v = 0; v < nviews; v++) {
+			vp = view(v);
+			if (view_clip[v].width == 0 || !onscreen(vp, o))
+				continue;
+			obj_view_box(o, vp, &r);
+			if (!gdk_rectangle_intersect(&r, &view_clip[v], &clipped))
+				continue;
+			if (v < nviews - 1 && hidden_by_views_above(v, &r)) {
+				view_stats.hidden++;
 				continue;
 			}
-			generic_draw_terrain(w, terrain_map[txy(t_x, t_y)], tx - vp->x, ty - vp->y);
-			t_x++;
-			if (t_x >= mapydim)
-				break;
+			view_bin[v][view_nbin[v]++] = o;
+		}
+	}
+	for (i = 0; i < projectiles.n; i++)
+		for (v = 0; v < nviews; v++)
+			if (view_clip[v].width && shot_in_view(i, view(v)))
+				view_shots[v][view_nshots[v]++] = i;
+	for (v = 0; v < nviews; v++)
+		view_stats.binned += view_nbin[v];
+	view_stats.culls++;
+}
+
+#ifndef BATTALLICA_BENCH
+/* a line round the edge of the views which sit on another one */
+static void draw_view_frame(struct viewport_t *vp)
+{
+	int x2 = vp->sx + vp->sw - 1, y2 = vp->sy + vp->sh - 1;
+
+	batch_line(WHITE, vp->sx, vp->sy, x2, vp->sy);
+	batch_line(WHITE, x2, vp->sy, x2, y2);
+	batch_line(WHITE, x2, y2, vp->sx, y2);
+	batch_line(WHITE, vp->sx, y2, vp->sx, vp->sy);
+}
+#endif
+
+/* place a view on the screen, keeping the middle of what it shows */
+/* where it was */
+static void set_view_geometry(struct viewport_t *vp, int sx, int sy, int sw, int sh)
+{
+	vp->x += (vp->width - (sw - 2 * vp->xoffset)) / 2;
+	vp->y += (vp->height - (sh - 2 * vp->yoffset)) / 2;
+	vp->sx = sx;
+	vp->sy = sy;
+	vp->sw = sw;
+	vp->sh = sh;
+	vp->width = sw - 2 * vp->xoffset;
+	vp->height = sh - 2 * vp->yoffset;
+}
+
+void set_view_layout(int layout)
+{
+	int i, n, w = SCREEN_WIDTH, h = SCREEN_HEIGHT;
+
+	switch (layout) {
+	case VIEWS_PIP:
+		set_view_geometry(&game_state.vp, 0, 0, w, h);
+		set_view_geometry(view(1), w - w / 3 - PIP_MARGIN, PIP_MARGIN, w / 3, h / 3);
+		n = 2;
+		break;
+	case VIEWS_SPLIT:
+		set_view_geometry(&game_state.vp, 0, 0, w / 2, h);
+		set_view_geometry(view(1), w / 2, 0, w - w / 2, h);
+		n = 2;
+		break;
+	case VIEWS_TRIO:
+		set_view_geometry(&game_state.vp, 0, 0, w / 2, h);
+		set_view_geometry(view(1), w / 2, 0, w - w / 2, h / 2);
+		set_view_geometry(view(2), w / 2, h / 2, w - w / 2, h - h / 2);
+		n = 3;
+		break;
+	default:
+		layout = VIEWS_SINGLE;
+		set_view_geometry(&game_state.vp, 0, 0, w, h);
+		n = 1;
+		break;
+	}
+	for (i = game_state.nviews; i < n; i++)
+		view(i)->obj = NO_OBJ;	/* newly shown, find something to follow */
+	game_state.nviews = n;
+	view_layout = layout;
+	full_redraw = 1;
+}
+
+/* the nth live battalion, or the player if there aren't that many */
+static obj_handle_t view_target(int n)
+{
+	int i;
+	struct game_obj_t *o;
+
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		if (o->alive && o->otype == OBJ_TYPE_BATTALION && n-- == 0)
+			return obj_handle(o);
+	}
+	return the_player;
+}
+
+/* viewport code ends        */
+/*****************************/
+
+static void draw_terrain_square(int x, int y, struct terrain_descriptor_t *t, void *w)
+{
+	struct viewport_t *vp = draw_vp;
+	GdkRectangle r;
+
+	x = x * mapsquarewidth - vp->x + vp->sx;
+	y = y * mapsquarewidth - vp->y + vp->sy;
+	if (draw_view < game_state.nviews - 1) {
+		r.x = x * xscale_screen;
+		r.y = y * yscale_screen;
+		r.width = mapsquarewidth * xscale_screen + 1;
+		r.height = mapsquarewidth * yscale_screen + 1;
+		if (hidden_by_views_above(draw_view, &r)) {
+			view_stats.hidden++;
+			return;
 		}
-		t_y++;
-		if (t_y >= mapydim)
-			break;
 	}
+	xrequests += generic_draw_terrain((GtkWidget *) w, t, x, y);
+}
+
+/* Draw the terrain squares which intersect area, which is in window */
+/* coords, so unscale it into game coords. */
+static void draw_terrain_area(GtkWidget *w, GdkRectangle *area)
+{
+	int tleft, tright, ttop, tbottom;
+	int x1, y1, x2, y2;
+	struct viewport_t *vp = draw_vp;
+
+	x1 = vp->x - vp->sx + (int) (area->x / xscale_screen);
+	y1 = vp->y - vp->sy + (int) (area->y / yscale_screen);
+	x2 = vp->x - vp->sx + (int) ((area->x + area->width) / xscale_screen) + 1;
+	y2 = vp->y - vp->sy + (int) ((area->y + area->height) / yscale_screen) + 1;
+	if (x2 > vp->x + vp->width)
+		x2 = vp->x + vp->width;
+	if (y2 > vp->y + vp->height)
+		y2 = vp->y + vp->height;
+
+	tleft = x1 < 0 ? 0 : x1 / mapsquarewidth;
+	ttop = y1 < 0 ? 0 : y1 / mapsquarewidth;
+	tright = x2 <= 0 ? -1 : (x2 - 1) / mapsquarewidth;
+	tbottom = y2 <= 0 ? -1 : (y2 - 1) / mapsquarewidth;
+	terrain_for_rect(tleft, ttop, tright, tbottom, draw_terrain_square, w);
+}
+
+#ifndef BATTALLICA_BENCH
+static int main_da_expose(GtkWidget *w, GdkEventExpose *event, gpointer p)
+{
+	int v, n;
+	GdkRectangle whole;
+	long long start = trace_begin(), t, work_start = usecs_now();
+
+	t = trace_begin();
+	cull_views(&event->area);
+	trace_end("cull_views", t, game_state.nviews);
 	
         gdk_gc_set_foreground(gc, &huex[WHITE]);
 	// wwvi_draw_rectangle(w->window, gc, 0, 
 	//		vp->xoffset, vp->yoffset, vp->width, vp->height);
 
-	for (i=0;i<=highest_object_number;i++) {
-		if (!game_state.go[i].alive)
+	n = 0;
+	for (v = 0; v < game_state.nviews; v++) {
+		if (view_clip[v].width == 0)
 			continue;
-		if (onscreen(&game_state.go[i]))
-			game_state.go[i].draw(&game_state.go[i], main_da); 
+		draw_view = v;
+		draw_vp = view(v);
+		if (game_state.nviews > 1)
+			gdk_gc_set_clip_rectangle(gc, &view_clip[v]);
+		if (v > 0) {	/* it may sit on view 0, which has drawn under it */
+			wwvi_set_foreground(gc, &huex[BLACK]);
+			wwvi_draw_rectangle(w->window, gc, TRUE, view_clip[v].x, view_clip[v].y,
+				view_clip[v].width, view_clip[v].height);
+			xrequests += 2;
+		}
+		t = trace_begin();
+		draw_terrain_area(w, &view_clip[v]);
+		trace_end("draw_terrain_area", t, view_clip[v].width * view_clip[v].height);
+		t = trace_begin();
+		run_draw_pass(view_bin[v], view_nbin[v], main_da);
+		draw_projectiles(view_shots[v], view_nshots[v]);
+		if (v > 0)
+			draw_view_frame(draw_vp);
+		flush_segment_batches(w->window);
+		trace_end("draw_objects", t, view_nbin[v]);
+		n += view_nbin[v];
+	}
+	draw_view = 0;
+	draw_vp = &game_state.vp;
+	if (game_state.nviews > 1) {
+		whole.x = 0;
+		whole.y = 0;
+		whole.width = real_screen_width;
+		whole.height = real_screen_height;
+		gdk_gc_set_clip_rectangle(gc, &whole);
 	}
+	draw_hud();
+	flush_segment_batches(w->window);
+	arena_reset(&frame_arena);
+	input_frame_drawn(timer);
+	trace_end("main_da_expose", start, n);
+	governor.work_usecs += usecs_now() - work_start;
+	expose_wakes_game();
 	return 0;
 }
+#endif
 
-void move_viewport()
+void move_viewport(struct viewport_t *vp)
 {
-	struct game_obj_t *v = game_state.vp.obj;
-	struct viewport_t *vp = &game_state.vp;
+	struct game_obj_t *v = obj_lookup(vp->obj);
 	int desiredx, desiredy;
 
+	if (v == NULL) {	/* nothing to follow, stay put */
+		vp->vx = 0;
+		vp->vy = 0;
+		return;
+	}
+
 	if (v->vx > 8)
-		desiredx = v->x - SCREEN_WIDTH/4;
+		desiredx = v->x - vp->sw/4;
 	else if (v->vx > 3)
-		desiredx = v->x - SCREEN_WIDTH/3;
+		desiredx = v->x - vp->sw/3;
 	else if (v->vx < -3)
-		desiredx = v->x - 2*SCREEN_WIDTH/3;
+		desiredx = v->x - 2*vp->sw/3;
 	else if (v->vx < -8)
-		desiredx = v->x - 3*SCREEN_WIDTH/4;
+		desiredx = v->x - 3*vp->sw/4;
 	else
-		desiredx = v->x - SCREEN_WIDTH/2;
+		desiredx = v->x - vp->sw/2;
 
 	if (v->vy > 8)
-		desiredy = v->y - SCREEN_HEIGHT/4;
+		desiredy = v->y - vp->sh/4;
 	else if (v->vy > 3)
-		desiredy = v->y - SCREEN_HEIGHT/3;
+		desiredy = v->y - vp->sh/3;
 	else if (v->vy < -3)
-		desiredy = v->y - 2*SCREEN_HEIGHT/3;
+		desiredy = v->y - 2*vp->sh/3;
 	else if (v->vy < -8)
-		desiredy = v->y - 3*SCREEN_HEIGHT/4;
+		desiredy = v->y - 3*vp->sh/4;
 	else
-		desiredy = v->y - SCREEN_HEIGHT/2;
+		desiredy = v->y - vp->sh/2;
 
 	if (vp->x < desiredx - 10) {
 		if (vp->vx > 0)
@@ -1240,51 +8562,883 @@ void move_viewport()
 	vp->y += vp->vy;
 }
 
-gint advance_game(gpointer data)
+/* the main view follows the player, the others whatever they were */
+/* given, or a new battalion when theirs is gone */
+void move_views()
 {
 	int i;
+	struct viewport_t *vp;
+	struct game_obj_t *o;
 
-	timer++;
-
-	for (i=0;i<=highest_object_number;i++) {
-		if (!game_state.go[i].alive)
+	if (view_layout_requested >= 0) {
+		set_view_layout(view_layout_requested);
+		view_layout_requested = -1;
+	}
+	for (i = 1; i < game_state.nviews; i++) {
+		vp = view(i);
+		if (obj_lookup(vp->obj) != NULL)
+			continue;
+		vp->obj = view_target(i - 1);
+		o = obj_lookup(vp->obj);
+		if (o == NULL)
 			continue;
-		game_state.go[i].move(&game_state.go[i]);
+		vp->x = o->x - vp->sw / 2;	/* jump straight there */
+		vp->y = o->y - vp->sh / 2;
+		vp->vx = vp->vy = 0;
 	}
-	move_viewport();
+	for (i = 0; i < game_state.nviews; i++)
+		move_viewport(view(i));
+}
+
+gint advance_game(gpointer data)
+{
+	struct tick_command cmd[MAXPLAYERS];
+	long long start, t, work_start = usecs_now();
+
+	if (trace_toggle_requested) {
+		trace_toggle_requested = 0;
+		trace_toggle();
+	}
+	if (in_the_process_of_quitting)
+		really_quit();
+	if (!idle_before_tick(net != NULL))
+		return FALSE;
+	govern_quality();
+	start = trace_begin();
+	if (net) {
+		sample_input(net->last_local + 1);
+		lockstep_frame(net, keys_this_tick);
+	} else {
+		sample_input(timer + 1);
+		memset(cmd, 0, sizeof(cmd));
+		cmd[local_player].keys = keys_this_tick;
+		simulate_tick(cmd);
+	}
+	t = trace_begin();
+	move_views();
+	trace_end("move_viewport", t, game_state.nviews);
+	audio_game_events();
 	
 	gdk_threads_enter();
-	gtk_widget_queue_draw(main_da);
+	capture_frame();	/* what the last expose drew */
+	update_minimap();
+	update_hud();
+	queue_dirty_rects();
 	nframes++;
 	gdk_threads_leave();
+	trace_end("advance_game", start, timer);
+	governor.work_usecs += usecs_now() - work_start;
 	if (in_the_process_of_quitting)
 		really_quit();
-	return TRUE;
+	return idle_after_tick(net != NULL || capture.filename != NULL);
 }
 
-int main(int argc, char *argv[])
+#ifdef BATTALLICA_BENCH
+
+/*****************************/
+/* benchmark code begins     */
+
+/* Built by "make bench" instead of the game: times the kernels the game */
+/* spends its time in, one at a time, with nothing drawn and nothing on */
+/* screen, against synthetic battles of a few sizes, and writes one CSV */
+/* line per kernel per size so runs from different commits can be diffed. */
+
+#define BENCH_MIN_USECS 200000	/* run each kernel for at least this long, see --usecs */
+#define BENCH_CHURN 64		/* slots freed and reallocated at a time */
+
+typedef long long bench_func(void);	/* does a bit of work, returns how many ops */
+
+static GtkWidget null_widget;	/* ->window is NULL, there's nothing to draw on */
+int bench_min_usecs = BENCH_MIN_USECS;
+
+static void null_line(GdkDrawable *drawable, GdkGC *gc, gint x1, gint y1, gint x2, gint y2)
+{
+}
+
+static void null_rectangle(GdkDrawable *drawable, GdkGC *gc, gboolean filled,
+	gint x, gint y, gint width, gint height)
+{
+}
+
+static void null_foreground(GdkGC *gc, const GdkColor *color)
+{
+}
+
+/* a random allocated slot which isn't the player, or -1 if there's none */
+static int bench_random_slot()
+{
+	int i, tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		i = randomn(highest_object_number + 1);
+		if (obj_allocated(i) && gobj(i)->otype != OBJ_TYPE_PLAYER)
+			return i;
+	}
+	return -1;
+}
+
+/* get rid of everything but player 0 */
+static void bench_clear()
 {
-	GtkWidget *vbox;
 	int i;
 
+	for (i = 0; i <= highest_object_number; i++)
+		if (obj_allocated(i) && gobj(i)->otype != OBJ_TYPE_PLAYER)
+			kill_object(gobj(i));
+	projectiles.n = 0;
+}
+
+/* A battle of n objects all over the map, about half of them soldiers */
+/* in 16 x 16 battalions and the rest enemies, the same every time. */
+static void bench_spawn(int n)
+{
+	int w = mapxdim * mapsquarewidth, h = mapydim * mapsquarewidth;
+
+	bench_clear();
+	sim_rng = DEFAULT_SEED;
+	while (live_objects - 1 + 16 * 16 + 1 <= n / 2 && battalion_type.count < MAX_BATTALIONS)
+		add_battalion(randomn(w), randomn(h), 16, 16, GREEN);
+	while (live_objects - 1 < n && enemy_type.count < MAX_ENEMIES)
+		add_enemy(randomn(w), randomn(h));
+	game_state.vp.x = w / 2 - SCREEN_WIDTH / 2;
+	game_state.vp.y = h / 2 - SCREEN_HEIGHT / 2;
+}
+
+/* free some slots here and there and find them again */
+static long long bench_find_free_obj()
+{
+	int slot[BENCH_CHURN], found[BENCH_CHURN], ontargetlist[BENCH_CHURN];
+	obj_handle_t next[BENCH_CHURN], prev[BENCH_CHURN];
+	struct game_obj_t *o;
+	int i, n, tries;
+
+	/* No slot is freed twice, so find_free_obj() is asked exactly once */
+	/* per cleared bit.  The slots are taken off the target list */
+	/* behind find_free_obj()'s back, and put back on afterwards. */
+	n = 0;
+	for (tries = 0; n < BENCH_CHURN && tries < 2 * BENCH_CHURN; tries++) {
+		slot[n] = bench_random_slot();
+		if (slot[n] < 0)
+			break;
+		if (!obj_allocated(slot[n]))
+			continue;
+		o = gobj(slot[n]);
+		next[n] = o->next;
+		prev[n] = o->prev;
+		ontargetlist[n] = o->ontargetlist;
+		o->next = o->prev = NO_OBJ;
+		o->ontargetlist = 0;
+		clearbit(&free_obj_bitmap[slot[n] >> 5], slot[n] & 31);
+		if ((slot[n] >> 5) < first_free_block)
+			first_free_block = slot[n] >> 5;
+		n++;
+	}
+	for (i = 0; i < n; i++)
+		found[i] = find_free_obj();
+
+	/* it may have come across other free slots first, so put the */
+	/* bitmap back just as it was */
+	for (i = 0; i < n; i++) {
+		if (found[i] < 0)
+			continue;
+		clearbit(&free_obj_bitmap[found[i] >> 5], found[i] & 31);
+		if ((found[i] >> 5) < first_free_block)
+			first_free_block = found[i] >> 5;
+	}
+	for (i = 0; i < n; i++) {
+		free_obj_bitmap[slot[i] >> 5] |= 1U << (slot[i] & 31);
+		o = gobj(slot[i]);
+		o->next = next[i];
+		o->prev = prev[i];
+		o->ontargetlist = ontargetlist[i];
+	}
+	return n;
+}
+
+/* take things off the target list and put them back */
+static long long bench_targets()
+{
+	struct game_obj_t *o;
+	int i, slot, n = 0;
+
+	for (i = 0; i < 16; i++) {
+		slot = bench_random_slot();
+		if (slot < 0)
+			break;
+		o = gobj(slot);
+		if (!o->ontargetlist)
+			continue;
+		remove_target(o);
+		add_target(o);
+		n++;
+	}
+	return n;
+}
+
+static long long bench_spin_points()
+{
+	struct my_point_t *points;
+
+	spin_points(player_points, NPOINTS(player_points), &points, NANGLES, 0, 0);
+	free(points);
+	return 1;
+}
+
+/* draw the terrain for a whole screen, somewhere on the map */
+static long long bench_terrain_cull()
+{
+	GdkRectangle area = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+
+	game_state.vp.x = randomn(mapxdim * mapsquarewidth) - SCREEN_WIDTH / 2;
+	game_state.vp.y = randomn(mapydim * mapsquarewidth) - SCREEN_HEIGHT / 2;
+	draw_terrain_area(&null_widget, &area);
+	return 1;
+}
+
+volatile int bench_impassable;	/* so the terrain lookups aren't optimized away */
+
+static void bench_count_impassable(int x, int y, struct terrain_descriptor_t *t, void *n)
+{
+	(*(int *) n)++;
+	bench_impassable += t->move_cost == 0;
+}
+
+/* "what's around this unit": the squares within 3 of a random square, */
+/* and its 8 neighbors one by one.  Ops are squares looked at. */
+static long long bench_terrain_around()
+{
+	int i, d, x, y, n = 0;
+	struct terrain_descriptor_t *t;
+
+	for (i = 0; i < 64; i++) {
+		x = randomn(mapxdim);
+		y = randomn(mapydim);
+		terrain_for_rect(x - 3, y - 3, x + 3, y + 3, bench_count_impassable, &n);
+		for (d = 0; d < 8; d++) {
+			t = terrain_neighbor(x, y, d);
+			bench_impassable += t == NULL || t->move_cost == 0;
+			n++;
+		}
+	}
+	return n;
+}
+
+/* sort a whole screen's worth of objects into the views' bins, with */
+/* the views in a given layout; ops are views */
+static long long bench_cull_views(int layout)
+{
+	GdkRectangle area = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+
+	if (view_layout != layout) {
+		set_view_layout(layout);
+		move_views();	/* point the new views at something */
+	}
+	cull_views(&area);
+	arena_reset(&frame_arena);
+	return game_state.nviews;
+}
+
+static long long bench_cull_1_view()
+{
+	return bench_cull_views(VIEWS_SINGLE);
+}
+
+static long long bench_cull_3_views()
+{
+	return bench_cull_views(VIEWS_TRIO);
+}
+
+static long long bench_generic_draw()
+{
+	struct game_obj_t *o;
+	int i, n = 0;
+
+	for (i = 0; i <= highest_object_number; i++) {
+		o = gobj(i);
+		if (!o->alive)
+			continue;
+		generic_draw(o, &null_widget);
+		n++;
+	}
+	return n;
+}
+
+static long long bench_move_loop()
+{
+	struct tick_command cmd[MAXPLAYERS];
+
+	memset(cmd, 0, sizeof(cmd));
+	simulate_tick(cmd);
+	return 1;
+}
+
+/* Leave a game with nothing going on in it but the player, run it */
+/* through advance_game() like the real thing, and check it stops ticking */
+/* and then uses next to no CPU, like one left sitting on a shared */
+/* machine would.  Returns 0 if it doesn't. */
+#define BENCH_IDLE_USECS 1000000	/* how long to watch it sleeping */
+#define BENCH_IDLE_MAX_CPU 1.0		/* percent */
+
+/* there's no window, so an invalidate goes straight round to what */
+/* main_da_expose() would have done about it */
+static int bench_expose_pending = 0;
+int bench_exposes = 0;
+
+static gboolean bench_expose(gpointer data)
+{
+	bench_expose_pending = 0;
+	bench_exposes++;
+	expose_wakes_game();
+	return FALSE;
+}
+
+static void bench_invalidate(GdkRectangle *r)
+{
+	if (bench_expose_pending)
+		return;
+	bench_expose_pending = 1;
+	g_idle_add(bench_expose, NULL);
+}
+
+static gboolean bench_idle_stop(gpointer data)
+{
+	g_main_loop_quit((GMainLoop *) data);
+	return FALSE;
+}
+
+static long long cpu_usecs_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int bench_idle()
+{
+	GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+	long long cpu, wall;
+	int ticks, exposes;
+	double percent;
+	struct game_obj_t *p;
+
+	bench_clear();
+	set_view_layout(VIEWS_PIP);	/* so the other views have to settle too */
+	hud_debug = 1;			/* and the HUD's counters */
+	if (obj_lookup(the_player) == NULL) {	/* the battles got it */
+		active_players &= ~(1U << local_player);
+		add_player(local_player);
+		game_state.vp.obj = the_player;
+	}
+	/* start the view over the player, or the time it takes to scroll */
+	/* there from wherever the battles left it counts against the test */
+	p = obj_lookup(the_player);
+	game_state.vp.x = p->x - SCREEN_WIDTH / 2;
+	game_state.vp.y = p->y - SCREEN_HEIGHT / 2;
+	invalidate_function = bench_invalidate;
+	full_redraw = 1;
+	tick_function = advance_game;
+	timer_tag = g_timeout_add(1000 / frame_rate_hz, tick_function, NULL);
+	g_timeout_add(2 * IDLE_TICKS * 1000 / frame_rate_hz + 500, bench_idle_stop, loop);
+	g_main_loop_run(loop);
+	if (!idle.sleeping) {
+		fprintf(stderr, "idle: FAILED, still ticking at tick %d\n", timer);
+		return 0;
+	}
+
+	ticks = timer;
+	exposes = bench_exposes;
+	cpu = cpu_usecs_now();
+	wall = usecs_now();
+	g_timeout_add(BENCH_IDLE_USECS / 1000, bench_idle_stop, loop);
+	g_main_loop_run(loop);
+	cpu = cpu_usecs_now() - cpu;
+	wall = usecs_now() - wall;
+	g_main_loop_unref(loop);
+	percent = 100.0 * cpu / wall;
+	fprintf(stderr, "idle: asleep at tick %d after %d exposes, then %d ticks and %.2f%% CPU in %.1f s\n",
+		ticks, exposes, timer - ticks, percent, wall / 1000000.0);
+	if (timer != ticks || percent > BENCH_IDLE_MAX_CPU) {
+		fprintf(stderr, "idle: FAILED, wanted no ticks and under %.1f%% CPU\n", BENCH_IDLE_MAX_CPU);
+		return 0;
+	}
+	return 1;
+}
+
+/* The bench is linked with -Wl,--wrap=malloc and friends (see the */
+/* Makefile), so every heap allocation made by the game's own code comes */
+/* through here and gets counted, whether game_malloc() saw it or not. */
+/* What GLib and libc allocate for themselves doesn't. */
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+volatile gint bench_heap_allocs = 0;
+
+void *__wrap_malloc(size_t n)
+{
+	g_atomic_int_inc(&bench_heap_allocs);
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	g_atomic_int_inc(&bench_heap_allocs);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+	g_atomic_int_inc(&bench_heap_allocs);
+	return __real_realloc(p, n);
+}
+
+/* Check that a busy battle, once it's settled down, ticks without */
+/* touching the heap.  Returns 0 if it doesn't.  The wrappers don't see */
+/* what libc allocates inside its own functions, qsort() of a big array */
+/* for one, so the tick mustn't call any such thing; ai_sort() is there */
+/* instead of qsort() for this. */
+#define BENCH_ALLOC_OBJECTS 10000
+#define BENCH_ALLOC_WARMUP 100	/* ticks for the arrays and arenas to reach their size */
+#define BENCH_ALLOC_TICKS 300
+
+static int bench_no_alloc()
+{
+	int i, before, allocs;
+
+	bench_spawn(BENCH_ALLOC_OBJECTS);
+	for (i = 0; i < BENCH_ALLOC_WARMUP; i++)
+		bench_move_loop();
+	before = g_atomic_int_get(&bench_heap_allocs);
+	for (i = 0; i < BENCH_ALLOC_TICKS; i++)
+		bench_move_loop();
+	allocs = g_atomic_int_get(&bench_heap_allocs) - before;
+	fprintf(stderr, "alloc: %d heap allocations in %d ticks of a %d object battle\n",
+		allocs, BENCH_ALLOC_TICKS, BENCH_ALLOC_OBJECTS);
+	if (allocs) {
+		fprintf(stderr, "alloc: FAILED, wanted none\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Nothing in the game reads the height and owner planes yet, so check */
+/* here that terrain_height_at() and terrain_owner() find what */
+/* put_terrain() and set_terrain_owner() put in the Morton ordered */
+/* blocks, for every square.  Returns 0 if they don't. */
+static int bench_terrain_planes()
+{
+	int x, y, bad = 0;
+
+	for (y = 0; y < mapydim; y++)
+		for (x = 0; x < mapxdim; x++) {
+			if (terrain_height_at(x * mapsquarewidth + mapsquarewidth - 1,
+					y * mapsquarewidth) != terrain_at(x, y)->height)
+				bad++;
+			set_terrain_owner(x, y, (x * 7 + y) % (NSIDES + 1));
+		}
+	for (y = 0; y < mapydim; y++)
+		for (x = 0; x < mapxdim; x++) {
+			if (terrain_owner(x, y) != (x * 7 + y) % (NSIDES + 1))
+				bad++;
+			set_terrain_owner(x, y, 0);
+		}
+	if (terrain_height_at(-1, 0) != 0 || terrain_height_at(0, mapydim * mapsquarewidth) != 0)
+		bad++;
+	fprintf(stderr, "terrain: %d bad reads of the height and owner planes\n", bad);
+	if (bad) {
+		fprintf(stderr, "terrain: FAILED, wanted none\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Enemies reloading is all the game puts on the timer wheel so far, */
+/* and it never cancels anything or looks far ahead, so check the rest */
+/* here: events up to three levels out, some called off by id and some */
+/* by their object dying, a few hundred due on the same tick, and an */
+/* old id which mustn't cancel its slot's next event.  Everything not */
+/* called off should run once, on time.  Returns 0 if not. */
+#define BENCH_TW_EVENTS 2000
+#define BENCH_TW_SAME_TICK 500	/* the first this many are all due at once */
+#define BENCH_TW_SPREAD (TW_SIZE * TW_SIZE + 1000)
+
+static int bench_tw_ran[BENCH_TW_EVENTS], bench_tw_runs[BENCH_TW_EVENTS];
+
+static void bench_tw_event(struct game_obj_t *o, int arg)
+{
+	bench_tw_ran[arg] = timer;
+	bench_tw_runs[arg]++;
+}
+
+static int bench_timer_wheel()
+{
+	static int id[BENCH_TW_EVENTS], due[BENCH_TW_EVENTS];
+	int i, obj, delay, start, together = 0, batch = 0, bad = 0;
+
+	bench_clear();
+	sim_register(&sim_event_funcs, (void *) bench_tw_event);
+	start = timer;
+	for (i = 0; i < BENCH_TW_EVENTS; i++) {
+		delay = i < BENCH_TW_SAME_TICK ? 100 : (i * 37) % BENCH_TW_SPREAD + 1;
+		obj = i % 3 ? i % 50 + 1 : -1;
+		id[i] = schedule_timer_event(obj, delay, bench_tw_event, i);
+		due[i] = start + delay;
+		bench_tw_ran[i] = -1;
+		bench_tw_runs[i] = 0;
+	}
+	for (obj = 1; obj <= 10; obj++)
+		cancel_obj_timer_events(obj);
+	for (i = 0; i < BENCH_TW_EVENTS; i++) {
+		obj = i % 3 ? i % 50 + 1 : -1;
+		if (i % 7 == 0)
+			cancel_timer_event(id[i]);
+		if (i % 7 == 0 || (obj >= 1 && obj <= 10))
+			due[i] = -1;
+		else if (i < BENCH_TW_SAME_TICK)
+			together++;
+	}
+
+	while (timer < start + BENCH_TW_SPREAD + 1) {
+		timer++;
+		run_timer_events();
+		if (timer == start + 100)
+			batch = timer_wheel.nbatch;
+	}
+	for (i = 0; i < BENCH_TW_EVENTS; i++)
+		if (bench_tw_runs[i] != (due[i] >= 0) || bench_tw_ran[i] != due[i])
+			bad++;
+	if (batch < together)
+		bad++;
+
+	/* every id above is stale now, and the new event likely reuses */
+	/* one of their slots */
+	bench_tw_runs[0] = 0;
+	schedule_timer_event(-1, 1, bench_tw_event, 0);
+	for (i = 0; i < BENCH_TW_EVENTS; i++)
+		cancel_timer_event(id[i]);
+	timer++;
+	run_timer_events();
+	if (bench_tw_runs[0] != 1 || timer_wheel.pending != 0)
+		bad++;
+
+	fprintf(stderr, "timer wheel: %d of %d events together in a batch, %d bad\n",
+		batch, together, bad);
+	if (bad) {
+		fprintf(stderr, "timer wheel: FAILED, wanted none bad\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* run f for at least bench_min_usecs, then write how it went.  The */
+/* first go isn't counted, it's often different (the first tick after */
+/* spawning sorts everything for sweep and prune from scratch, say). */
+static void bench_kernel(FILE *out, const char *name, int n, bench_func *f)
+{
+	long long ops = 0, start, usecs;
+	int spawned = live_objects - 1;
+
+	f();
+	start = usecs_now();
+	do {
+		ops += f();
+		usecs = usecs_now() - start;
+	} while (usecs < bench_min_usecs);
+	fprintf(out, "%s,%d,%d,%lld,%lld,%.1f\n", name, n, spawned, ops, usecs,
+		ops ? usecs * 1000.0 / ops : 0.0);
+	fflush(out);
+	fprintf(stderr, "%-16s %7d objects  %12.1f ns/op\n", name, n,
+		ops ? usecs * 1000.0 / ops : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 1000, 10000, 100000 };
+	int i, ok, nthreads = 1;
+	char *outfile = "bench.csv";
+	FILE *out;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outfile = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--usecs") == 0 && i + 1 < argc) {
+			bench_min_usecs = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			nthreads = atoi(argv[++i]);
+			continue;
+		}
+		fprintf(stderr, "battallica-bench: unknown option '%s'\n", argv[i]);
+		fprintf(stderr, "usage: battallica-bench [--out file.csv] [--usecs n] [--threads n]\n");
+		exit(1);
+	}
+	out = strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "w");
+	if (out == NULL) {
+		fprintf(stderr, "battallica-bench: can't write %s: %s\n", outfile, strerror(errno));
+		exit(1);
+	}
+
+	xscale_screen = 1.0;
+	yscale_screen = 1.0;
+	current_draw_line = null_line;
+	current_draw_rectangle = null_rectangle;
+	current_set_foreground = null_foreground;
+
+	/* the same thinking every run, however fast the machine */
+	ai.budget_usecs = 0;
+	ai.max_thinks = DEFAULT_NET_AI_THINKS;
+
+	init_arena(&tick_arena, TICK_ARENA_SIZE);
+	init_arena(&frame_arena, FRAME_ARENA_SIZE);
+	init_obj_arena();
+	init_obj_types();
+	init_sim_tables();
+	init_timer_wheel();
+	init_projectiles(DEFAULT_MAX_PROJECTILES);
+	init_terrain_types();
+	init_vects();
+	init_players(1);
+	init_game_state(obj_lookup(the_player));
+	build_terrain();
+	init_influence();
+	init_hud();
+	if (!g_thread_supported ())
+		g_thread_init(NULL);
+	init_workers(nthreads);
+
+	fprintf(out, "kernel,objects,spawned,ops,usecs,ns_per_op\n");
+	for (i = 0; i < (int) NPOINTS(sizes); i++) {
+		bench_spawn(sizes[i]);
+		bench_kernel(out, "find_free_obj", sizes[i], bench_find_free_obj);
+		bench_kernel(out, "target_list", sizes[i], bench_targets);
+		bench_kernel(out, "spin_points", sizes[i], bench_spin_points);
+		bench_kernel(out, "terrain_cull", sizes[i], bench_terrain_cull);
+		bench_kernel(out, "terrain_around", sizes[i], bench_terrain_around);
+		bench_kernel(out, "cull_1_view", sizes[i], bench_cull_1_view);
+		bench_kernel(out, "cull_3_views", sizes[i], bench_cull_3_views);
+		set_view_layout(VIEWS_SINGLE);
+		bench_kernel(out, "generic_draw", sizes[i], bench_generic_draw);
+		bench_kernel(out, "move_loop", sizes[i], bench_move_loop);
+	}
+	if (out != stdout)
+		fclose(out);
+	ok = bench_no_alloc();
+	if (!bench_terrain_planes())
+		ok = 0;
+	if (!bench_timer_wheel())
+		ok = 0;
+	if (!bench_idle())
+		ok = 0;
+	return ok ? 0 : 1;
+}
+
+/* benchmark code ends       */
+/*****************************/
+
+#else
+
+int main(int argc, char *argv[])
+{
+	GtkWidget *vbox, *hbox;
+	int i, n, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int net_id = 0, npeers = 0, nplayers = 0;
+	int loopback_peers = 0, loopback_frames = 900, loopback_latency = 50, loopback_loss = 0;
+	char *net_peers = NULL, *audio_spec = NULL;
+	struct sim_buf *baseline;
+
 	real_screen_width = SCREEN_WIDTH;
 	real_screen_height = SCREEN_HEIGHT;
+	xscale_screen = 1.0;
+	yscale_screen = 1.0;
+
+	/* the loopback test runs without a display */
+	for (i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--loopback") == 0)
+			break;
+	if (i >= argc) {
+		gtk_set_locale();
+		gtk_init (&argc, &argv);
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--max-objects") == 0 && i + 1 < argc) {
+			max_objects = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			nthreads = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--ai-budget") == 0 && i + 1 < argc) {
+			ai.budget_usecs = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--ai-thinks") == 0 && i + 1 < argc) {
+			ai.max_thinks = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			sim_rng = strtoul(argv[++i], NULL, 0);
+			if (sim_rng == 0)
+				sim_rng = DEFAULT_SEED;
+			continue;
+		}
+		if (strcmp(argv[i], "--net-id") == 0 && i + 1 < argc) {
+			net_id = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--net-peers") == 0 && i + 1 < argc) {
+			net_peers = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--net-players") == 0 && i + 1 < argc) {
+			nplayers = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc) {
+			input_delay = atoi(argv[++i]);
+			if (input_delay < 0)
+				input_delay = 0;
+			if (input_delay > NET_MAX_CMDS / 2)
+				input_delay = NET_MAX_CMDS / 2;
+			continue;
+		}
+		if (strcmp(argv[i], "--loopback") == 0 && i + 1 < argc) {
+			loopback_peers = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--loopback-frames") == 0 && i + 1 < argc) {
+			loopback_frames = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--loopback-latency") == 0 && i + 1 < argc) {
+			loopback_latency = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--loopback-loss") == 0 && i + 1 < argc) {
+			loopback_loss = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--trace") == 0) {
+			tracing = 1;
+			trace_always = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--trace-seconds") == 0 && i + 1 < argc) {
+			trace_seconds = atoi(argv[++i]);
+			continue;
+		}
+		if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+			quality = atoi(argv[++i]);
+			if (quality < QUALITY_FULL || quality > QUALITY_LOWEST) {
+				fprintf(stderr, "battallica: --quality wants %d to %d\n",
+					QUALITY_FULL, QUALITY_LOWEST);
+				exit(1);
+			}
+			governor.fixed = 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) {
+			view_layout_requested = atoi(argv[++i]);
+			if (view_layout_requested < 0 || view_layout_requested >= NVIEW_LAYOUTS) {
+				fprintf(stderr, "battallica: --views wants 0 (one) 1 (picture in picture)"
+					" 2 (split) or 3 (three)\n");
+				exit(1);
+			}
+			continue;
+		}
+		if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+			audio_spec = argv[++i];
+			continue;
+		}
+		if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			capture.filename = argv[++i];
+			n = strlen(capture.filename);
+			capture.raw = n > 4 && strcmp(capture.filename + n - 4, ".rgb") == 0;
+			continue;
+		}
+		fprintf(stderr, "battallica: unknown option '%s'\n", argv[i]);
+		fprintf(stderr, "usage: battallica [--max-objects n] [--threads n] [--ai-budget usecs]\n"
+			"	[--ai-thinks n] [--seed n]\n"
+			"	[--net-id k --net-peers host:port,host:port,... [--net-players n]]\n"
+			"	[--input-delay ticks]\n"
+			"	[--loopback players [--loopback-frames n] [--loopback-latency ms]\n"
+			"		[--loopback-loss percent]]\n"
+			"	[--trace] [--trace-seconds n] [--capture file.y4m|file.rgb]\n"
+			"	[--quality 0-4] [--audio null|wav:file|oss[:device]] [--views 0-3]\n");
+		exit(1);
+	}
+
+	/* Networked, player 0 and the first nplayers are in from the start, */
+	/* the rest join later.  In the loopback test everybody but the last. */
+	if (net_peers) {
+		npeers = init_udp(net_peers, net_id);
+		local_player = net_id;
+		if (nplayers <= 0 || nplayers > npeers)
+			nplayers = npeers;
+	} else if (loopback_peers) {
+		if (loopback_peers < 1 || loopback_peers > MAXPLAYERS) {
+			fprintf(stderr, "battallica: --loopback wants 1 to %d players\n", MAXPLAYERS);
+			exit(1);
+		}
+		nplayers = loopback_peers > 1 ? loopback_peers - 1 : 1;
+	} else
+		nplayers = 1;
+	if (net_peers || loopback_peers) {
+		/* the clock differs from machine to machine, a count doesn't */
+		ai.budget_usecs = 0;
+		if (ai.max_thinks == 0)
+			ai.max_thinks = DEFAULT_NET_AI_THINKS;
+	}
 
-	gtk_set_locale();
-	gtk_init (&argc, &argv);
+	trace_register_thread("game");
+	signal(SIGUSR1, trace_signal);
 
 	init_keymap();
+	init_arena(&tick_arena, TICK_ARENA_SIZE);
+	init_arena(&frame_arena, FRAME_ARENA_SIZE);
+	init_obj_arena();
+	init_obj_types();
+	init_sim_tables();
+	init_timer_wheel();
+	init_projectiles(DEFAULT_MAX_PROJECTILES);
 	init_terrain_types();
 	init_vects();
-	init_player();
-	init_game_state(the_player);
+	init_players(nplayers);
+	init_game_state(obj_lookup(the_player) ? obj_lookup(the_player) : obj_lookup(player_obj[0]));
 
 	build_terrain();
+	init_minimap();
+	init_hud();
+	init_influence();
+	add_demo_battalions();
+	add_demo_enemies(300);
+
+	if (loopback_peers) {
+		if (!g_thread_supported ())
+			g_thread_init(NULL);
+		init_workers(nthreads);
+		exit(run_loopback(loopback_peers, loopback_frames, loopback_latency, loopback_loss));
+	}
+	if (net_peers) {
+		baseline = (struct sim_buf *) game_malloc(ALLOC_NET, sizeof(*baseline));
+		memset(baseline, 0, sizeof(*baseline));
+		save_sim(baseline);
+		net = new_lockstep(net_id, npeers, input_delay, baseline, udp_send, udp_recv);
+	}
 
 	window = gtk_window_new (GTK_WINDOW_TOPLEVEL);		
 	gtk_container_set_border_width (GTK_CONTAINER (window), 0);
 	vbox = gtk_vbox_new(FALSE, 0);
+	hbox = gtk_hbox_new(FALSE, 0);
         main_da = gtk_drawing_area_new();
+	minimap_da = gtk_drawing_area_new();
+	gtk_widget_set_size_request(minimap_da,
+		mapxdim * MINIMAP_TILE_PIXELS, mapydim * MINIMAP_TILE_PIXELS);
 
 	g_signal_connect (G_OBJECT (window), "delete_event",
 		G_CALLBACK (delete_event), NULL);
@@ -1298,6 +9452,8 @@ int main(int argc, char *argv[])
 		G_CALLBACK (main_da_expose), NULL);
         g_signal_connect(G_OBJECT (main_da), "configure_event",
 		G_CALLBACK (main_da_configure), NULL);
+	g_signal_connect(G_OBJECT (minimap_da), "expose_event",
+		G_CALLBACK (minimap_expose), NULL);
 
 	gdk_color_parse("white", &huex[WHITE]);
 	gdk_color_parse("blue", &huex[BLUE]);
@@ -1311,14 +9467,20 @@ int main(int argc, char *argv[])
 	gdk_color_parse("MAGENTA", &huex[MAGENTA]);
 
 	gtk_container_add (GTK_CONTAINER (window), vbox);
-	gtk_box_pack_start(GTK_BOX (vbox), main_da, TRUE /* expand */, TRUE /* fill */, 0);
+	gtk_box_pack_start(GTK_BOX (vbox), hbox, TRUE /* expand */, TRUE /* fill */, 0);
+	gtk_box_pack_start(GTK_BOX (hbox), main_da, TRUE /* expand */, TRUE /* fill */, 0);
+	gtk_box_pack_start(GTK_BOX (hbox), minimap_da, FALSE /* expand */, FALSE /* fill */, 0);
 
 	gtk_widget_modify_bg(main_da, GTK_STATE_NORMAL, &huex[BLACK]);
+	gtk_widget_modify_bg(minimap_da, GTK_STATE_NORMAL, &huex[BLACK]);
 
-        gtk_window_set_default_size(GTK_WINDOW(window), real_screen_width, real_screen_height);
+        gtk_window_set_default_size(GTK_WINDOW(window),
+		real_screen_width + mapxdim * MINIMAP_TILE_PIXELS, real_screen_height);
 
         gtk_widget_show (vbox);
+        gtk_widget_show (hbox);
         gtk_widget_show (main_da);
+        gtk_widget_show (minimap_da);
         gtk_widget_show (window);
 
 	for (i=0;i<NCOLORS+NSPARKCOLORS + NRAINBOWCOLORS;i++)
@@ -1326,8 +9488,10 @@ int main(int argc, char *argv[])
         gc = gdk_gc_new(GTK_WIDGET(main_da)->window);
         gdk_gc_set_foreground(gc, &huex[BLUE]);
         gdk_gc_set_foreground(gc, &huex[WHITE]);
+	realize_minimap();
 
-	timer_tag = g_timeout_add(1000 / frame_rate_hz, advance_game, NULL);
+	tick_function = advance_game;
+	timer_tag = g_timeout_add(1000 / frame_rate_hz, tick_function, NULL);
 
 	/* Apparently (some versions of?) portaudio calls g_thread_init(). */
 	/* It may only be called once, and subsequent calls abort, so */
@@ -1335,9 +9499,15 @@ int main(int argc, char *argv[])
 	if (!g_thread_supported ())
 		g_thread_init(NULL);
 	gdk_threads_init();
+	init_workers(nthreads);
+	start_influence_thread();
+	if (audio_spec)
+		init_audio(audio_spec);
 
 	gettimeofday(&start_time, NULL);
 
 	gtk_main ();
 	return 0;
 }
+
+#endif